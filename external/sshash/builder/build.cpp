@@ -12,7 +12,7 @@
 
 namespace sshash {
 
-void dictionary::build(std::string const& filename, build_configuration const& build_config) {
+void dictionary::init(build_configuration const& build_config) {
     /* Validate the build configuration. */
     if (build_config.k == 0) throw std::runtime_error("k must be > 0");
     if (build_config.k > constants::max_k) {
@@ -34,20 +34,37 @@ void dictionary::build(std::string const& filename, build_configuration const& b
     m_seed = build_config.seed;
     m_canonical_parsing = build_config.canonical_parsing;
     m_skew_index.min_log2 = build_config.l;
+}
+
+void dictionary::build(std::string const& filename, build_configuration const& build_config) {
+    init(build_config);
+    essentials::timer_type timer;
+    timer.start();
+    parse_data data = parse_file(filename, build_config);
+    timer.stop();
+    print_time(timer.elapsed(), data.num_kmers, "step 1: 'parse_file'");
+    build(data, build_config, timer.elapsed());
+}
+
+void dictionary::build(std::istream& is, build_configuration const& build_config) {
+    init(build_config);
+    essentials::timer_type timer;
+    timer.start();
+    parse_data data(build_config.tmp_dirname);
+    parse_file(is, data, build_config);
+    timer.stop();
+    print_time(timer.elapsed(), data.num_kmers, "step 1: 'parse_file'");
+    build(data, build_config, timer.elapsed());
+}
 
+void dictionary::build(parse_data& data, build_configuration const& build_config,
+                       double parse_time) {
     std::vector<double> timings;
     timings.reserve(5);
+    timings.push_back(parse_time);
     essentials::timer_type timer;
 
-    /* step 1: parse the input file and build compact string pool ***/
-    timer.start();
-    parse_data data = parse_file(filename, build_config);
     m_size = data.num_kmers;
-    timer.stop();
-    timings.push_back(timer.elapsed());
-    print_time(timings.back(), data.num_kmers, "step 1: 'parse_file'");
-    timer.reset();
-    /******/
 
     if (build_config.weighted) {
         /* step 1.1: compress weights ***/
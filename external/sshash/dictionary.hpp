@@ -8,12 +8,17 @@
 
 namespace sshash {
 
+struct parse_data;
+
 struct dictionary {
     dictionary() : m_size(0), m_seed(0), m_k(0), m_m(0), m_canonical_parsing(0) {}
 
     /* Build from input file. */
     void build(std::string const& input_filename, build_configuration const& build_config);
 
+    /* Build from input stream (FASTA with one sequence per line, not compressed). */
+    void build(std::istream& is, build_configuration const& build_config);
+
     /* Write super-k-mers to output file in FASTA format. */
     void dump(std::string const& output_filename) const;
 
@@ -151,6 +156,9 @@ private:
     skew_index m_skew_index;
     weights m_weights;
 
+    void build(parse_data& data, build_configuration const& build_config, double parse_time);
+    void init(build_configuration const& build_config);
+
     lookup_result lookup_uint_regular_parsing(kmer_t uint_kmer) const;
     lookup_result lookup_uint_canonical_parsing(kmer_t uint_kmer) const;
     void forward_neighbours(kmer_t suffix, neighbourhood& res, bool check_reverse_complement) const;
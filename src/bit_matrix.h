@@ -0,0 +1,233 @@
+#ifndef KM_BIT_MATRIX_H
+#define KM_BIT_MATRIX_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+// presence/absence rows packed in 64-bit words: bit j of a row is sample j
+
+static inline std::size_t bit_row_words(std::size_t n_samples) {
+  return (n_samples + 63) / 64;
+}
+
+
+// number of bits set in a row of nb_bytes bytes (as stored in kmtricks PA matrices)
+static inline std::size_t popcount_bytes(const uint8_t *row, std::size_t nb_bytes) {
+  std::size_t n = 0, i = 0;
+  for (; i + 8 <= nb_bytes; i += 8) {
+    uint64_t word;
+    memcpy(&word, row+i, 8);
+    n += __builtin_popcountll(word);
+  }
+  for (; i < nb_bytes; ++i) { n += __builtin_popcount(row[i]); }
+  return n;
+}
+
+
+// pack the values of a text matrix line (starting from its second column) in a row of
+// presence bits, any value other than 0 meaning presence; returns the number of values
+static inline std::size_t parse_bit_row(const char *values, uint64_t *row) {
+  std::size_t col = 0;
+  const char *p = values;
+  while (true) {
+    while (*p == ' ' || *p == '\t') { ++p; }
+    if (*p == '\0' || *p == '\n') { break; }
+    bool present = false;
+    for (; *p != '\0' && *p != ' ' && *p != '\t' && *p != '\n'; ++p) {
+      present |= (*p != '0' && *p != '.');
+    }
+    if (present) { row[col/64] |= uint64_t{1} << (col%64); }
+    col++;
+  }
+  return col;
+}
+
+
+// set in a row of bit_row_words(n) words the bits j such that counts[j] >= min_count
+static inline void threshold_bit_row(const uint32_t *counts, std::size_t n, uint32_t min_count, uint64_t *row) {
+  std::fill(row, row + bit_row_words(n), 0);
+  std::size_t j = 0;
+#if defined(__AVX2__)
+  // counts[j] >= min_count iff max(counts[j], min_count) == counts[j] (unsigned), 8 counts at a time
+  const __m256i t = _mm256_set1_epi32((int)min_count);
+  for (; j + 8 <= n; j += 8) {
+    __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(counts + j));
+    __m256i ge = _mm256_cmpeq_epi32(_mm256_max_epu32(c, t), c);
+    row[j/64] |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(ge))) << (j%64);
+  }
+#endif
+  for (; j < n; ++j) {
+    if (counts[j] >= min_count) { row[j/64] |= uint64_t{1} << (j%64); }
+  }
+}
+
+
+// add to counts[j] the number of rows, among the nb_rows consecutive rows of nb_words
+// words, whose bit j is set (a "positional" popcount over the columns of a bit matrix)
+// counts must have room for 64*nb_words elements
+static inline void column_popcount(const uint64_t *rows, std::size_t nb_rows, std::size_t nb_words, uint32_t *counts) {
+#if defined(__AVX2__)
+  // each 32-bit chunk of a row is expanded so that byte j of a 256-bit register is 0xFF
+  // iff bit j is set; 8-bit counters are accumulated for up to 255 rows at a time
+  const __m256i shuffle = _mm256_setr_epi8(
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i bits = _mm256_set1_epi64x(0x8040201008040201ULL);
+  alignas(32) uint8_t acc8[32];
+  for (std::size_t w = 0; w < nb_words; ++w) {
+    for (std::size_t half = 0; half < 2; ++half) {
+      uint32_t *cnt = counts + 64*w + 32*half;
+      for (std::size_t first = 0; first < nb_rows; first += 255) {
+        std::size_t last = first + 255 < nb_rows ? first + 255 : nb_rows;
+        __m256i acc = _mm256_setzero_si256();
+        for (std::size_t r = first; r < last; ++r) {
+          uint32_t chunk = (uint32_t)(rows[r*nb_words+w] >> (32*half));
+          if (chunk == 0) { continue; }
+          __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32((int)chunk), shuffle);
+          __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), bits);
+          acc = _mm256_sub_epi8(acc, set);
+        }
+        _mm256_store_si256(reinterpret_cast<__m256i*>(acc8), acc);
+        for (std::size_t j = 0; j < 32; ++j) { cnt[j] += acc8[j]; }
+      }
+    }
+  }
+#else
+  for (std::size_t r = 0; r < nb_rows; ++r) {
+    for (std::size_t w = 0; w < nb_words; ++w) {
+      for (uint64_t word = rows[r*nb_words+w]; word; word &= word - 1) {
+        counts[64*w + __builtin_ctzll(word)]++;
+      }
+    }
+  }
+#endif
+}
+
+
+// number of bits set in the intersection of two rows of nb_words words
+static inline std::size_t and_popcount(const uint64_t *a, const uint64_t *b, std::size_t nb_words) {
+  std::size_t n = 0, i = 0;
+#if defined(__AVX2__)
+  // popcount of each byte by looking up its two nibbles, bytes summed in 64-bit lanes
+  const __m256i lut = _mm256_setr_epi8(
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 4 <= nb_words; i += 4) {
+    __m256i v = _mm256_and_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i)),
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i)));
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low_mask));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+  }
+  alignas(32) uint64_t lanes[4];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  n = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i < nb_words; ++i) { n += __builtin_popcountll(a[i] & b[i]); }
+  return n;
+}
+
+
+// sample-major presence/absence matrix: one row of bits per sample, whose bit i is set iff
+// the i-th unitig (row of the unitig matrix) is present in the sample
+//
+// file layout: magic, number of samples and of unitigs (uint64_t), then the name of each
+// sample (uint32_t length followed by its characters, possibly empty) and the rows of bits
+static const char BIT_MATRIX_MAGIC[8] = { 'K', 'M', 'B', 'I', 'T', 'M', 'T', '1' };
+
+struct sample_bit_matrix {
+  std::size_t nb_samples{0};
+  std::size_t nb_unitigs{0};
+  std::vector<std::string> names;
+  std::vector<uint64_t> bits;
+  std::size_t stride{0}; // words allocated per row, at least words() (more while unitigs are appended)
+
+  sample_bit_matrix() = default;
+  sample_bit_matrix(std::size_t n_samples, std::size_t n_unitigs)
+    : nb_samples(n_samples), nb_unitigs(n_unitigs), names(n_samples), bits(n_samples * bit_row_words(n_unitigs), 0),
+      stride(bit_row_words(n_unitigs)) {}
+
+  std::size_t words() const { return bit_row_words(nb_unitigs); }
+  uint64_t* row(std::size_t s) { return bits.data() + s * stride; }
+  const uint64_t* row(std::size_t s) const { return bits.data() + s * stride; }
+
+  // thread-safe when different threads set bits of the same word
+  void set(std::size_t s, std::size_t utg_id) {
+    __atomic_fetch_or(row(s) + utg_id/64, uint64_t{1} << (utg_id%64), __ATOMIC_RELAXED);
+  }
+
+  // append a unitig, whose presence in sample s is given by present(s)
+  // (the rows grow geometrically, so that appending n unitigs copies O(n) words per sample)
+  template <typename Predicate>
+  void push_back(Predicate present) {
+    if (nb_unitigs == stride * 64) { restride(std::max<std::size_t>(1, 2 * stride)); }
+    std::size_t utg_id = nb_unitigs++;
+    for (std::size_t s = 0; s < nb_samples; ++s) {
+      if (present(s)) { row(s)[utg_id/64] |= uint64_t{1} << (utg_id%64); }
+    }
+  }
+
+  bool save(const std::string &fname) const {
+    FILE *fp = fopen(fname.c_str(), "wb");
+    if (fp == NULL) { return false; }
+    uint64_t dims[2] = { nb_samples, nb_unitigs };
+    fwrite(BIT_MATRIX_MAGIC, 1, sizeof(BIT_MATRIX_MAGIC), fp);
+    fwrite(dims, sizeof(uint64_t), 2, fp);
+    for (std::size_t s = 0; s < nb_samples; ++s) {
+      uint32_t len = s < names.size() ? names[s].size() : 0;
+      fwrite(&len, sizeof(len), 1, fp);
+      if (len) { fwrite(names[s].data(), 1, len, fp); }
+    }
+    for (std::size_t s = 0; s < nb_samples; ++s) { fwrite(row(s), sizeof(uint64_t), words(), fp); }
+    bool ok = !ferror(fp);
+    return (fclose(fp) == 0) && ok;
+  }
+
+  bool load(const std::string &fname) {
+    FILE *fp = fopen(fname.c_str(), "rb");
+    if (fp == NULL) { return false; }
+    char magic[8];
+    uint64_t dims[2];
+    bool ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, BIT_MATRIX_MAGIC, sizeof(magic)) == 0
+           && fread(dims, sizeof(uint64_t), 2, fp) == 2;
+    if (ok) {
+      nb_samples = dims[0]; nb_unitigs = dims[1];
+      names.assign(nb_samples, "");
+      for (std::size_t s = 0; ok && s < nb_samples; ++s) {
+        uint32_t len;
+        ok = fread(&len, sizeof(len), 1, fp) == 1;
+        names[s].resize(ok ? len : 0);
+        ok = ok && fread(names[s].data(), 1, len, fp) == len;
+      }
+      stride = words();
+      bits.resize(nb_samples * stride);
+      ok = ok && fread(bits.data(), sizeof(uint64_t), bits.size(), fp) == bits.size();
+    }
+    fclose(fp);
+    return ok;
+  }
+
+private:
+  void restride(std::size_t new_stride) {
+    std::vector<uint64_t> grown(nb_samples * new_stride, 0);
+    for (std::size_t s = 0; s < nb_samples; ++s) { memcpy(grown.data() + s*new_stride, row(s), words()*sizeof(uint64_t)); }
+    bits.swap(grown);
+    stride = new_stride;
+  }
+};
+
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef KM_COLUMNS_H
+#define KM_COLUMNS_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+// projection of the rows of a text matrix (k-mer matrix, unitig matrix, or csv matrix written by
+// "kmat_tools convert") on a subset of its sample columns, fields being separated by a single
+// space, tab or comma: only the delimiters up to the last selected column are located, and the
+// fields are copied without being parsed
+
+static inline bool is_field_delim(char c) { return c == ' ' || c == '\t' || c == ','; }
+
+// offsets of the first n delimiters of [p,end) (fewer if there are fewer), i.e. the ends of
+// the first n fields; returns their number
+static inline std::size_t find_field_delims(const char *p, const char *end, std::size_t n, uint32_t *pos) {
+  const char *begin = p;
+  std::size_t found = 0;
+#if defined(__AVX2__)
+  const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), comma = _mm256_set1_epi8(',');
+  for (; p + 32 <= end && found < n; p += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i d = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)), _mm256_cmpeq_epi8(v, comma));
+    for (uint32_t mask = _mm256_movemask_epi8(d); mask && found < n; mask &= mask - 1) {
+      pos[found++] = (p - begin) + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), comma = _mm_set1_epi8(',');
+  for (; p + 16 <= end && found < n; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i d = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)), _mm_cmpeq_epi8(v, comma));
+    for (uint32_t mask = _mm_movemask_epi8(d); mask && found < n; mask &= mask - 1) {
+      pos[found++] = (p - begin) + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; p < end && found < n; ++p) {
+    if (is_field_delim(*p)) { pos[found++] = p - begin; }
+  }
+  return found;
+}
+
+
+// a value is zero if it only has '0', '.' and ';' characters (e.g. "0", "0.00;0.00")
+static inline bool is_zero_field(const char *p, const char *end) {
+  for (; p < end; ++p) {
+    if (*p != '0' && *p != '.' && *p != ';') { return false; }
+  }
+  return true;
+}
+
+
+struct column_projection {
+  std::size_t lead{1};            // leading columns always kept (row name, ...)
+  std::vector<uint32_t> cols;     // selected sample columns (0-based, after the leading ones), in output order
+  bool drop_zero{false};          // skip rows whose selected values are all zero
+
+  // append to out the projection of the row [p,end) (without its newline), followed by a newline
+  // returns 0 if the row was written, 1 if it was skipped (all zero), -1 if it has too few columns
+  int project(const char *p, const char *end, std::string &out, std::vector<uint32_t> &delims) const {
+    std::size_t need = lead + m_max_col + 1;
+    delims.resize(need);
+    std::size_t found = find_field_delims(p, end, need, delims.data());
+    if (found + 1 < need) { return -1; }
+
+    auto field_begin = [&](std::size_t f) { return f == 0 ? p : p + delims[f-1] + 1; };
+    auto field_end = [&](std::size_t f) { return f < found ? p + delims[f] : end; };
+
+    if (drop_zero) {
+      bool zero = true;
+      for (uint32_t c : cols) { zero &= is_zero_field(field_begin(lead+c), field_end(lead+c)); }
+      if (zero) { return 1; }
+    }
+
+    out.append(p, field_end(lead-1));
+    for (uint32_t c : cols) {
+      out.push_back(*field_end(lead-1));  // same delimiter as the input
+      out.append(field_begin(lead+c), field_end(lead+c));
+    }
+    out.push_back('\n');
+    return 0;
+  }
+
+  // parse a list of columns: comma-separated 0-based sample indexes, ranges "i-j" or sample names
+  // (looked up in names, e.g. the header of the matrix), or the name of a file with one per line
+  bool parse(const std::string &spec, const std::vector<std::string> &names, std::string &error) {
+    std::vector<std::string> items;
+    std::ifstream file(spec);
+    if (file.good()) {
+      for (std::string item; std::getline(file, item); ) {
+        if (!item.empty() && item.back() == '\r') { item.pop_back(); }
+        if (!item.empty()) { items.push_back(item); }
+      }
+    } else {
+      std::size_t start = 0;
+      for (std::size_t comma; (comma = spec.find(',', start)) != std::string::npos; start = comma + 1) {
+        items.push_back(spec.substr(start, comma - start));
+      }
+      items.push_back(spec.substr(start));
+    }
+
+    cols.clear();
+    for (const std::string &item : items) {
+      char *end;
+      unsigned long i = strtoul(item.c_str(), &end, 10);
+      if (!item.empty() && isdigit(item[0]) && *end == '\0') {
+        cols.push_back(i);
+      } else if (!item.empty() && isdigit(item[0]) && *end == '-' && isdigit(end[1])) {
+        unsigned long j = strtoul(end+1, &end, 10);
+        if (*end != '\0' || j < i) { error = "invalid range \"" + item + "\""; return false; }
+        for (; i <= j; ++i) { cols.push_back(i); }
+      } else {
+        std::size_t s = 0;
+        while (s < names.size() && names[s] != item) { ++s; }
+        if (s == names.size()) { error = "unknown sample \"" + item + "\""; return false; }
+        cols.push_back(s);
+      }
+    }
+    if (cols.empty()) { error = "no sample selected"; return false; }
+
+    m_max_col = 0;
+    for (uint32_t c : cols) { m_max_col = std::max<std::size_t>(m_max_col, c); }
+    return true;
+  }
+
+  std::size_t max_col() const { return m_max_col; }
+
+private:
+  std::size_t m_max_col{0};
+};
+
+
+#endif
@@ -1,14 +1,23 @@
 #ifndef KM_COMMON_H
 #define KM_COMMON_H
 
+#include <string>
 #include <type_traits>
+#include <utility>
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 
 static const int isnuc[256] = {
     0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
@@ -98,54 +107,167 @@ static int ktncmp(const char *k1, const char *k2, size_t n) {
   return n2kt[c1] - n2kt[c2];
 }
 
+// vectorized reverse complement: blocks of 16 (SSSE3) or 32 (AVX2) characters are read from the
+// end of the k-mer, reversed and complemented with byte shuffles, the remaining ones (and all of
+// them on other architectures) with rctable. The low nibble of A, C, G, T and N (1, 3, 7, 4, 14)
+// indexes the uppercase complement, the case bit (0x20) being kept and the other characters left
+// unchanged as in rctable.
+#if defined(__SSSE3__)
+static inline __m128i rc_block16(__m128i x, __m128i &invalid) {
+  const __m128i comp = _mm_setr_epi8(0, 'T', 0, 'G', 'A', 0, 0, 'C', 0, 0, 0, 0, 0, 0, 'N', 0);
+  const __m128i base = _mm_setr_epi8(-1, 'A', -1, 'C', 'T', -1, -1, 'G', -1, -1, -1, -1, -1, -1, 'N', -1);
+  const __m128i rev = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  __m128i nib = _mm_and_si128(x, _mm_set1_epi8(0x0f));
+  __m128i upper = _mm_and_si128(x, _mm_set1_epi8((char)0xdf));
+  __m128i nuc = _mm_cmpeq_epi8(upper, _mm_shuffle_epi8(base, nib));
+  invalid = _mm_or_si128(invalid, _mm_xor_si128(nuc, _mm_set1_epi8(-1)));
+  __m128i rc = _mm_or_si128(_mm_shuffle_epi8(comp, nib), _mm_and_si128(x, _mm_set1_epi8(0x20)));
+  rc = _mm_or_si128(_mm_and_si128(nuc, rc), _mm_andnot_si128(nuc, x));
+  return _mm_shuffle_epi8(rc, rev);
+}
+#endif
+
+#if defined(__AVX2__)
+static inline __m256i rc_block32(__m256i x, __m256i &invalid) {
+  const __m256i comp = _mm256_setr_epi8(0, 'T', 0, 'G', 'A', 0, 0, 'C', 0, 0, 0, 0, 0, 0, 'N', 0,
+                                        0, 'T', 0, 'G', 'A', 0, 0, 'C', 0, 0, 0, 0, 0, 0, 'N', 0);
+  const __m256i base = _mm256_setr_epi8(-1, 'A', -1, 'C', 'T', -1, -1, 'G', -1, -1, -1, -1, -1, -1, 'N', -1,
+                                        -1, 'A', -1, 'C', 'T', -1, -1, 'G', -1, -1, -1, -1, -1, -1, 'N', -1);
+  const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                       15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  __m256i nib = _mm256_and_si256(x, _mm256_set1_epi8(0x0f));
+  __m256i upper = _mm256_and_si256(x, _mm256_set1_epi8((char)0xdf));
+  __m256i nuc = _mm256_cmpeq_epi8(upper, _mm256_shuffle_epi8(base, nib));
+  invalid = _mm256_or_si256(invalid, _mm256_xor_si256(nuc, _mm256_set1_epi8(-1)));
+  __m256i rc = _mm256_or_si256(_mm256_shuffle_epi8(comp, nib), _mm256_and_si256(x, _mm256_set1_epi8(0x20)));
+  rc = _mm256_blendv_epi8(x, rc, nuc);
+  return _mm256_permute4x64_epi64(_mm256_shuffle_epi8(rc, rev), 0x4e);
+}
+#endif
+
+// out[i] = rctable[kmer[n-1-i]] for i < n (kmer and out must not overlap)
+// returns false if some character is not a nucleotide (see isnuc)
+__attribute__((always_inline)) static inline bool rc_kernel(const char *kmer, char *out, size_t n) {
+  size_t i = 0;
+  bool valid = true;
+#if defined(__AVX2__)
+  __m256i invalid32 = _mm256_setzero_si256();
+  for(; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(kmer + n - i - 32));
+    _mm256_storeu_si256((__m256i *)(out + i), rc_block32(x, invalid32));
+  }
+  valid = _mm256_testz_si256(invalid32, invalid32);
+#endif
+#if defined(__SSSE3__)
+  __m128i invalid16 = _mm_setzero_si128();
+  for(; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(kmer + n - i - 16));
+    _mm_storeu_si128((__m128i *)(out + i), rc_block16(x, invalid16));
+  }
+  valid = valid && _mm_movemask_epi8(invalid16) == 0;
+#endif
+  int nuc = 1;
+  for(; i < n; ++i) {
+    unsigned char c = kmer[n-1-i];
+    out[i] = rctable[c];
+    nuc &= isnuc[c];
+  }
+  return valid && nuc;
+}
+
+// index of the first position where a and b differ, n if none
+__attribute__((always_inline)) static inline size_t first_mismatch(const char *a, const char *b, size_t n) {
+  size_t i = 0;
+#if defined(__SSSE3__)
+  for(; i + 16 <= n; i += 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+    unsigned mask = ~(unsigned)_mm_movemask_epi8(eq) & 0xffff;
+    if(mask) { return i + __builtin_ctz(mask); }
+  }
+#endif
+  while(i < n && a[i] == b[i]) { ++i; }
+  return i;
+}
+
+// same as ktrccmp below on a k-mer and its reverse complement rc
+__attribute__((always_inline)) static inline int ktcmp_rc(const char *kmer, const char *rc, size_t n) {
+  for(size_t i = first_mismatch(kmer, rc, n); i < n; i += 1 + first_mismatch(kmer + i + 1, rc + i + 1, n - i - 1)) {
+    int d = n2kt[(unsigned char)kmer[i]] - n2kt[(unsigned char)rc[i]];
+    if(d != 0) { return d; }
+  }
+  return 0;
+}
+
+// kernels specialized for a k-mer size K known at compile time (K = 0 for a run-time size), so that
+// their loops are fully unrolled
+template <size_t K>
+static inline bool reverse_complement_k(const char *kmer, char *out, size_t ksize = K) {
+  return rc_kernel(kmer, out, K ? K : ksize);
+}
+
+// canonical form of a k-mer in out: the smallest of the k-mer and its reverse complement in the
+// kmtricks order (A < C < T < G), as in kmtricks matrices
+template <size_t K>
+static inline bool canonical_kmer_k(const char *kmer, char *out, size_t ksize = K) {
+  const size_t n = K ? K : ksize;
+  bool valid = rc_kernel(kmer, out, n);
+  if(ktcmp_rc(kmer, out, n) <= 0) { memcpy(out, kmer, n); }
+  return valid;
+}
+
+// calls f(std::integral_constant<size_t, K>()) with K = ksize for the common k-mer sizes (odd
+// sizes from 15 to 63), or f(std::integral_constant<size_t, 0>()) for the other ones
+template <typename F, size_t... I>
+static inline void with_kmer_size_impl(size_t ksize, F &&f, std::index_sequence<I...>) {
+  bool done = ((ksize == 15 + 2*I ? (f(std::integral_constant<size_t, 15 + 2*I>()), true) : false) || ...);
+  if(!done) { f(std::integral_constant<size_t, 0>()); }
+}
+
+template <typename F>
+static inline void with_kmer_size(size_t ksize, F &&f) {
+  with_kmer_size_impl(ksize, std::forward<F>(f), std::make_index_sequence<25>());
+}
+
+// reverse complement of a k-mer, in a stack buffer for the usual k-mer sizes
+struct kmer_rc_buf {
+  kmer_rc_buf(const char *kmer, size_t ksize) : m_heap(ksize > sizeof(m_stack) ? ksize : 0, '\0') {
+    m_rc = m_heap.empty() ? m_stack : &m_heap[0];
+    rc_kernel(kmer, m_rc, ksize);
+  }
+  kmer_rc_buf(const kmer_rc_buf&) = delete;
+  kmer_rc_buf& operator=(const kmer_rc_buf&) = delete;
+  const char *data() const { return m_rc; }
+private:
+  char m_stack[128];
+  std::string m_heap;
+  char *m_rc;
+};
+
 // compare kmer with its reverse complement
 // returns:
 // a negative value if kmer is canonical
 // 0 if kmer is equal to its reverse complement
 // a positive value if kmer is not canonical
 static int rccmp(char *kmer, int ksize) {
-  char *left = kmer;
-  char *right = kmer+ksize-1;
-  unsigned char fc, rc;
-  for(int i=0; i<ksize; ++i) {
-    fc = (unsigned char) *left++;
-    rc = (unsigned char) rctable[(int)*right--];
-    if (fc != rc) {
-      return fc-rc;
-    }
-  }
-  return 0;
+  kmer_rc_buf rc(kmer, ksize);
+  size_t i = first_mismatch(kmer, rc.data(), ksize);
+  return i < (size_t)ksize ? (unsigned char)kmer[i] - (unsigned char)rc.data()[i] : 0;
 }
 
 // same as revcmp but using the kmtricks nucleotide order
 static int ktrccmp(char *kmer, int ksize) {
-  unsigned char fc, rc;
-  for(int i=0; i<ksize; ++i) {
-    fc = n2kt[(int)kmer[i]];
-    rc = n2kt[(int)rctable[(int)kmer[ksize-i-1]]];
-    if (fc != rc) {
-      return fc-rc;
-    }
-  }
-  return 0;
+  kmer_rc_buf rc(kmer, ksize);
+  return ktcmp_rc(kmer, rc.data(), ksize);
 }
 
-static inline char * reverse_complement(char *kmer, int ksize) {
-    char *out = (char *)calloc(ksize+1,1);
-    for(int i=0; i<ksize; ++i) {
-      out[i] = rctable[(int)kmer[ksize-i-1]];
-    }
-    return out;
+// reverse complement of kmer written to out (ksize characters, not null-terminated)
+static inline void reverse_complement(const char *kmer, int ksize, char *out) {
+  rc_kernel(kmer, out, ksize);
 }
 
 static inline void reverse_complement_inplace(char *kmer, int ksize) {
-  int m = 1 + ((ksize-1)>>1);
-  for(int l=0; l<m; ++l) {
-    int r = ksize-l-1;
-    char temp = kmer[l];
-    kmer[l] = rctable[(int)kmer[r]];
-    kmer[r] = rctable[(int)temp];
-  }
+  kmer_rc_buf rc(kmer, ksize);
+  memcpy(kmer, rc.data(), ksize);
 }
 
 static char * second_column(char *line) {
@@ -222,6 +344,59 @@ static int64_t encode_kmer(char *kmer, int ksize) {
 }
 
 
+// FracMinHash ("scaled" MinHash) sampling of k-mers: a k-mer is sampled iff the hash of
+// its canonical form (the smallest between the k-mer and its reverse complement) is at most
+// 2^64/scale, so that about one k-mer every scale is kept, consistently across matrices
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline uint64_t canonical_kmer_hash(const char *kmer, int ksize) {
+  kmer_rc_buf rc(kmer, ksize);
+  size_t d = first_mismatch(kmer, rc.data(), ksize);
+  const char *canonical = (d == (size_t)ksize || (unsigned char)kmer[d] < (unsigned char)rc.data()[d]) ? kmer : rc.data();
+  uint64_t h = mix64(ksize), word = 0;
+  for(int i=0; i<ksize; ++i) {
+    unsigned char c = canonical[i];
+    word = (word << 2) | ((c >> 1) & 3);
+    if((i & 31) == 31 || i == ksize-1) {
+      h = mix64(h ^ word);
+      word = 0;
+    }
+  }
+  return h;
+}
+
+static inline bool is_sampled_kmer(const char *kmer, int ksize, uint64_t scale) {
+  return scale <= 1 || canonical_kmer_hash(kmer, ksize) <= UINT64_MAX / scale;
+}
+
+
+// LEB128 variable-length encoding of unsigned integers (7 bits per byte)
+static inline void put_varint(std::string &buf, uint64_t val) {
+  while(val >= 0x80) {
+    buf.push_back((char)(val | 0x80));
+    val >>= 7;
+  }
+  buf.push_back((char)val);
+}
+
+static inline uint64_t get_varint(const uint8_t *&p, const uint8_t *end) {
+  uint64_t val = 0;
+  for(int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    val |= uint64_t(b & 0x7f) << shift;
+    if(!(b & 0x80)) { break; }
+  }
+  return val;
+}
+
+
 // https://locklessinc.com/articles/sat_arithmetic/
 template<typename T, class = typename std::enable_if<std::is_unsigned_v<T>>::type>
 inline T add_sat(T a, T b) noexcept {
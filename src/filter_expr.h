@@ -0,0 +1,492 @@
+#ifndef KM_FILTER_EXPR_H
+#define KM_FILTER_EXPR_H
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bit_matrix.h"
+
+
+// k-mer filters over groups of samples ("kmat_tools filter -e" and "kmat_tools ktfilter -e"),
+// e.g. for a case/control study:
+//
+//   fpresent(case) >= 30% && fabsent(control) >= 0.5 && sum(all) >= 100
+//
+// expression  := term { ("||" | "or") term }
+// term        := factor { ("&&" | "and") factor }
+// factor      := ("!" | "not") factor | "(" expression ")" | function "(" group [ "," INT ] ")" op NUMBER
+// function    := present | absent    number of samples of the group where the k-mer is present (absent)
+//              | fpresent | fabsent  same as a fraction of the samples of the group
+//              | sum | mean          total (average) abundance of the k-mer in the samples of the group
+// op          := ">=" | ">" | "<=" | "<" | "==" | "!="
+//
+// a k-mer is present in a sample if its abundance is at least the optional INT argument, or
+// the -a threshold otherwise; NUMBER can be a percentage. Groups are read from a file (see
+// load_sample_groups), the group "all" being made of all the samples unless it is redefined.
+//
+// the expression is compiled once the number of samples is known: each comparison becomes an
+// interval of values of an integer statistic of a group (a number of present samples or a sum),
+// comparisons that are always true or false are folded, and the operands of && and || are
+// ordered so that the cheapest ones are evaluated first. A row of counts is then evaluated with
+// early exit: the presence bits of the samples are computed for a threshold (8 samples per
+// AVX2 comparison) only when a comparison needs them, and counted in a group with a popcount.
+
+struct sample_groups {
+  std::vector<std::string> names;
+  std::vector<std::vector<uint32_t>> members;
+};
+
+
+// parse a sample: a 0-based index or a name of sample_names
+static bool parse_sample(const std::string &item, const std::vector<std::string> &sample_names, uint32_t &sample) {
+  char *end;
+  unsigned long i = strtoul(item.c_str(), &end, 10);
+  if (!item.empty() && isdigit(item[0]) && *end == '\0') { sample = i; return true; }
+  auto it = std::find(sample_names.begin(), sample_names.end(), item);
+  if (it == sample_names.end()) { return false; }
+  sample = it - sample_names.begin();
+  return true;
+}
+
+
+// groups file: one group per line, "name: sample sample ...", where samples (separated by spaces
+// or commas) are 0-based indexes, ranges "i-j" or names of sample_names; '#' starts a comment
+static bool load_sample_groups(const std::string &path, const std::vector<std::string> &sample_names, sample_groups &groups, std::string &error) {
+  std::ifstream in(path);
+  if (!in.good()) { error = "cannot open groups file \"" + path + "\""; return false; }
+  std::size_t line_nb = 0;
+  for (std::string line; std::getline(in, line); ) {
+    ++line_nb;
+    line = line.substr(0, line.find('#'));
+    std::replace(line.begin(), line.end(), ',', ' ');
+    if (line.find_first_not_of(" \t\r") == std::string::npos) { continue; }
+    std::size_t colon = line.find(':');
+    std::istringstream name_ss(line.substr(0, colon));
+    std::string name;
+    if (colon == std::string::npos || !(name_ss >> name)) {
+      error = "line " + std::to_string(line_nb) + " of \"" + path + "\" is not of the form \"name: samples\"";
+      return false;
+    }
+    if (std::find(groups.names.begin(), groups.names.end(), name) != groups.names.end()) {
+      error = "group \"" + name + "\" is defined twice";
+      return false;
+    }
+    std::vector<uint32_t> members;
+    std::istringstream iss(line.substr(colon+1));
+    for (std::string item; iss >> item; ) {
+      uint32_t s, t;
+      std::size_t dash = item.find('-', 1);
+      if (parse_sample(item, sample_names, s)) {
+        members.push_back(s);
+      } else if (dash != std::string::npos && isdigit(item[0]) && parse_sample(item.substr(0, dash), {}, s)
+                 && parse_sample(item.substr(dash+1), {}, t) && s <= t) {
+        for (; s <= t; ++s) { members.push_back(s); }
+      } else {
+        error = "unknown sample \"" + item + "\" in group \"" + name + "\"";
+        return false;
+      }
+    }
+    std::sort(members.begin(), members.end());
+    members.erase(std::unique(members.begin(), members.end()), members.end());
+    groups.names.push_back(name);
+    groups.members.push_back(members);
+  }
+  return true;
+}
+
+
+class filter_expr {
+public:
+
+  // parse an expression (groups and thresholds are only resolved by compile)
+  bool parse(const std::string &text, std::string &error) {
+    m_text = text; m_pos = 0;
+    m_nodes.clear(); m_comparisons.clear();
+    m_error.clear();
+    m_root = parse_or();
+    skip_spaces();
+    if (m_error.empty() && m_pos < m_text.size()) { fail("unexpected \"" + m_text.substr(m_pos, 10) + "\""); }
+    if (!m_error.empty()) { error = m_error; return false; }
+    return true;
+  }
+
+  // resolve the groups and thresholds for rows of n_samples samples; with pa, rows are presence
+  // bits and a sample is present when its bit is set, whatever the threshold
+  bool compile(std::size_t n_samples, const sample_groups &groups, uint32_t min_abund, bool pa, std::string &error) {
+    m_samples = n_samples;
+    m_words = bit_row_words(n_samples);
+    m_pa = pa;
+    m_group_masks.clear(); m_group_members.clear(); m_group_names.clear();
+    m_thresholds.clear(); m_atoms.clear();
+
+    for (std::size_t g = 0; g < groups.names.size(); ++g) {
+      for (uint32_t s : groups.members[g]) {
+        if (s >= n_samples) {
+          error = "sample " + std::to_string(s) + " of group \"" + groups.names[g] + "\" does not exist (" + std::to_string(n_samples) + " samples)";
+          return false;
+        }
+      }
+    }
+
+    m_plan = m_nodes;
+    for (std::size_t c = 0; c < m_comparisons.size(); ++c) {
+      const comparison &cmp = m_comparisons[c];
+      std::vector<uint32_t> members;
+      auto g = std::find(groups.names.begin(), groups.names.end(), cmp.group);
+      if (g != groups.names.end()) {
+        members = groups.members[g - groups.names.begin()];
+      } else if (cmp.group == "all") {
+        for (uint32_t s = 0; s < n_samples; ++s) { members.push_back(s); }
+      } else {
+        error = "unknown group \"" + cmp.group + "\"";
+        return false;
+      }
+      if (members.empty()) { error = "group \"" + cmp.group + "\" is empty"; return false; }
+
+      atom a;
+      a.group = group_index(cmp.group, members);
+      // with presence bits, the sum of a group is its number of present samples
+      a.sum = !pa && (cmp.func == "sum" || cmp.func == "mean");
+      uint32_t threshold = cmp.has_threshold ? cmp.threshold : min_abund;
+      if (pa) { threshold = (cmp.func == "sum" || cmp.func == "mean") ? 1 : std::min<uint32_t>(threshold, 1); }
+      a.threshold = a.sum ? 0 : threshold_index(threshold);
+
+      // interval of the values v of the statistic such that "v op value*scale" holds
+      double scale = (cmp.func[0] == 'f' || cmp.func == "mean") ? members.size() : 1.0;
+      double x = cmp.value * scale;
+      if (std::fabs(x - std::round(x)) < 1e-9) { x = std::round(x); }
+      uint64_t max = a.sum ? UINT64_MAX : members.size();
+      auto clamp = [&](double v) { return v < 0 ? 0 : (v >= (double)max ? max : (uint64_t)v); };
+      uint64_t lo = 0, hi = max;
+      if (cmp.op == ">=") { if (x > max) { lo = 1; hi = 0; } else { lo = clamp(std::ceil(x)); } }
+      else if (cmp.op == ">") { if (x >= max) { lo = 1; hi = 0; } else { lo = clamp(std::floor(x) + 1); } }
+      else if (cmp.op == "<=") { if (x < 0) { lo = 1; hi = 0; } else { hi = clamp(std::floor(x)); } }
+      else if (cmp.op == "<") { if (x <= 0) { lo = 1; hi = 0; } else { hi = clamp(std::ceil(x) - 1); } }
+      else if (x == std::floor(x) && x >= 0 && x <= (double)max) { lo = hi = (uint64_t)x; }  // == (and != negated)
+      else { lo = 1; hi = 0; }
+      if (cmp.func == "absent" || cmp.func == "fabsent") {
+        // absent = size - present
+        uint64_t n = members.size();
+        if (lo <= hi) { uint64_t l = n - hi; hi = n - lo; lo = l; }
+      }
+      a.lo = lo; a.hi = hi;
+
+      node &leaf = m_plan[cmp.leaf];
+      if (lo > hi) { leaf.kind = CONST_FALSE; }
+      else if (lo == 0 && hi == max) { leaf.kind = CONST_TRUE; }
+      else { leaf.atom = m_atoms.size(); m_atoms.push_back(a); }
+    }
+    fold(m_root);
+    return true;
+  }
+
+  // evaluate a row of counts (compiled with pa = false)
+  bool operator()(const uint32_t *counts) const {
+    count_row row{*this, counts, scratch()};
+    return eval(m_root, row);
+  }
+
+  // evaluate a row of presence bits as stored in kmtricks presence/absence matrices (compiled with pa = true)
+  bool operator()(const uint8_t *bits) const {
+    pa_row row{*this, bits, scratch()};
+    return eval(m_root, row);
+  }
+
+  // the compiled plan, for logging
+  std::string str() const { return str(m_root); }
+
+private:
+
+  enum node_kind { AND, OR, NOT, LEAF, CONST_TRUE, CONST_FALSE };
+
+  struct node {
+    node_kind kind;
+    std::vector<int> children;
+    int atom{-1};
+    double cost{0};
+  };
+
+  struct comparison {
+    std::string func, group, op;
+    bool has_threshold{false};
+    uint32_t threshold{0};
+    double value{0};
+    int leaf;
+  };
+
+  // compiled comparison: lo <= statistic <= hi
+  struct atom {
+    bool sum;
+    int group;
+    int threshold;
+    uint64_t lo, hi;
+  };
+
+  struct eval_scratch {
+    std::vector<uint64_t> bits;       // presence bits, for each threshold
+    std::vector<uint8_t> computed;
+  };
+
+  // ---- parsing ----
+
+  void fail(const std::string &msg) {
+    if (m_error.empty()) { m_error = msg + " at position " + std::to_string(m_pos) + " of the filter expression"; }
+  }
+
+  void skip_spaces() { while (m_pos < m_text.size() && isspace(m_text[m_pos])) { ++m_pos; } }
+
+  bool accept(const std::string &tok) {
+    skip_spaces();
+    if (m_text.compare(m_pos, tok.size(), tok) != 0) { return false; }
+    // keywords must not be the prefix of an identifier
+    if (isalpha(tok[0]) && m_pos + tok.size() < m_text.size() && (isalnum(m_text[m_pos+tok.size()]) || m_text[m_pos+tok.size()] == '_')) { return false; }
+    m_pos += tok.size();
+    return true;
+  }
+
+  std::string identifier() {
+    skip_spaces();
+    std::size_t start = m_pos;
+    while (m_pos < m_text.size() && (isalnum(m_text[m_pos]) || strchr("_.-", m_text[m_pos]))) { ++m_pos; }
+    if (start == m_pos) { fail("expected a name"); }
+    return m_text.substr(start, m_pos - start);
+  }
+
+  double number(bool allow_percent) {
+    skip_spaces();
+    const char *begin = m_text.c_str() + m_pos;
+    char *end;
+    double v = strtod(begin, &end);
+    if (end == begin) { fail("expected a number"); return 0; }
+    m_pos += end - begin;
+    if (allow_percent && accept("%")) { v /= 100; }
+    return v;
+  }
+
+  int add_node(node_kind kind, std::vector<int> children = {}) {
+    m_nodes.push_back(node{kind, std::move(children)});
+    return m_nodes.size() - 1;
+  }
+
+  int parse_or() {
+    std::vector<int> terms{parse_and()};
+    while (m_error.empty() && (accept("||") || accept("or"))) { terms.push_back(parse_and()); }
+    return terms.size() == 1 ? terms[0] : add_node(OR, terms);
+  }
+
+  int parse_and() {
+    std::vector<int> factors{parse_factor()};
+    while (m_error.empty() && (accept("&&") || accept("and"))) { factors.push_back(parse_factor()); }
+    return factors.size() == 1 ? factors[0] : add_node(AND, factors);
+  }
+
+  int parse_factor() {
+    if (!m_error.empty()) { return -1; }
+    if (accept("!") || accept("not")) { return add_node(NOT, {parse_factor()}); }
+    if (accept("(")) {
+      int n = parse_or();
+      if (!accept(")")) { fail("expected \")\""); }
+      return n;
+    }
+
+    comparison cmp;
+    cmp.func = identifier();
+    static const char *functions[] = { "present", "absent", "fpresent", "fabsent", "sum", "mean" };
+    if (m_error.empty() && std::find(std::begin(functions), std::end(functions), cmp.func) == std::end(functions)) {
+      fail("unknown function \"" + cmp.func + "\"");
+    }
+    if (!accept("(")) { fail("expected \"(\""); }
+    cmp.group = identifier();
+    if (accept(",")) {
+      if (cmp.func == "sum" || cmp.func == "mean") { fail("no abundance threshold for " + cmp.func + "()"); }
+      double t = number(false);
+      if (t < 0 || t != std::floor(t) || t > UINT32_MAX) { fail("invalid abundance threshold"); }
+      cmp.has_threshold = true;
+      cmp.threshold = t;
+    }
+    if (!accept(")")) { fail("expected \")\""); }
+    for (const char *op : { ">=", "<=", "==", "!=", ">", "<" }) {
+      if (accept(op)) { cmp.op = op; break; }
+    }
+    if (cmp.op.empty()) { fail("expected a comparison operator"); }
+    cmp.value = number(true);
+    if (!m_error.empty()) { return -1; }
+
+    bool negate = (cmp.op == "!=");
+    if (negate) { cmp.op = "=="; }
+    cmp.leaf = add_node(LEAF);
+    m_comparisons.push_back(cmp);
+    return negate ? add_node(NOT, {cmp.leaf}) : cmp.leaf;
+  }
+
+  // ---- compilation ----
+
+  int group_index(const std::string &name, const std::vector<uint32_t> &members) {
+    auto it = std::find(m_group_names.begin(), m_group_names.end(), name);
+    if (it != m_group_names.end()) { return it - m_group_names.begin(); }
+    std::vector<uint64_t> mask(m_words, 0);
+    for (uint32_t s : members) { mask[s/64] |= uint64_t{1} << (s%64); }
+    m_group_names.push_back(name);
+    m_group_masks.push_back(mask);
+    m_group_members.push_back(members);
+    return m_group_names.size() - 1;
+  }
+
+  int threshold_index(uint32_t t) {
+    auto it = std::find(m_thresholds.begin(), m_thresholds.end(), t);
+    if (it != m_thresholds.end()) { return it - m_thresholds.begin(); }
+    m_thresholds.push_back(t);
+    return m_thresholds.size() - 1;
+  }
+
+  // fold the constant operands and order the other ones by increasing cost
+  void fold(int i) {
+    node &n = m_plan[i];
+    if (n.kind == LEAF) {
+      const atom &a = m_atoms[n.atom];
+      n.cost = a.sum ? 1 + m_group_members[a.group].size() / 8.0 : 1 + m_words;
+      return;
+    }
+    if (n.kind == CONST_TRUE || n.kind == CONST_FALSE) { return; }
+    for (int c : n.children) { fold(c); }
+    if (n.kind == NOT) {
+      node_kind k = m_plan[n.children[0]].kind;
+      if (k == CONST_TRUE || k == CONST_FALSE) { n.kind = (k == CONST_TRUE) ? CONST_FALSE : CONST_TRUE; n.children.clear(); }
+      else { n.cost = m_plan[n.children[0]].cost; }
+      return;
+    }
+    node_kind absorbing = (n.kind == AND) ? CONST_FALSE : CONST_TRUE;
+    node_kind neutral = (n.kind == AND) ? CONST_TRUE : CONST_FALSE;
+    std::vector<int> children;
+    for (int c : n.children) {
+      if (m_plan[c].kind == absorbing) { n.kind = absorbing; n.children.clear(); return; }
+      if (m_plan[c].kind != neutral) { children.push_back(c); }
+    }
+    if (children.empty()) { n.kind = neutral; n.children.clear(); return; }
+    std::stable_sort(children.begin(), children.end(), [&](int a, int b){ return m_plan[a].cost < m_plan[b].cost; });
+    n.children = children;
+    n.cost = 0;
+    for (int c : children) { n.cost += m_plan[c].cost; }
+  }
+
+  std::string str(int i) const {
+    const node &n = m_plan[i];
+    switch (n.kind) {
+      case CONST_TRUE: return "true";
+      case CONST_FALSE: return "false";
+      case NOT: return m_plan[n.children[0]].kind == LEAF ? "!(" + str(n.children[0]) + ")" : "!" + str(n.children[0]);
+      case LEAF: {
+        const atom &a = m_atoms[n.atom];
+        std::string s = (a.sum ? "sum(" : "present(") + m_group_names[a.group];
+        if (!a.sum && !m_pa) { s += "," + std::to_string(m_thresholds[a.threshold]); }
+        s += ")";
+        if (a.lo == a.hi) { return s + "==" + std::to_string(a.lo); }
+        uint64_t max = a.sum ? UINT64_MAX : m_group_members[a.group].size();
+        if (a.lo == 0) { return s + "<=" + std::to_string(a.hi); }
+        if (a.hi == max) { return s + ">=" + std::to_string(a.lo); }
+        return s + " in [" + std::to_string(a.lo) + "," + std::to_string(a.hi) + "]";
+      }
+      default: {
+        std::string s = "(";
+        for (std::size_t c = 0; c < n.children.size(); ++c) {
+          s += (c ? (n.kind == AND ? " && " : " || ") : "") + str(n.children[c]);
+        }
+        return s + ")";
+      }
+    }
+  }
+
+  // ---- evaluation ----
+
+  eval_scratch& scratch() const {
+    thread_local eval_scratch s;
+    s.bits.resize(m_thresholds.size() * m_words);
+    s.computed.assign(m_thresholds.size(), 0);
+    return s;
+  }
+
+  struct count_row {
+    const filter_expr &expr;
+    const uint32_t *counts;
+    eval_scratch &s;
+
+    const uint64_t* bits(int t) {
+      uint64_t *row = s.bits.data() + t * expr.m_words;
+      if (!s.computed[t]) { threshold_bit_row(counts, expr.m_samples, expr.m_thresholds[t], row); s.computed[t] = 1; }
+      return row;
+    }
+    uint64_t sum(int g) {
+      uint64_t total = 0;
+      for (uint32_t j : expr.m_group_members[g]) { total += counts[j]; }
+      return total;
+    }
+  };
+
+  struct pa_row {
+    const filter_expr &expr;
+    const uint8_t *bytes;
+    eval_scratch &s;
+
+    const uint64_t* bits(int t) {
+      uint64_t *row = s.bits.data() + t * expr.m_words;
+      if (!s.computed[t]) {
+        std::fill(row, row + expr.m_words, expr.m_thresholds[t] == 0 ? ~uint64_t{0} : 0);
+        if (expr.m_thresholds[t] > 0) { memcpy(row, bytes, (expr.m_samples + 7) / 8); }  // bit j of byte j/8 (little-endian words)
+        s.computed[t] = 1;
+      }
+      return row;
+    }
+    uint64_t sum(int) { return 0; }  // sums are compiled into numbers of present samples
+  };
+
+  template<typename Row>
+  bool eval(int i, Row &row) const {
+    const node &n = m_plan[i];
+    switch (n.kind) {
+      case CONST_TRUE: return true;
+      case CONST_FALSE: return false;
+      case NOT: return !eval(n.children[0], row);
+      case AND:
+        for (int c : n.children) { if (!eval(c, row)) { return false; } }
+        return true;
+      case OR:
+        for (int c : n.children) { if (eval(c, row)) { return true; } }
+        return false;
+      default: {
+        const atom &a = m_atoms[n.atom];
+        uint64_t v = a.sum ? row.sum(a.group) : and_popcount(row.bits(a.threshold), m_group_masks[a.group].data(), m_words);
+        return a.lo <= v && v <= a.hi;
+      }
+    }
+  }
+
+  std::string m_text;
+  std::size_t m_pos{0};
+  std::string m_error;
+
+  std::vector<node> m_nodes;      // parsed expression
+  std::vector<node> m_plan;       // compiled expression
+  std::vector<comparison> m_comparisons;
+  int m_root{-1};
+
+  std::size_t m_samples{0};
+  std::size_t m_words{0};
+  bool m_pa{false};
+  std::vector<std::string> m_group_names;
+  std::vector<std::vector<uint64_t>> m_group_masks;
+  std::vector<std::vector<uint32_t>> m_group_members;
+  std::vector<uint32_t> m_thresholds;
+  std::vector<atom> m_atoms;
+};
+
+
+#endif
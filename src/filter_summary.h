@@ -0,0 +1,177 @@
+#ifndef KM_FILTER_SUMMARY_H
+#define KM_FILTER_SUMMARY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+
+// summary of a kmtricks matrix partition written by "kmat_tools ktfilter -C": for each k-mer of
+// the partition, in the same order, the number of samples in which its abundance is at least
+// each of a few cutoffs. The k-mers retained by the -a/-n/-f/-N/-F filter only depend on these
+// numbers, so that a run with other thresholds decides from the summary alone and only reads the
+// partitions holding retained k-mers, for their counts.
+//
+// file layout: a fixed-size header (with the size and modification time of the partition, to
+// detect a rewritten one), the cutoffs (uint32_t), then the numbers of samples, nb_cutoffs per
+// k-mer on value_bits bits each, packed in little-endian 64-bit words
+
+static const char FILTER_SUMMARY_MAGIC[8] = { 'K', 'M', 'F', 'S', 'U', 'M', 'M', '1' };
+
+struct filter_summary_header {
+  char magic[8];
+  uint64_t source_size;
+  int64_t source_mtime;
+  uint64_t nb_kmers;
+  uint32_t nb_samples;
+  uint32_t nb_cutoffs;
+  uint32_t value_bits;
+  uint32_t reserved;
+};
+
+static bool summary_source_stamp(const std::string &source, uint64_t &size, int64_t &mtime) {
+  std::error_code ec;
+  size = std::filesystem::file_size(source, ec);
+  if (ec) { return false; }
+  auto time = std::filesystem::last_write_time(source, ec);
+  if (ec) { return false; }
+  mtime = time.time_since_epoch().count();
+  return true;
+}
+
+static inline uint32_t summary_value_bits(uint32_t nb_samples) {
+  return std::max(1, 32 - __builtin_clz(std::max<uint32_t>(nb_samples, 1)));
+}
+
+
+// written to a temporary file renamed by finish(), so that an interrupted run leaves no summary
+class filter_summary_writer {
+public:
+  filter_summary_writer(const std::string &path, const std::string &source, uint32_t nb_samples, const std::vector<uint32_t> &cutoffs)
+    : m_path(path), m_tmp_path(path + ".tmp"), m_cutoffs(cutoffs)
+  {
+    memcpy(m_header.magic, FILTER_SUMMARY_MAGIC, sizeof(m_header.magic));
+    m_header.nb_samples = nb_samples;
+    m_header.nb_cutoffs = cutoffs.size();
+    m_header.value_bits = summary_value_bits(nb_samples);
+    if (!summary_source_stamp(source, m_header.source_size, m_header.source_mtime)) { return; }
+    m_file = fopen(m_tmp_path.c_str(), "wb");
+    if (m_file == NULL) { return; }
+    m_good = fwrite(&m_header, sizeof(m_header), 1, m_file) == 1
+          && fwrite(m_cutoffs.data(), sizeof(uint32_t), m_cutoffs.size(), m_file) == m_cutoffs.size();
+  }
+
+  ~filter_summary_writer() {
+    if (m_file) { fclose(m_file); std::remove(m_tmp_path.c_str()); }
+  }
+
+  bool good() const { return m_good; }
+
+  // numbers of samples of a k-mer for each cutoff
+  void add(const uint32_t *nb_present) {
+    for (uint32_t c = 0; c < m_header.nb_cutoffs; ++c) {
+      uint64_t v = nb_present[c];
+      m_word |= v << m_used;
+      if (m_used + m_header.value_bits >= 64) {
+        put_word();
+        m_word = m_used ? v >> (64 - m_used) : 0;
+        m_used = m_used + m_header.value_bits - 64;
+      } else {
+        m_used += m_header.value_bits;
+      }
+    }
+    m_header.nb_kmers++;
+  }
+
+  bool finish() {
+    if (m_used) { put_word(); }
+    m_good = m_good && fseek(m_file, 0, SEEK_SET) == 0 && fwrite(&m_header, sizeof(m_header), 1, m_file) == 1;
+    m_good = (fclose(m_file) == 0) && m_good;
+    m_file = NULL;
+    if (m_good) {
+      std::error_code ec;
+      std::filesystem::rename(m_tmp_path, m_path, ec);
+      m_good = !ec;
+    }
+    if (!m_good) { std::remove(m_tmp_path.c_str()); }
+    return m_good;
+  }
+
+private:
+  void put_word() {
+    m_good = m_good && fwrite(&m_word, sizeof(m_word), 1, m_file) == 1;
+    m_word = 0;
+  }
+
+  std::string m_path, m_tmp_path;
+  std::vector<uint32_t> m_cutoffs;
+  filter_summary_header m_header{};
+  FILE *m_file{NULL};
+  bool m_good{false};
+  uint64_t m_word{0};
+  uint32_t m_used{0};
+};
+
+
+class filter_summary_reader {
+public:
+  ~filter_summary_reader() { if (m_file) { fclose(m_file); } }
+
+  // open the summary of a partition, failing if it was not computed from its current version
+  bool open(const std::string &path, const std::string &source, uint32_t nb_samples) {
+    if (m_file) { fclose(m_file); }
+    m_file = fopen(path.c_str(), "rb");
+    if (m_file == NULL) { return false; }
+    uint64_t size; int64_t mtime;
+    if (fread(&m_header, sizeof(m_header), 1, m_file) != 1 || memcmp(m_header.magic, FILTER_SUMMARY_MAGIC, sizeof(m_header.magic)) != 0
+        || !summary_source_stamp(source, size, mtime) || size != m_header.source_size || mtime != m_header.source_mtime
+        || m_header.nb_samples != nb_samples || m_header.value_bits != summary_value_bits(nb_samples)) {
+      return false;
+    }
+    m_cutoffs.resize(m_header.nb_cutoffs);
+    if (fread(m_cutoffs.data(), sizeof(uint32_t), m_cutoffs.size(), m_file) != m_cutoffs.size()) { return false; }
+    m_read = 0; m_word = 0; m_avail = 0;
+    return true;
+  }
+
+  const std::vector<uint32_t>& cutoffs() const { return m_cutoffs; }
+  uint64_t nb_kmers() const { return m_header.nb_kmers; }
+
+  // numbers of samples of the next k-mer for each cutoff
+  bool next(uint32_t *nb_present) {
+    if (m_read == m_header.nb_kmers) { return false; }
+    const uint32_t b = m_header.value_bits;
+    const uint64_t mask = (uint64_t{1} << b) - 1;
+    for (uint32_t c = 0; c < m_header.nb_cutoffs; ++c) {
+      if (m_avail >= b) {
+        nb_present[c] = m_word & mask;
+        m_word = (b == 64) ? 0 : m_word >> b;
+        m_avail -= b;
+      } else {
+        uint64_t w;
+        if (fread(&w, sizeof(w), 1, m_file) != 1) { return false; }
+        nb_present[c] = (m_word | (w << m_avail)) & mask;
+        m_word = w >> (b - m_avail);
+        m_avail = 64 - (b - m_avail);
+      }
+    }
+    m_read++;
+    return true;
+  }
+
+private:
+  FILE *m_file{NULL};
+  filter_summary_header m_header{};
+  std::vector<uint32_t> m_cutoffs;
+  uint64_t m_read{0};
+  uint64_t m_word{0};
+  uint32_t m_avail{0};
+};
+
+
+#endif
@@ -0,0 +1,406 @@
+#ifndef KM_KFF_H
+#define KM_KFF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+
+
+// k-mer matrices in the KFF format (https://github.com/Kmer-File-Format/kff-reference, v1.0),
+// the counts of a k-mer in all samples being stored as its data
+//
+// the writer emits raw sections of up to KFF_SECTION_KMERS k-mers (one per block), each preceded
+// by a section of variables when they change: k, max = 1, data_size and nb_samples (not part of
+// the specification, files without it are read as having one sample); counts are stored big-endian
+// on 1, 2 or 4 bytes, the smallest width fitting the largest count of the section
+// the reader also accepts blocks of several k-mers and minimizer sections
+//
+// open_kmer_matrix()/create_kmer_matrix() give access to KFF files as FILE* streams of text
+// matrix rows ("kmer count_1 ... count_n"), so that the tools reading and writing text matrices
+// can process KFF files unchanged
+
+static const std::size_t KFF_SECTION_KMERS = 1 << 16;
+
+// nucleotide codes used when writing (those of kmtricks): A=0, C=1, G=3, T=2, i.e. (c >> 1) & 3
+static const uint8_t KFF_ENCODING = (0 << 6) | (1 << 4) | (3 << 2) | 2;
+
+// number of bytes of a field storing values up to v (as defined by the specification)
+static inline std::size_t kff_field_bytes(uint64_t v) {
+  return v <= 1 ? 0 : (64 - __builtin_clzll(v - 1) + 7) / 8;
+}
+
+
+class kff_writer {
+public:
+  bool open(FILE *fp) {
+    m_fp = fp;
+    const uint8_t header[] = { 'K', 'F', 'F', 1, 0, KFF_ENCODING, 1 /* unique */, 0 /* canonical */, 0, 0, 0, 0 /* free size */ };
+    return fwrite(header, 1, sizeof(header), m_fp) == sizeof(header);
+  }
+
+  // add a k-mer and its counts (all k-mers must have the same size and number of counts)
+  bool write(std::string_view kmer, const std::vector<uint32_t> &counts) {
+    if(m_nb_kmers == 0 && m_k == 0) {
+      m_k = kmer.size();
+      m_nb_samples = counts.size();
+    }
+    if(kmer.size() != m_k || counts.size() != m_nb_samples) { return false; }
+    for(std::size_t i = 0; i < m_k; ++i) {
+      if(!isnuc[(int)kmer[i]]) { return false; }
+    }
+    m_kmers.append(kmer);
+    m_counts.insert(m_counts.end(), counts.begin(), counts.end());
+    for(uint32_t c : counts) { m_max_count = std::max(m_max_count, c); }
+    if(++m_nb_kmers == KFF_SECTION_KMERS) { return flush(); }
+    return true;
+  }
+
+  // write the remaining k-mers and the footer
+  bool close() {
+    if(!flush()) { return false; }
+    std::string buf;
+    buf.push_back('v');
+    put_be(buf, 2, 8);
+    put_var(buf, "first_index", 0);
+    put_var(buf, "footer_size", 1 + 8 + 2 * (8 + 12));
+    buf.append("KFF");
+    return fwrite(buf.data(), 1, buf.size(), m_fp) == buf.size();
+  }
+
+private:
+  static void put_be(std::string &buf, uint64_t v, std::size_t bytes) {
+    for(std::size_t i = bytes; i-- > 0; ) { buf.push_back((char)(v >> (8*i))); }
+  }
+
+  static void put_var(std::string &buf, const char *name, uint64_t v) {
+    buf.append(name, strlen(name)+1);
+    put_be(buf, v, 8);
+  }
+
+  bool flush() {
+    if(m_nb_kmers == 0) { return true; }
+    std::size_t width = m_max_count < (1U << 8) ? 1 : m_max_count < (1U << 16) ? 2 : 4;
+    std::string buf;
+    if(width != m_width) {
+      m_width = width;
+      buf.push_back('v');
+      put_be(buf, 4, 8);
+      put_var(buf, "k", m_k);
+      put_var(buf, "max", 1);
+      put_var(buf, "data_size", m_nb_samples * m_width);
+      put_var(buf, "nb_samples", m_nb_samples);
+    }
+    buf.push_back('r');
+    put_be(buf, m_nb_kmers, 8);
+
+    std::size_t seq_bytes = (2*m_k + 7) / 8, pad = 8*seq_bytes - 2*m_k;
+    for(std::size_t i = 0; i < m_nb_kmers; ++i) {
+      const char *kmer = m_kmers.data() + i * m_k;
+      std::size_t pos = buf.size();
+      buf.append(seq_bytes, '\0');
+      for(std::size_t j = 0; j < m_k; ++j) {
+        std::size_t bit = pad + 2*j;
+        buf[pos + bit/8] |= (char)(((kmer[j] >> 1) & 3) << (6 - bit%8));
+      }
+      for(std::size_t s = 0; s < m_nb_samples; ++s) { put_be(buf, m_counts[i * m_nb_samples + s], m_width); }
+    }
+
+    m_kmers.clear();
+    m_counts.clear();
+    m_nb_kmers = 0;
+    m_max_count = 0;
+    return fwrite(buf.data(), 1, buf.size(), m_fp) == buf.size();
+  }
+
+  FILE *m_fp{NULL};
+  std::size_t m_k{0};
+  std::size_t m_nb_samples{0};
+  std::size_t m_width{0};   // of the counts, in the last variables section written
+  std::string m_kmers;      // of the current section
+  std::vector<uint32_t> m_counts;
+  std::size_t m_nb_kmers{0};
+  uint32_t m_max_count{0};
+};
+
+
+class kff_reader {
+public:
+  bool open(FILE *fp) {
+    m_fp = fp;
+    uint8_t header[12];
+    if(fread(header, 1, sizeof(header), m_fp) != sizeof(header) || memcmp(header, "KFF", 3) != 0 || header[3] != 1) { return false; }
+    for(int nuc = 0; nuc < 4; ++nuc) { m_decode[(header[5] >> (6 - 2*nuc)) & 3] = "ACGT"[nuc]; }
+    return skip(get_be(header + 8, 4));
+  }
+
+  uint64_t k() const { return m_k; }
+
+  // next k-mer of the file and its counts, false at the end of the file or on error (see good())
+  bool next(std::string &kmer, std::vector<uint32_t> &counts) {
+    while(m_block_next == m_block_kmers) {
+      if(m_blocks > 0) {
+        if(!read_block()) { return fail(); }
+      } else if(!read_section()) {
+        return false;
+      }
+    }
+    std::size_t i = m_block_next++;
+    kmer.assign(m_block_seq, i, m_k);
+    counts.resize(m_nb_samples);
+    const uint8_t *data = m_block_data.data() + i * m_data_size;
+    for(std::size_t s = 0; s < m_nb_samples; ++s) { counts[s] = get_be(data + s * m_width, m_width); }
+    return true;
+  }
+
+  bool good() const { return m_ok; }
+
+private:
+  static uint64_t get_be(const uint8_t *p, std::size_t bytes) {
+    uint64_t v = 0;
+    for(std::size_t i = 0; i < bytes; ++i) { v = (v << 8) | p[i]; }
+    return v;
+  }
+
+  bool read_be(uint64_t &v, std::size_t bytes) {
+    uint8_t buf[8];
+    if(fread(buf, 1, bytes, m_fp) != bytes) { return false; }
+    v = get_be(buf, bytes);
+    return true;
+  }
+
+  // skip bytes (the input may not be seekable)
+  bool skip(uint64_t bytes) {
+    for(; bytes > 0; --bytes) {
+      if(getc(m_fp) == EOF) { return false; }
+    }
+    return true;
+  }
+
+  bool read_seq(std::size_t len, std::string &out) {
+    std::size_t bytes = (2*len + 7) / 8, pad = 8*bytes - 2*len;
+    m_buf.resize(bytes);
+    if(fread(m_buf.data(), 1, bytes, m_fp) != bytes) { return false; }
+    out.resize(len);
+    for(std::size_t j = 0; j < len; ++j) {
+      std::size_t bit = pad + 2*j;
+      out[j] = m_decode[(m_buf[bit/8] >> (6 - bit%8)) & 3];
+    }
+    return true;
+  }
+
+  bool fail() { m_ok = false; return false; }
+
+  // read the next section, false at the end of the file (or on error)
+  bool read_section() {
+    int type = getc(m_fp);
+    switch(type) {
+      case 'v': {
+        uint64_t nb_vars;
+        if(!read_be(nb_vars, 8)) { return fail(); }
+        for(uint64_t i = 0; i < nb_vars; ++i) {
+          std::string name;
+          int c;
+          while((c = getc(m_fp)) > 0) { name.push_back((char)c); }
+          uint64_t v;
+          if(c != 0 || !read_be(v, 8)) { return fail(); }
+          if(name == "k") { m_k = v; }
+          else if(name == "m") { m_m = v; }
+          else if(name == "max") { m_max = v; }
+          else if(name == "data_size") { m_data_size = v; }
+          else if(name == "nb_samples") { m_nb_samples_var = v; }
+        }
+        return true;
+      }
+      case 'r':
+        m_minimizer.clear();
+        return (check_vars() && read_be(m_blocks, 8)) || fail();
+      case 'm':
+        if(!check_vars() || m_m == 0 || m_m > m_k || !read_seq(m_m, m_minimizer) || !read_be(m_blocks, 8)) { return fail(); }
+        return true;
+      case 'i': {
+        uint64_t nb_entries;
+        if(!read_be(nb_entries, 8) || !skip(nb_entries * 9 + 8)) { return fail(); }
+        return true;
+      }
+      case 'K':
+        return (getc(m_fp) == 'F' && getc(m_fp) == 'F') || fail();
+      case EOF:
+        return false;
+      default:
+        return fail();
+    }
+  }
+
+  // the data of a k-mer are the counts of one sample, or of nb_samples samples of equal width
+  bool check_vars() {
+    m_nb_samples = m_nb_samples_var ? m_nb_samples_var : (m_data_size > 0);
+    m_width = m_nb_samples ? m_data_size / m_nb_samples : 0;
+    return m_k > 0 && m_max > 0 && m_width <= 4 && m_width * m_nb_samples == m_data_size;
+  }
+
+  bool read_block() {
+    --m_blocks;
+    uint64_t n = 1;
+    if(kff_field_bytes(m_max) > 0 && !read_be(n, kff_field_bytes(m_max))) { return false; }
+    if(n == 0 || n > m_max) { return false; }
+    if(m_minimizer.empty()) {
+      if(!read_seq(n + m_k - 1, m_block_seq)) { return false; }
+    } else {
+      uint64_t pos = 0;
+      std::size_t pos_bytes = kff_field_bytes(m_k + m_max - 1);
+      if(pos_bytes > 0 && !read_be(pos, pos_bytes)) { return false; }
+      if(pos > n + m_k - 1 - m_m || !read_seq(n + m_k - 1 - m_m, m_block_seq)) { return false; }
+      m_block_seq.insert(pos, m_minimizer);
+    }
+    m_block_data.resize(n * m_data_size);
+    if(fread(m_block_data.data(), 1, m_block_data.size(), m_fp) != m_block_data.size()) { return false; }
+    m_block_kmers = n;
+    m_block_next = 0;
+    return true;
+  }
+
+  FILE *m_fp{NULL};
+  char m_decode[4];
+  uint64_t m_k{0}, m_m{0}, m_max{0}, m_data_size{0}, m_nb_samples_var{0};
+  std::size_t m_nb_samples{0}, m_width{0};
+  uint64_t m_blocks{0};        // remaining blocks of the current section
+  std::string m_minimizer;     // of the current minimizer section
+  std::string m_block_seq;
+  std::vector<uint8_t> m_block_data;
+  uint64_t m_block_kmers{0};   // number of k-mers of the current block
+  uint64_t m_block_next{0};    // index of the next one to be read
+  std::vector<uint8_t> m_buf;
+  bool m_ok{true};
+};
+
+
+// FILE* streams of text matrix rows backed by a KFF reader or writer
+
+struct kff_text_stream {
+  FILE *fp;
+  bool writer_mode;
+  kff_reader reader;
+  kff_writer writer;
+  std::string buf;          // rows formatted but not read yet / partial row written
+  std::size_t pos{0};
+  std::string kmer;
+  std::vector<uint32_t> counts;
+
+  kff_text_stream(FILE *f, bool write) : fp(f), writer_mode(write) {}
+};
+
+static ssize_t kff_text_read(void *cookie, char *out, size_t size) {
+  kff_text_stream *s = (kff_text_stream *)cookie;
+  while(s->buf.size() - s->pos < size && s->reader.next(s->kmer, s->counts)) {
+    if(s->pos > 0) { s->buf.erase(0, s->pos); s->pos = 0; }
+    s->buf.append(s->kmer);
+    char num[16];
+    for(uint32_t c : s->counts) {
+      s->buf.push_back(' ');
+      s->buf.append(num, snprintf(num, sizeof(num), "%u", c));
+    }
+    s->buf.push_back('\n');
+  }
+  // the rows read before an error are still given, so that no row is truncated
+  if(s->pos == s->buf.size() && !s->reader.good()) { fprintf(stderr, "[error] KFF file is truncated or corrupted\n"); return -1; }
+  size_t n = std::min(size, s->buf.size() - s->pos);
+  memcpy(out, s->buf.data() + s->pos, n);
+  s->pos += n;
+  return n;
+}
+
+// parse a text matrix row and add it to the KFF writer
+static bool kff_write_row(kff_text_stream *s, const char *row, std::size_t len) {
+  std::string line(row, len);
+  char *tok = strtok(line.data(), " \t\n");
+  if(tok == NULL) { return true; } // skip empty lines
+  s->kmer = tok;
+  s->counts.clear();
+  while((tok = strtok(NULL, " \t\n")) != NULL) { s->counts.push_back(strtoul(tok, NULL, 10)); }
+  if(!s->writer.write(s->kmer, s->counts)) {
+    fprintf(stderr, "[error] cannot write row \"%s\" to KFF file (invalid k-mer, or different k-mer size or number of samples)\n", s->kmer.c_str());
+    return false;
+  }
+  return true;
+}
+
+static ssize_t kff_text_write(void *cookie, const char *in, size_t size) {
+  kff_text_stream *s = (kff_text_stream *)cookie;
+  s->buf.append(in, size);
+  std::size_t start = 0, end;
+  while((end = s->buf.find('\n', start)) != std::string::npos) {
+    if(!kff_write_row(s, s->buf.data() + start, end - start)) { return -1; }
+    start = end + 1;
+  }
+  s->buf.erase(0, start);
+  return size;
+}
+
+static int kff_text_close(void *cookie) {
+  kff_text_stream *s = (kff_text_stream *)cookie;
+  bool ok = true;
+  if(s->writer_mode) {
+    ok = kff_write_row(s, s->buf.data(), s->buf.size()) && s->writer.close();
+  }
+  ok = (s->fp == stdin || s->fp == stdout || fclose(s->fp) == 0) && ok;
+  delete s;
+  return ok ? 0 : EOF;
+}
+
+static FILE* kff_text_open(kff_text_stream *s) {
+#if defined(__APPLE__) || defined(__FreeBSD__)
+  FILE *fp = s->writer_mode
+    ? funopen(s, NULL, [](void *c, const char *in, int n) { return (int)kff_text_write(c, in, n); }, NULL, kff_text_close)
+    : funopen(s, [](void *c, char *out, int n) { return (int)kff_text_read(c, out, n); }, NULL, NULL, kff_text_close);
+#else
+  cookie_io_functions_t funcs = { NULL, NULL, NULL, kff_text_close };
+  if(s->writer_mode) { funcs.write = kff_text_write; } else { funcs.read = kff_text_read; }
+  FILE *fp = fopencookie(s, s->writer_mode ? "w" : "r", funcs);
+#endif
+  if(fp == NULL) { kff_text_close(s); }
+  return fp;
+}
+
+
+// open a k-mer matrix for reading ("-" for stdin): a text matrix, or a KFF file detected by its
+// signature (a text matrix starts with a nucleotide) and read as a text matrix
+static FILE* open_kmer_matrix(const char *fname) {
+  FILE *fp = strcmp(fname,"-") ? fopen(fname,"r") : stdin;
+  if(fp == NULL) { return NULL; }
+  int c = getc(fp);
+  if(c == EOF || ungetc(c, fp) == EOF || c != 'K') { return fp; }
+
+  kff_text_stream *s = new kff_text_stream(fp, false);
+  if(!s->reader.open(fp)) {
+    fprintf(stderr, "[error] \"%s\" is not a valid KFF file\n", fname);
+    kff_text_close(s);
+    return NULL;
+  }
+  return kff_text_open(s);
+}
+
+// open a k-mer matrix for writing (NULL for stdout): rows written to a file whose name ends with
+// ".kff" are stored in the KFF format
+static FILE* create_kmer_matrix(const char *fname) {
+  if(fname == NULL) { return stdout; }
+  FILE *fp = fopen(fname,"w");
+  std::string_view name(fname);
+  if(fp == NULL || name.size() < 4 || name.substr(name.size()-4) != ".kff") { return fp; }
+
+  kff_text_stream *s = new kff_text_stream(fp, true);
+  if(!s->writer.open(fp)) {
+    kff_text_close(s);
+    return NULL;
+  }
+  return kff_text_open(s);
+}
+
+
+#endif
+
@@ -1,20 +1,35 @@
+#include "columns.h"
 #include "common.h"
+#include "filter_expr.h"
+#include "kff.h"
+#include "progress.h"
 
 int main_basic_filter(int argc, char **argv) {
 
   size_t min_zeros=10, min_nz=10, min_abund=1;
   double min_zero_frac=0.5, min_nz_frac=0.1;
-  char *out_fname = NULL;
+  size_t scale = 1;
+  char *out_fname = NULL, *kmers_fname = NULL, *columns_spec = NULL;
+  char *expr_text = NULL, *groups_fname = NULL;
   bool verbose_opt=false, help_opt=false;
   
   bool min_zero_frac_opt=false, min_nz_frac_opt=false;
 
   int c;
-  while ((c = getopt(argc, argv, "a:f:F:n:N:o:vh")) != -1) {
+  while ((c = getopt(argc, argv, "a:c:e:f:F:g:n:N:o:S:K:vh")) != -1) {
     switch (c) {
       case 'a':
         min_abund = strtoul(optarg, NULL, 10);
         break;
+      case 'c':
+        columns_spec = optarg;
+        break;
+      case 'e':
+        expr_text = optarg;
+        break;
+      case 'g':
+        groups_fname = optarg;
+        break;
       case 'n':
         min_zeros = strtoul(optarg, NULL, 10);
         break;
@@ -32,6 +47,12 @@ int main_basic_filter(int argc, char **argv) {
         min_nz_frac_opt = true;
         min_nz_frac = atof(optarg);
         break;
+      case 'S':
+        scale = strtoul(optarg, NULL, 10);
+        break;
+      case 'K':
+        kmers_fname = optarg;
+        break;
       case 'v':
         verbose_opt = true;
         break;
@@ -53,11 +74,16 @@ int main_basic_filter(int argc, char **argv) {
     fprintf(stderr, "[error] -F must be in the [0.01,0.95] interval.\n");
     return 1;
   }
+  if(scale < 1) {
+    fprintf(stderr, "[error] -S must be a positive integer.\n");
+    return 1;
+  }
 
   if(argc-optind != 1 || help_opt) {
     fprintf(stdout, "Usage: kmat_tools filter [options] <in.mat>\n\n");
 
-    fprintf(stdout, "Filter a matrix by selecting k-mers that are potentially differential.\n\n");
+    fprintf(stdout, "Filter a matrix by selecting k-mers that are potentially differential.\n");
+    fprintf(stdout, "The input matrix can be a text or a KFF file, the output matrix is written in KFF if its name ends with \".kff\".\n\n");
     
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -a INT    min abundance to define a k-mer as present in a sample [1]\n");
@@ -65,26 +91,72 @@ int main_basic_filter(int argc, char **argv) {
     fprintf(stdout, "  -f FLOAT  fraction of samples for which a k-mer should be absent (overrides -n)\n");
     fprintf(stdout, "  -N INT    min number of samples for which a k-mer should be present [10]\n");
     fprintf(stdout, "  -F FLOAT  fraction of samples for which a k-mer should be present (overrides -N)\n");
+    fprintf(stdout, "  -e EXPR   retain the k-mers satisfying EXPR instead (overrides -n/-f/-N/-F), a combination with &&, ||\n");
+    fprintf(stdout, "            and ! of comparisons of present(G), absent(G), fpresent(G), fabsent(G) (number or fraction\n");
+    fprintf(stdout, "            of samples of group G where the k-mer abundance is at least -a, or the second argument if any),\n");
+    fprintf(stdout, "            sum(G) or mean(G) with a number, e.g. \"fpresent(case) >= 30%% && fabsent(control) >= 0.5\"\n");
+    fprintf(stdout, "  -g FILE   groups of samples for -e, one per line: \"name: samples\" where samples are 0-based indexes\n");
+    fprintf(stdout, "            or ranges (e.g. \"case: 0-4 9\"); the group \"all\" has all the samples by default\n");
     fprintf(stdout, "  -o FILE   output filtered matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -S INT    sketch mode: only output the retained k-mers sampled with FracMinHash at scale INT\n");
+    fprintf(stdout, "            (about 1/INT of them, chosen by hash so that the same k-mers are sampled in any matrix) [1]\n");
+    fprintf(stdout, "  -K FILE   also write all the retained k-mers (sampled or not) to FILE, one per line\n");
+    fprintf(stdout, "  -c STR    only output these samples: comma-separated 0-based indexes or ranges (e.g. \"0-9\"),\n");
+    fprintf(stdout, "            or a file with one of them per line (the k-mers are still filtered on all samples)\n");
     fprintf(stdout, "  -v        verbose output\n");
     fprintf(stdout, "  -h        print this help message\n");
     return 0;
   }
 
-  FILE *matfile = strcmp(argv[optind],"-") ? fopen(argv[optind],"r") : stdin;
+  filter_expr expr;
+  sample_groups groups;
+  std::string expr_error;
+  if(expr_text && !expr.parse(expr_text, expr_error)) {
+    fprintf(stderr, "[error] %s\n", expr_error.c_str());
+    return 1;
+  }
+  if(groups_fname && !load_sample_groups(groups_fname, {}, groups, expr_error)) {
+    fprintf(stderr, "[error] %s\n", expr_error.c_str());
+    return 1;
+  }
+
+  column_projection proj;
+  std::string proj_error;
+  if(columns_spec && !proj.parse(columns_spec, {}, proj_error)) {
+    fprintf(stderr, "[error] %s (-c)\n", proj_error.c_str());
+    return 1;
+  }
+
+  FILE *matfile = open_kmer_matrix(argv[optind]);
   if(matfile == NULL) { 
     fprintf(stderr,"[error] cannot open file \"%s\"\n",argv[optind]);
     return 1;
   }
 
-  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  FILE *outfile = create_kmer_matrix(out_fname);
   if(outfile != stdout && outfile == NULL) {
     if(matfile != stdin){ fclose(matfile); }
     fprintf(stderr,"[error] cannot open output file \"%s\"\n",out_fname);
     return 1;
   }
 
-  size_t n_samples = 0, n_kmers = 0, n_retrieved = 0;
+  FILE *kmersfile = NULL;
+  if(kmers_fname && (kmersfile = fopen(kmers_fname,"w")) == NULL) {
+    if(matfile != stdin){ fclose(matfile); }
+    if(outfile != stdout){ fclose(outfile); }
+    fprintf(stderr,"[error] cannot open output file \"%s\"\n",kmers_fname);
+    return 1;
+  }
+
+  progress_meter &progress = progress_meter::global();
+  progress.watch_input(matfile);
+  progress.watch_output(outfile);
+
+  size_t n_samples = 0, n_kmers = 0, n_retrieved = 0, n_sampled = 0;
+  int ret = 0;
+  std::vector<uint32_t> counts;
+  std::string proj_row;
+  std::vector<uint32_t> proj_delims;
 
   char *line = NULL, *line_cpy = NULL;
   size_t line_size = 0, line_cpy_size = 0;
@@ -99,22 +171,61 @@ int main_basic_filter(int argc, char **argv) {
 
     char *elem = strtok(line," \t\n");
     if(elem == NULL){ continue; } // skip empty lines
+    char *kmer = elem;
     ++n_kmers;
+    progress.add(PROGRESS_ROWS);
 
     size_t n_zeros = 0, n_present = 0;
+    counts.clear();
     while((elem = strtok(NULL," \t\n")) != NULL) {
       if(n_kmers == 1){ 
         ++n_samples; 
       }
       size_t val = strtol(elem,NULL,10);
       if(val >= min_abund){ ++n_present; } else { ++n_zeros; }
+      if(expr_text) { counts.push_back(std::min<size_t>(val, UINT32_MAX)); }
+    }
+    if(n_kmers == 1 && expr_text) {
+      if(!expr.compile(n_samples, groups, std::min<size_t>(min_abund, UINT32_MAX), false, expr_error)) {
+        fprintf(stderr, "[error] %s\n", expr_error.c_str());
+        ret = 1;
+        break;
+      }
+      fprintf(stderr, "[info] filter: %s\n", expr.str().c_str());
+    }
+    if(expr_text && counts.size() != n_samples) {
+      fprintf(stderr, "[error] k-mer %s has %lu samples instead of %lu\n", kmer, counts.size(), n_samples);
+      ret = 1;
+      break;
+    }
+    if(n_kmers == 1 && columns_spec && proj.max_col() >= n_samples) {
+      fprintf(stderr, "[error] sample %lu selected but the matrix has %lu samples\n", proj.max_col(), n_samples);
+      ret = 1;
+      break;
     }
 
     bool enough_zeros = (min_zero_frac_opt && n_zeros >= min_zero_frac*n_samples) || (!min_zero_frac_opt && n_zeros >= min_zeros);
     bool enough_nz = (min_nz_frac_opt && n_present >= min_nz_frac*n_samples) || (!min_nz_frac_opt && n_present >= min_nz);
-    if(enough_zeros && enough_nz) {
+    if(expr_text ? expr(counts.data()) : (enough_zeros && enough_nz)) {
       ++n_retrieved;
-      fputs(line_cpy, outfile);
+      if(kmersfile) {
+        fputs(kmer, kmersfile);
+        fputc('\n', kmersfile);
+      }
+      if(is_sampled_kmer(kmer, strlen(kmer), scale)) {
+        ++n_sampled;
+        if(columns_spec) {
+          proj_row.clear();
+          if(proj.project(line_cpy, line_cpy + strcspn(line_cpy, "\r\n"), proj_row, proj_delims) < 0) {
+            fprintf(stderr, "[error] k-mer %s has fewer than %lu samples\n", kmer, proj.max_col() + 1);
+            ret = 1;
+            break;
+          }
+          fwrite(proj_row.data(), 1, proj_row.size(), outfile);
+        } else {
+          fputs(line_cpy, outfile);
+        }
+      }
     }
 
     if(verbose_opt && (n_kmers & ((1U<<20)-1)) == 0) {
@@ -126,10 +237,14 @@ int main_basic_filter(int argc, char **argv) {
   fprintf(stderr, "[info] %lu\tsamples\n", n_samples);
   fprintf(stderr, "[info] %lu\ttotal k-mers\n", n_kmers);
   fprintf(stderr, "[info] %lu\tretained k-mers\n", n_retrieved);
+  if(scale > 1) {
+    fprintf(stderr, "[info] %lu\tsampled k-mers (scale %lu)\n", n_sampled, scale);
+  }
 
   free(line); free(line_cpy);
   if(matfile != stdin){ fclose(matfile); }
   if(outfile != stdout){ fclose(outfile); }
+  if(kmersfile){ fclose(kmersfile); }
 
-  return 0;
+  return ret;
 }
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "columns.h"
+#include "common.h"
+#include "kff.h"
+#include "progress.h"
+
+
+// the rows of a chunk of the matrix (whole lines) projected on the selected columns
+struct column_chunk {
+  std::string in, out;
+  std::size_t n_rows{0}, n_written{0}, n_short{0};
+};
+
+static void project_chunk(const column_projection &proj, column_chunk &chunk) {
+  std::vector<uint32_t> delims;
+  chunk.out.clear();
+  chunk.n_rows = chunk.n_written = chunk.n_short = 0;
+  const char *p = chunk.in.data(), *end = p + chunk.in.size();
+  while (p < end) {
+    const char *eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (eol == NULL) { eol = end; }
+    const char *row_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+    if (row_end > p) {
+      ++chunk.n_rows;
+      int ret = proj.project(p, row_end, chunk.out, delims);
+      if (ret == 0) { ++chunk.n_written; } else if (ret < 0) { ++chunk.n_short; }
+    }
+    p = eol + 1;
+  }
+}
+
+
+int main_columns(int argc, char **argv) {
+
+  char *out_fname = NULL;
+  std::string spec;
+  column_projection proj;
+  bool header_opt = false;
+  size_t nb_threads = 1;
+  bool help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "c:l:Ho:t:zh")) != -1) {
+    switch (c) {
+      case 'c':
+        spec = optarg;
+        break;
+      case 'l':
+        proj.lead = std::max(1L, strtol(optarg, NULL, 10));
+        break;
+      case 'H':
+        header_opt = true;
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 't':
+        nb_threads = std::max(1L, strtol(optarg, NULL, 10));
+        break;
+      case 'z':
+        proj.drop_zero = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(argc-optind != 1 || spec.empty() || help_opt) {
+    fprintf(stdout, "Usage: kmat_tools columns [options] -c <samples> <in.mat>\n\n");
+    fprintf(stdout, "Select a subset of the samples (columns) of a k-mer or unitig matrix (\"-\" for stdin).\n");
+    fprintf(stdout, "Fields must be separated by a single space, tab or comma, which is kept in the output.\n");
+    fprintf(stdout, "The input matrix can be a text or a KFF file, the output matrix is written in KFF if its name ends with \".kff\".\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -c STR    samples to output, in this order: comma-separated 0-based indexes, ranges (e.g. \"0-9\"),\n");
+    fprintf(stdout, "            or sample names of the header (see -H), or a file with one of them per line (required)\n");
+    fprintf(stdout, "  -l INT    number of leading columns always kept (e.g. 3 for the matrices of \"unitig -S\") [1]\n");
+    fprintf(stdout, "  -H        the first line is a header (detected for the csv matrices of \"kmat_tools convert\")\n");
+    fprintf(stdout, "  -z        skip the rows whose selected values are all zero\n");
+    fprintf(stdout, "  -o FILE   write the matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -t INT    number of threads [1]\n");
+    fprintf(stdout, "  -h        print this help message\n");
+    return 0;
+  }
+
+  const char *mat_fname = argv[optind];
+  FILE *matfile = open_kmer_matrix(mat_fname);
+  if(matfile == NULL) {
+    fprintf(stderr, "[error] cannot open file \"%s\"\n", mat_fname);
+    return 1;
+  }
+
+  // the first line gives the number of columns, and the sample names if it is a header
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len = getline(&line, &line_size, matfile);
+  if(len <= 0) {
+    fprintf(stderr, "[error] empty matrix \"%s\"\n", mat_fname);
+    free(line);
+    if(matfile != stdin) { fclose(matfile); }
+    return 1;
+  }
+  std::string first(line, len);
+  free(line);
+  while(!first.empty() && (first.back() == '\n' || first.back() == '\r')) { first.pop_back(); }
+
+  std::vector<std::string> fields;
+  for(std::size_t start = 0, d; ; start = d + 1) {
+    d = std::find_if(first.begin() + start, first.end(), is_field_delim) - first.begin();
+    fields.push_back(first.substr(start, d - start));
+    if(d == first.size()) { break; }
+  }
+  header_opt = header_opt || fields[0] == "Unitigs_id";
+  if(fields.size() <= proj.lead) {
+    fprintf(stderr, "[error] the matrix has no sample column (-l %lu)\n", proj.lead);
+    if(matfile != stdin) { fclose(matfile); }
+    return 1;
+  }
+  std::size_t n_samples = fields.size() - proj.lead;
+
+  std::vector<std::string> names;
+  if(header_opt) { names.assign(fields.begin() + proj.lead, fields.end()); }
+  std::string error;
+  if(!proj.parse(spec, names, error)) {
+    fprintf(stderr, "[error] %s (-c)\n", error.c_str());
+    if(matfile != stdin) { fclose(matfile); }
+    return 1;
+  }
+  if(proj.max_col() >= n_samples) {
+    fprintf(stderr, "[error] sample %lu selected but the matrix has %lu samples\n", proj.max_col(), n_samples);
+    if(matfile != stdin) { fclose(matfile); }
+    return 1;
+  }
+
+  FILE *outfile = create_kmer_matrix(out_fname);
+  if(outfile == NULL) {
+    if(matfile != stdin) { fclose(matfile); }
+    fprintf(stderr, "[error] cannot open output file \"%s\"\n", out_fname);
+    return 1;
+  }
+
+  if(header_opt) {
+    std::string out;
+    std::vector<uint32_t> delims;
+    column_projection header_proj = proj;
+    header_proj.drop_zero = false;
+    header_proj.project(first.data(), first.data() + first.size(), out, delims);
+    fwrite(out.data(), 1, out.size(), outfile);
+  }
+
+  progress_meter &progress = progress_meter::global();
+  progress.watch_input(matfile);
+  progress.watch_output(outfile);
+
+  // chunks of whole lines are read in turn, projected by the threads, then written in order
+  constexpr std::size_t chunk_size = 1 << 22;
+  std::vector<column_chunk> chunks(nb_threads);
+  std::string carry = header_opt ? "" : first + "\n";
+  std::size_t n_rows = 0, n_written = 0, n_short = 0;
+  bool eof = false;
+  while(!eof) {
+    std::size_t n_chunks = 0;
+    for(; n_chunks < nb_threads && !eof; ++n_chunks) {
+      std::string &buf = chunks[n_chunks].in;
+      buf.swap(carry);
+      carry.clear();
+      std::size_t old_size = buf.size();
+      buf.resize(old_size + chunk_size);
+      std::size_t n = fread(&buf[old_size], 1, chunk_size, matfile);
+      buf.resize(old_size + n);
+      if(n < chunk_size) {
+        eof = true;
+      } else {
+        // keep the last partial line for the next chunk
+        std::size_t last = buf.rfind('\n');
+        std::size_t cut = (last == std::string::npos) ? 0 : last + 1;
+        carry.assign(buf, cut, std::string::npos);
+        buf.resize(cut);
+      }
+    }
+
+    std::atomic<std::size_t> next{0};
+    auto worker = [&]() {
+      for(std::size_t i; (i = next++) < n_chunks; ) { project_chunk(proj, chunks[i]); }
+    };
+    std::vector<std::thread> workers;
+    for(std::size_t t = 1; t < n_chunks; ++t) { workers.emplace_back(worker); }
+    worker();
+    for(auto &t : workers) { t.join(); }
+
+    for(std::size_t i = 0; i < n_chunks; ++i) {
+      fwrite(chunks[i].out.data(), 1, chunks[i].out.size(), outfile);
+      n_rows += chunks[i].n_rows;
+      progress.add(PROGRESS_ROWS, chunks[i].n_rows);
+      n_written += chunks[i].n_written;
+      n_short += chunks[i].n_short;
+    }
+  }
+
+  fprintf(stderr, "[info] %lu\tsamples selected out of %lu\n", proj.cols.size(), n_samples);
+  fprintf(stderr, "[info] %lu\trows\n", n_rows);
+  if(proj.drop_zero) {
+    fprintf(stderr, "[info] %lu\trows with all selected values zero skipped\n", n_rows - n_written - n_short);
+  }
+
+  if(matfile != stdin) { fclose(matfile); }
+  if(outfile != stdout) { fclose(outfile); }
+
+  if(n_short > 0) {
+    fprintf(stderr, "[error] %lu rows with fewer than %lu columns were skipped\n", n_short, proj.lead + proj.max_col() + 1);
+    return 1;
+  }
+
+  return 0;
+}
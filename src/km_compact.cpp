@@ -0,0 +1,121 @@
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "kmer_graph.h"
+
+
+// number of buckets of the k-mer set, fixed so that the output does not depend on the number of threads
+#define COMPACT_BUCKETS 4096
+
+
+// read all the k-mers of a matrix (*line_ptr holding its first line) and output its maximal unitigs
+template <typename kmer_t>
+static int write_unitigs(FILE *fp, FILE *outfile, size_t ksize, size_t min_len, size_t nb_threads, char **line_ptr, size_t *line_size) {
+  kmer_set<kmer_t> set(ksize, COMPACT_BUCKETS);
+  size_t kmer_count = read_matrix_kmers(fp, set, line_ptr, line_size);
+  fprintf(stderr, "[info] %zu k-mers processed.\n", kmer_count);
+
+  set.build(nb_threads);
+  fprintf(stderr, "[info] %zu distinct canonical k-mers.\n", set.size());
+
+  // unitigs are buffered by bucket and written in bucket order
+  std::vector<std::string> buffers(set.nb_buckets()+1);
+  std::vector<size_t> nb_unitigs(set.nb_buckets()+1, 0);
+  compute_unitigs(set, nb_threads, [&](const std::string &seq, size_t b) {
+    nb_unitigs[b]++;
+    if(seq.length() < min_len) { return; }
+    buffers[b].append(seq);
+    buffers[b].push_back('\n');
+  });
+
+  size_t nb_total = 0, nb_written = 0;
+  for(size_t b = 0; b < buffers.size(); ++b) {
+    nb_total += nb_unitigs[b];
+    for(size_t begin = 0, end; begin < buffers[b].size(); begin = end + 1) {
+      end = buffers[b].find('\n', begin);
+      fprintf(outfile, ">%zu LN:i:%zu\n%.*s\n", nb_written++, end - begin, (int)(end - begin), buffers[b].data() + begin);
+    }
+    std::string().swap(buffers[b]);
+  }
+  fprintf(stderr, "[info] %zu unitigs built, %zu written.\n", nb_total, nb_written);
+
+  return 0;
+}
+
+
+int main_compact(int argc, char **argv) {
+
+  char *out_fname = NULL;
+  size_t min_len = 0;
+  size_t nb_threads = 1;
+  bool help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "l:o:t:h")) != -1) {
+    switch (c) {
+      case 'l':
+        min_len = strtoul(optarg, NULL, 10);
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 't':
+        nb_threads = std::max(1L, strtol(optarg, NULL, 10));
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(argc-optind != 1 || help_opt) {
+    fprintf(stdout, "Usage: kmat_tools compact [options] <in.mat>\n\n");
+
+    fprintf(stdout, "Builds the maximal unitigs of the de Bruijn graph of the k-mers of a k-mer matrix.\n");
+    fprintf(stdout, "k-mer size (<= 63) is inferred from the first non-empty line.\n\n");
+
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -l INT   minimum unitig length [0]\n");
+    fprintf(stdout, "  -o FILE  output FASTA file of unitigs to FILE [stdout]\n");
+    fprintf(stdout, "  -t INT   number of threads [1]\n");
+    fprintf(stdout, "  -h       print this help message\n");
+    return 0;
+  }
+
+  FILE *fp = strcmp(argv[optind],"-") ? fopen(argv[optind],"r") : stdin;
+  if(fp == NULL) {
+    fprintf(stderr,"[error] cannot open file \"%s\"\n",argv[optind]);
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile != stdout && outfile == NULL) {
+    if(fp != stdin){ fclose(fp); }
+    fprintf(stderr,"[error] cannot open output file \"%s\"\n",out_fname);
+    return 1;
+  }
+
+  char *line = NULL;
+  size_t line_size = 0;
+  size_t ksize = matrix_kmer_size(fp, &line, &line_size);
+  int ret = 0;
+  if(ksize == 0 || ksize > 63) {
+    fprintf(stderr,"[error] k-mer size must be in [1,63] to build unitigs\n");
+    ret = 1;
+  } else if(ksize < 32) {
+    ret = write_unitigs<uint64_t>(fp, outfile, ksize, min_len, nb_threads, &line, &line_size);
+  } else {
+    ret = write_unitigs<__uint128_t>(fp, outfile, ksize, min_len, nb_threads, &line, &line_size);
+  }
+
+  free(line);
+  if(fp != stdin) { fclose(fp); }
+  if(outfile != stdout){ fclose(outfile); }
+
+  return ret;
+}
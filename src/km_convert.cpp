@@ -7,13 +7,16 @@
 
 #include "../external/kseq++/seqio.hpp"
 #include "../external/json/json.hpp"
+#include "bit_matrix.h"
 #include "common.h"
+#include "progress.h"
 
 using json = nlohmann::json;
 
 int main_convert(int argc, char* argv[]) {
 
   std::string out_fname;
+  std::string bits_fname;
   bool help_opt {false};
   bool ap_flag = {false};
   double min {0.8};
@@ -21,7 +24,7 @@ int main_convert(int argc, char* argv[]) {
   bool out_write_seq {false};
 
   int c;
-  while ((c = getopt(argc, argv, "o:m:sph")) != -1) {
+  while ((c = getopt(argc, argv, "o:b:m:sph")) != -1) {
     switch (c) {
       case 'p':
         ap_flag = true;
@@ -33,6 +36,9 @@ int main_convert(int argc, char* argv[]) {
       case 'o':
         out_fname = optarg;
         break;
+      case 'b':
+        bits_fname = optarg;
+        break;
       case 's':
         out_write_seq = true;
         break;
@@ -55,11 +61,13 @@ int main_convert(int argc, char* argv[]) {
     std::cerr << "  -m float minimum value to set the presence to 1 (taking values >= of m) [0.8]\n";
     std::cerr << "  -s flag to indicate you want the unitig sequence and not the id in the matrix\n";
     std::cerr << "  -o FILE  write unitig matrix to FILE [stdout]\n";
+    std::cerr << "  -b FILE  also write a bit-packed, sample-major presence/absence matrix to FILE, using the\n";
+    std::cerr << "           -m threshold (see \"kmat_tools dist\")\n";
     std::cerr << "  -h       print this help message\n";
     return 0;
   }
 
-  if (m_used && !ap_flag){
+  if (m_used && !ap_flag && bits_fname.empty()){
     std::cerr << "[Warning] you are setting the minimum treshold but not the absence/presence option.\nThe treshold will be unused." << std::endl;
   } 
 
@@ -111,6 +119,9 @@ int main_convert(int argc, char* argv[]) {
     std::iota (std::begin(keys), std::end(keys), 0); // Fill with 0, 1, ..., color_names.size().
 
     std::vector<float> presence_values(num_colors, 0);  // Vector to store the values of "x"
+    std::vector<float> ratio_values(num_colors, 0);
+    sample_bit_matrix utg_bits(bits_fname.empty() ? 0 : num_colors, 0);
+    for (uint64_t i = 0; i < utg_bits.nb_samples; i++) { utg_bits.names[i] = color_names[i+1]; }
     std::string csv_line;
 
     //std::ofstream outputFile(out_fname);
@@ -136,15 +147,25 @@ int main_convert(int argc, char* argv[]) {
     float curr_value;
     std::ifstream colorQueryFile(color_query_Filename);
 
+    // the query output has a line per unitig
+    progress_meter &progress = progress_meter::global();
+    std::error_code ec;
+    std::uintmax_t query_size = std::filesystem::file_size(color_query_Filename, ec);
+    progress.expect_input(ec ? 0 : query_size);
+    progress.watch_output(out_fname);
+
     klibpp::KSeq unitig;
     klibpp::SeqStreamIn utg_ssi(unitigs_filename.c_str());
 
     while (std::getline(colorQueryFile, line)) {
+        progress.add(PROGRESS_ROWS);
+        progress.add(PROGRESS_BYTES_IN, line.size() + 1);
         try {
             // Parse the line as a JSON object
             json jsonObj = json::parse(line);
 
             std::fill(presence_values.begin(), presence_values.end(), 0);;  // Vector to store the values of "x"
+            std::fill(ratio_values.begin(), ratio_values.end(), 0);
             // Check if the key "x" exists and is an object
             if (jsonObj.contains("matches") && jsonObj["matches"].is_object()) {
                 json nestedObj = jsonObj["matches"];
@@ -155,6 +176,7 @@ int main_convert(int argc, char* argv[]) {
                         uint64_t index = std::stoi(key);  // Convert key to integer index
                         curr_value = value.get<float>();
                         if (index < presence_values.size()) {
+                            ratio_values[index] = curr_value;
                             if (ap_flag) {
                                 if (curr_value > min){
                                     presence_values[index] = 1;
@@ -171,6 +193,7 @@ int main_convert(int argc, char* argv[]) {
             if (unitigs_filename.size() != 0){
 
             }
+            utg_bits.push_back([&](std::size_t s) { return ratio_values[s] > min; });
             utg_ssi >> unitig;
             // std::cerr << unitig.seq << " " << unitig.name << std::endl;
             *fpout << (out_write_seq ? unitig.seq : unitig.name) << ",";
@@ -192,5 +215,10 @@ int main_convert(int argc, char* argv[]) {
         ofs.close();
     }
 
+    if(!bits_fname.empty() && !utg_bits.save(bits_fname)) {
+        std::cerr << "[error] cannot write bit-packed presence/absence matrix \"" << bits_fname << "\"\n";
+        return 1;
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "common.h"
+#include "progress.h"
 
 
 int main_diff(int argc, char **argv) {
@@ -67,6 +68,11 @@ int main_diff(int argc, char **argv) {
     return 1;
   }
 
+  progress_meter &progress = progress_meter::global();
+  progress.watch_input(mat_1);
+  progress.watch_input(mat_2);
+  progress.watch_output(outfile);
+
   char *kmer_1 = (char *)calloc(ksize+1,1);
   char *kmer_2 = (char *)calloc(ksize+1,1);
   char *line_1 = NULL, *line_2 = NULL;
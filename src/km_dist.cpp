@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bit_matrix.h"
+#include "common.h"
+
+
+// pairwise intersection sizes of the sample rows of a bit matrix, computed on tiles of
+// samples and chunks of words small enough for the rows of two tiles to stay in cache;
+// threads take the pairs of tiles in turn, each pair owning its entries of inter
+static void pairwise_intersections(const sample_bit_matrix &mat, std::size_t nb_threads, std::vector<uint64_t> &inter) {
+  constexpr std::size_t tile_size = 16;
+  constexpr std::size_t chunk_words = 1024;
+
+  std::size_t n = mat.nb_samples;
+  std::size_t n_words = mat.words();
+  std::size_t n_tiles = (n + tile_size - 1) / tile_size;
+  std::vector<std::pair<std::size_t,std::size_t>> tiles;
+  for (std::size_t ti = 0; ti < n_tiles; ++ti) {
+    for (std::size_t tj = ti; tj < n_tiles; ++tj) { tiles.emplace_back(ti, tj); }
+  }
+
+  inter.assign(n * n, 0);
+  std::atomic<std::size_t> next{0};
+  auto worker = [&]() {
+    for (std::size_t t; (t = next++) < tiles.size(); ) {
+      std::size_t i0 = tiles[t].first * tile_size, i1 = std::min(n, i0 + tile_size);
+      std::size_t j0 = tiles[t].second * tile_size, j1 = std::min(n, j0 + tile_size);
+      for (std::size_t w = 0; w < n_words; w += chunk_words) {
+        std::size_t len = std::min(chunk_words, n_words - w);
+        for (std::size_t i = i0; i < i1; ++i) {
+          for (std::size_t j = std::max(i, j0); j < j1; ++j) {
+            inter[i*n+j] += and_popcount(mat.row(i) + w, mat.row(j) + w, len);
+          }
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (std::size_t t = 0; t < std::min(nb_threads, tiles.size()); ++t) { workers.emplace_back(worker); }
+  for (auto &t : workers) { t.join(); }
+
+  for (std::size_t i = 0; i < n; ++i) {
+    for (std::size_t j = i+1; j < n; ++j) { inter[j*n+i] = inter[i*n+j]; }
+  }
+}
+
+
+int main_dist(int argc, char **argv) {
+
+  char *out_fname = NULL;
+  std::string metric = "jaccard";
+  size_t nb_threads = 1;
+  bool help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "d:o:t:h")) != -1) {
+    switch (c) {
+      case 'd':
+        metric = optarg;
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 't':
+        nb_threads = std::max(1L, strtol(optarg, NULL, 10));
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(argc-optind != 1 || help_opt) {
+    fprintf(stdout, "Usage: kmat_tools dist [options] <presence.bin>\n\n");
+    fprintf(stdout, "Compute the pairwise distances between the samples of a bit-packed presence/absence unitig matrix\n");
+    fprintf(stdout, "(see \"kmat_tools unitig -b\" and \"kmat_tools convert -b\") and output them as a tab-separated square matrix.\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -d STR    distance: \"jaccard\" (1 - |A and B| / |A or B|) or \"hamming\" (|A xor B|) [jaccard]\n");
+    fprintf(stdout, "  -o FILE   write the distance matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -t INT    number of threads [1]\n");
+    fprintf(stdout, "  -h        print this help message\n");
+    return 0;
+  }
+
+  bool jaccard = (metric == "jaccard");
+  if(!jaccard && metric != "hamming") {
+    fprintf(stderr, "[error] unknown distance \"%s\" (-d must be either jaccard or hamming)\n", metric.c_str());
+    return 1;
+  }
+
+  const char *mat_fname = argv[optind];
+  if(!std::filesystem::exists(mat_fname)) {
+    fprintf(stderr, "[error] file \"%s\" does not exist\n", mat_fname);
+    return 1;
+  }
+
+  sample_bit_matrix mat;
+  if(!mat.load(mat_fname)) {
+    fprintf(stderr, "[error] \"%s\" is not a bit-packed presence/absence matrix\n", mat_fname);
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile == NULL) {
+    fprintf(stderr, "[error] cannot open output file \"%s\"\n", out_fname);
+    return 1;
+  }
+
+  std::size_t n = mat.nb_samples;
+  fprintf(stderr, "[info] %lu\tsamples\n", n);
+  fprintf(stderr, "[info] %lu\tunitigs\n", mat.nb_unitigs);
+
+  std::vector<uint64_t> inter;
+  pairwise_intersections(mat, nb_threads, inter);
+
+  // samples without a name are identified by their (0-based) column in the unitig matrix
+  auto name = [&](std::size_t s) { return mat.names[s].empty() ? std::to_string(s) : mat.names[s]; };
+
+  for(std::size_t j = 0; j < n; ++j) { fprintf(outfile, "\t%s", name(j).c_str()); }
+  fputc('\n', outfile);
+  for(std::size_t i = 0; i < n; ++i) {
+    fputs(name(i).c_str(), outfile);
+    for(std::size_t j = 0; j < n; ++j) {
+      uint64_t both = inter[i*n+j];
+      uint64_t either = inter[i*n+i] + inter[j*n+j] - both;
+      if(jaccard) {
+        fprintf(outfile, "\t%.6f", either ? 1.0 - (double)both/either : 0.0);
+      } else {
+        fprintf(outfile, "\t%lu", either - both);
+      }
+    }
+    fputc('\n', outfile);
+  }
+
+  if(outfile != stdout) { fclose(outfile); }
+
+  return 0;
+}
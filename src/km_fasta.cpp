@@ -1,18 +1,52 @@
+#include <mutex>
 
 #include "common.h"
+#include "kff.h"
+#include "kmer_graph.h"
+#include "progress.h"
+
+
+// read all the k-mers of a matrix (*line_ptr holding its first line) and output them chained in simplitigs
+template <typename kmer_t>
+static int write_simplitigs(FILE *fp, FILE *outfile, size_t ksize, size_t nb_threads, char **line_ptr, size_t *line_size) {
+  kmer_set<kmer_t> set(ksize, 64*nb_threads);
+  size_t kmer_count = read_matrix_kmers(fp, set, line_ptr, line_size);
+  fprintf(stderr, "[info] %zu k-mers processed.\n", kmer_count);
+
+  set.build(nb_threads);
+
+  std::mutex out_mutex;
+  size_t nb_strings = 0, nb_nucs = 0;
+  compute_simplitigs(set, nb_threads, [&](const std::string &seq) {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    fprintf(outfile, ">%zu\n%s\n", ++nb_strings, seq.c_str());
+    nb_nucs += seq.length();
+  });
+  fprintf(stderr, "[info] %zu simplitigs written (%zu nucleotides).\n", nb_strings, nb_nucs);
+
+  return 0;
+}
 
 
 int main_fasta(int argc, char **argv) {
 
   char *out_fname = NULL;
+  size_t nb_threads = 1;
+  bool compact = false;
   bool help_opt = false;
 
   int c;
-  while ((c = getopt(argc, argv, "o:h")) != -1) {
+  while ((c = getopt(argc, argv, "o:t:ch")) != -1) {
     switch (c) {
       case 'o':
         out_fname = optarg;
         break;
+      case 't':
+        nb_threads = std::max(1L, strtol(optarg, NULL, 10));
+        break;
+      case 'c':
+        compact = true;
+        break;
       case 'h':
         help_opt = true;
         break;
@@ -26,16 +60,19 @@ int main_fasta(int argc, char **argv) {
   if(argc-optind != 1 || help_opt) {
     fprintf(stdout, "Usage: kmat_tools fasta [options] <in.mat>\n\n");
 
-    fprintf(stdout, "Outputs k-mers of a k-mer matrix in FASTA format.\n");
+    fprintf(stdout, "Outputs k-mers of a k-mer matrix (text or KFF file) in FASTA format.\n");
     fprintf(stdout, "k-mer size is inferred from the first non-empty line.\n\n");
     
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -o FILE  output FASTA file of k-mers to FILE [stdout]\n");
+    fprintf(stdout, "  -c       chain overlapping k-mers into simplitigs instead of writing one k-mer per record\n");
+    fprintf(stdout, "           (the set of k-mers is unchanged, k must be <= 63)\n");
+    fprintf(stdout, "  -t INT   number of threads used with -c [1]\n");
     fprintf(stdout, "  -h       print this help message\n");
     return 0;
   }
 
-  FILE *fp = strcmp(argv[optind],"-") ? fopen(argv[optind],"r") : stdin;
+  FILE *fp = open_kmer_matrix(argv[optind]);
   if(fp == NULL) {
     fprintf(stderr,"[error] cannot open file \"%s\"\n",argv[optind]);
     return 1;
@@ -48,12 +85,36 @@ int main_fasta(int argc, char **argv) {
     return 1;
   }
 
+  progress_meter &progress = progress_meter::global();
+  progress.watch_input(fp);
+  progress.watch_output(outfile);
+
+  if(compact) {
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t ksize = matrix_kmer_size(fp, &line, &line_size);
+    int ret = 0;
+    if(ksize == 0 || ksize > 63) {
+      fprintf(stderr,"[error] k-mer size must be in [1,63] to compute simplitigs\n");
+      ret = 1;
+    } else if(ksize < 32) {
+      ret = write_simplitigs<uint64_t>(fp, outfile, ksize, nb_threads, &line, &line_size);
+    } else {
+      ret = write_simplitigs<__uint128_t>(fp, outfile, ksize, nb_threads, &line, &line_size);
+    }
+    free(line);
+    if(fp != stdin) { fclose(fp); }
+    if(outfile != stdout){ fclose(outfile); }
+    return ret;
+  }
+
   char *line = NULL;
   size_t line_size=0, line_num=0, kmer_count=0;
   
   ssize_t ch_read = getline(&line, &line_size, fp);
   while(ch_read >= 0) {
     ++line_num;
+    progress.add(PROGRESS_ROWS);
 
     if(ch_read == 0 || line[0]=='\n') { // skip empty lines
       continue;
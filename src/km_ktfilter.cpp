@@ -1,13 +1,25 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <filesystem>
+#include <fstream>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <string>
+#include <thread>
+#include <type_traits>
 
 #include <fmt/format.h>
 
 #include "kmtricks.h"
 #include "common.h"
+#include "bit_matrix.h"
+#include "filter_expr.h"
+#include "filter_summary.h"
+#include "partition_prefetch.h"
+#include "progress.h"
 
 namespace fs = std::filesystem;
 
@@ -15,6 +27,7 @@ struct filter_options {
   fs::path matrices_dir;
   fs::path filtered_dir;
   fs::path output;
+  fs::path kmers_output;
   std::size_t min_zeros{10};
   std::size_t min_nz{10};
   std::size_t min_abund{1};
@@ -24,32 +37,114 @@ struct filter_options {
   bool min_nz_frac_set{false};
   uint32_t kmer_size{31};
   std::size_t nb_threads{1};
+  bool pa_matrix{false};
+  uint64_t scale{1};
+  std::string expr_text;
+  fs::path groups_file;
+  filter_expr expr;
+  std::size_t nb_samples{0};
+  std::vector<uint32_t> summary_cutoffs;
+  fs::path summary_dir;
+  bool dry_run{false};
+  prefetch_options prefetch;
+  std::atomic<std::size_t> nb_summarized{0};  // partitions filtered from their summary
 };
 
 void print_filter_usage() {
   filter_options opt;
   fmt::print("Usage: kmat_tools ktfilter [options] <kmtricks_run_dir>\n\n");
-  fmt::print("Filter a kmtricks matrix by selecting k-mers that are potentially differential.\n\n");
+  fmt::print("Filter a kmtricks matrix by selecting k-mers that are potentially differential.\n");
+  fmt::print("Both count (--mode kmer:count:bin) and presence/absence (--mode kmer:pa:bin) matrices are supported.\n\n");
   fmt::print("Options:\n");
-  fmt::print("  -a INT    min abundance to define a k-mer as present in a sample [{}]\n", opt.min_abund);
+  fmt::print("  -a INT    min abundance to define a k-mer as present in a sample (ignored for presence/absence matrices) [{}]\n", opt.min_abund);
   fmt::print("  -n INT    min number of samples for which a k-mer should be absent [{}]\n", opt.min_zeros);
   fmt::print("  -f FLOAT  fraction of samples for which a k-mer should be absent (overrides -n)\n");
   fmt::print("  -N INT    min number of samples for which a k-mer should be present [{}]\n", opt.min_nz);
   fmt::print("  -F FLOAT  fraction of samples for which a k-mer should be present (overrides -N)\n");
+  fmt::print("  -e EXPR   retain the k-mers satisfying EXPR instead (overrides -n/-f/-N/-F), a combination with &&, ||\n");
+  fmt::print("            and ! of comparisons of present(G), absent(G), fpresent(G), fabsent(G) (number or fraction\n");
+  fmt::print("            of samples of group G where the k-mer abundance is at least -a, or the second argument if any),\n");
+  fmt::print("            sum(G) or mean(G) with a number, e.g. \"fpresent(case) >= 30% && fabsent(control) >= 0.5\"\n");
+  fmt::print("  -g FILE   groups of samples for -e, one per line: \"name: samples\" where samples are 0-based indexes,\n");
+  fmt::print("            ranges or sample IDs of the kmtricks input file (e.g. \"case: 0-4 S9\"); the group \"all\"\n");
+  fmt::print("            has all the samples by default\n");
   fmt::print("  -o FILE   output filtered matrix to FILE [stdout]\n");
+  fmt::print("  -S INT    sketch mode: only output the retained k-mers sampled with FracMinHash at scale INT\n");
+  fmt::print("            (about 1/INT of them, chosen by hash so that the same k-mers are sampled in any matrix) [{}]\n", opt.scale);
+  fmt::print("  -K FILE   also write all the retained k-mers (sampled or not) to FILE, one per line\n");
+  fmt::print("  -C LIST   also write a summary of each partition in \"<kmtricks_run_dir>/matrices_summary\": the number of samples\n");
+  fmt::print("            where each k-mer has an abundance of at least each cutoff of LIST (e.g. \"1,2,5\"); later runs with\n");
+  fmt::print("            -a among the cutoffs (and no -e) decide from the summaries and only read the partitions with\n");
+  fmt::print("            retained k-mers\n");
+  fmt::print("  -d        dry run: only print the number of retained k-mers, computed from the summaries (see -C)\n");
+  fmt::print("  -p INT    number of 1 MiB reads of a partition kept in flight while it is filtered (with io_uring when\n");
+  fmt::print("            available, or a reader thread), 0 for blocking reads [{}]\n", opt.prefetch.depth);
   fmt::print("  -t INT    number of threads [stdout]\n");
   fmt::print("  -w PATH   working directory for temporary files [\"<kmtricks_run_dir>/matrices_filtered\"]\n");
   fmt::print("  -h        print this help message\n");
 }
 
+// sample IDs of the kmtricks input file copied in the run directory ("ID : FILE_1 ; FILE_2 ; ...")
+static std::vector<std::string> fof_sample_ids(const fs::path &fof) {
+  std::vector<std::string> ids;
+  std::ifstream in(fof);
+  for (std::string line; std::getline(in, line);) {
+    std::size_t pos = line.find(':');
+    if (pos == std::string::npos) { continue; }
+    std::string id = line.substr(0, pos);
+    id.erase(0, id.find_first_not_of(" \t"));
+    id.erase(id.find_last_not_of(" \t") + 1);
+    ids.push_back(id);
+  }
+  return ids;
+}
+
+static inline bool is_retained(std::size_t n_present, std::size_t n_samples, const filter_options &opts) {
+  std::size_t n_zeros = n_samples - n_present;
+  bool enough_zeros = (opts.min_zero_frac_set && n_zeros >= opts.min_zero_frac*n_samples) || (!opts.min_zero_frac_set && n_zeros >= opts.min_zeros);
+  bool enough_nz = (opts.min_nz_frac_set && n_present >= opts.min_nz_frac*n_samples) || (!opts.min_nz_frac_set && n_present >= opts.min_nz);
+  return enough_zeros && enough_nz;
+}
+
+// cutoffs of the summaries written with -C (presence/absence partitions only have presence bits)
+static std::vector<uint32_t> summary_cutoffs(const filter_options &opts) {
+  return opts.pa_matrix ? std::vector<uint32_t>{1} : opts.summary_cutoffs;
+}
+
+// open the summary of a partition if the retained k-mers can be decided from it: it is up to
+// date and has the -a cutoff (and exactly the -C cutoffs if any, so that it is rewritten otherwise)
+static bool open_summary(filter_summary_reader &summary, const std::string &path, const std::string &partition, const filter_options &opts, std::size_t &cutoff) {
+  if (!opts.expr_text.empty() || !summary.open(path, partition, opts.nb_samples)) { return false; }
+  if (!opts.summary_cutoffs.empty() && summary.cutoffs() != summary_cutoffs(opts)) { return false; }
+  const std::vector<uint32_t> &cutoffs = summary.cutoffs();
+  auto it = std::find(cutoffs.begin(), cutoffs.end(), opts.pa_matrix ? 1 : opts.min_abund);
+  cutoff = it - cutoffs.begin();
+  return it != cutoffs.end();
+}
+
+// number of k-mers of a partition retained according to its summary, -1 if it cannot be used
+static long summary_retained(const std::string &path, const std::string &partition, const filter_options &opts, std::size_t &nb_kmers) {
+  filter_summary_reader summary;
+  std::size_t cutoff;
+  if (!open_summary(summary, path, partition, opts, cutoff)) { return -1; }
+  std::vector<uint32_t> nb_present(summary.cutoffs().size());
+  long n = 0;
+  nb_kmers = summary.nb_kmers();
+  for (std::size_t i = 0; i < nb_kmers; ++i) {
+    if (!summary.next(nb_present.data())) { return -1; }
+    n += is_retained(nb_present[cutoff], opts.nb_samples, opts);
+  }
+  return n;
+}
+
 template<size_t MAX_K>
 class FilterTask : public km::ITask
 {
   using count_type = typename km::selectC<DMAX_C>::type;
 
 public:
-  FilterTask(std::string &input, std::string &output, std::size_t &nb_kmers, std::size_t &nb_retained, filter_options &opts, bool compress = true)
-    : km::ITask(4, false), m_input(input), m_output(output), m_nb_kmers(nb_kmers), m_nb_retained(nb_retained), m_opts(opts), m_compress(compress)
+  FilterTask(std::string &input, std::string &output, std::string &sketch_output, std::string &summary, std::size_t &nb_kmers, std::size_t &nb_retained, std::size_t &nb_sampled, filter_options &opts, bool compress = true)
+    : km::ITask(4, false), m_input(input), m_output(output), m_sketch_output(sketch_output), m_summary(summary), m_nb_kmers(nb_kmers), m_nb_retained(nb_retained), m_nb_sampled(nb_sampled), m_opts(opts), m_compress(compress)
   {}
 
   void preprocess() {}
@@ -57,46 +152,195 @@ public:
 
   void exec()
   {
-    km::MatrixReader reader(m_input);
+    prefetching_reader<km::MatrixReader<8192>> reader(m_input, m_opts.prefetch);
     km::Kmer<MAX_K> kmer; kmer.set_k(m_opts.kmer_size);
     
     std::size_t n_samples{reader.infos().nb_counts};
     std::vector<count_type> counts(n_samples);
     
-    km::MatrixWriter<8192> writer(m_output,
-      m_opts.kmer_size,
-      reader.infos().count_slots,
-      n_samples,
-      reader.infos().id,
-      reader.infos().partition,
-      m_compress);
+    // retained k-mers are written to m_output and, in sketch mode, the sampled ones to m_sketch_output
+    // (either path can be empty when the corresponding output is not needed)
+    auto make_writer = [&](const std::string &path) {
+      return path.empty() ? nullptr : std::make_unique<km::MatrixWriter<8192>>(path,
+        m_opts.kmer_size,
+        reader.infos().count_slots,
+        n_samples,
+        reader.infos().id,
+        reader.infos().partition,
+        m_compress);
+    };
+    auto writer = make_writer(m_output);
+    auto sketch_writer = make_writer(m_sketch_output);
+
+    // with an up-to-date summary, the retained k-mers are known without looking at their counts,
+    // and a partition without any is not read
+    filter_summary_reader summary;
+    std::size_t cutoff = 0, summary_kmers = 0;
+    long summary_nb_retained = summary_retained(m_summary, m_input, m_opts, summary_kmers);
+    if (summary_nb_retained == 0) { m_nb_kmers += summary_kmers; m_opts.nb_summarized++; return; }
+    bool from_summary = summary_nb_retained > 0 && open_summary(summary, m_summary, m_input, m_opts, cutoff);
+    std::vector<uint32_t> nb_present(from_summary ? summary.cutoffs().size() : 0);
+    if (from_summary) { m_opts.nb_summarized++; }
 
+    // otherwise, the summary is written with -C
+    std::vector<uint32_t> cutoffs = summary_cutoffs(m_opts);
+    std::vector<uint32_t> cutoff_present(cutoffs.size());
+    std::unique_ptr<filter_summary_writer> summary_writer;
+    if (!from_summary && !m_opts.summary_cutoffs.empty()) {
+      summary_writer = std::make_unique<filter_summary_writer>(m_summary, m_input, n_samples, cutoffs);
+      if (!summary_writer->good()) {
+        fmt::print(stderr, "[warning] cannot write summary \"{}\"\n", m_summary);
+        summary_writer.reset();
+      }
+    }
+    std::vector<uint64_t> cutoff_bits(bit_row_words(n_samples));
+
+    static_assert(std::is_same_v<count_type, uint32_t>, "filter expressions are evaluated on 32-bit counts");
+    bool use_expr = !m_opts.expr_text.empty();
+
+    progress_meter &progress = progress_meter::global();
     while (reader.template read<MAX_K, DMAX_C>(kmer, counts)) {
       m_nb_kmers++;
-      std::size_t n_zeros{0};
-      std::size_t n_present{0};
-      for (auto& c : counts) {
-        if(c >= m_opts.min_abund){ 
-          n_present++;
-        } else { 
-          n_zeros++; 
+      progress.add(PROGRESS_ROWS);
+      bool retained;
+      if (from_summary && summary.next(nb_present.data())) {
+        retained = is_retained(nb_present[cutoff], n_samples, m_opts);
+      } else if (use_expr) {
+        retained = m_opts.expr(counts.data());
+      } else {
+        std::size_t n_present{0};
+        for (auto& c : counts) {
+          n_present += (c >= m_opts.min_abund);
         }
+        retained = is_retained(n_present, n_samples, m_opts);
+      }
+      if (summary_writer) {
+        for (std::size_t c = 0; c < cutoffs.size(); ++c) {
+          threshold_bit_row(counts.data(), n_samples, cutoffs[c], cutoff_bits.data());
+          cutoff_present[c] = and_popcount(cutoff_bits.data(), cutoff_bits.data(), cutoff_bits.size());
+        }
+        summary_writer->add(cutoff_present.data());
       }
 
-      bool enough_zeros = (m_opts.min_zero_frac_set && n_zeros >= m_opts.min_zero_frac*n_samples) || (!m_opts.min_zero_frac_set && n_zeros >= m_opts.min_zeros);
-      bool enough_nz = (m_opts.min_nz_frac_set && n_present >= m_opts.min_nz_frac*n_samples) || (!m_opts.min_nz_frac_set && n_present >= m_opts.min_nz);
-      if(enough_zeros && enough_nz) {
+      if(retained) {
         m_nb_retained++;
-        writer.template write<MAX_K, DMAX_C>(kmer,counts);
+        if (writer) { writer->template write<MAX_K, DMAX_C>(kmer,counts); }
+        if (sketch_writer && is_sampled_kmer(kmer.to_string().c_str(), m_opts.kmer_size, m_opts.scale)) {
+          m_nb_sampled++;
+          sketch_writer->template write<MAX_K, DMAX_C>(kmer,counts);
+        }
       }
     }
+
+    if (summary_writer && !summary_writer->finish()) {
+      fmt::print(stderr, "[warning] cannot write summary \"{}\"\n", m_summary);
+    }
   }
 
 private:
   std::string& m_input;
   std::string& m_output;
+  std::string& m_sketch_output;
+  std::string& m_summary;
   std::size_t& m_nb_kmers;
   std::size_t& m_nb_retained;
+  std::size_t& m_nb_sampled;
+  filter_options& m_opts;
+  bool m_compress;
+};
+
+// same as FilterTask for presence/absence matrices: the number of samples in which a k-mer
+// is present is the popcount of its row, no per-sample comparison is needed
+template<size_t MAX_K>
+class PAFilterTask : public km::ITask
+{
+public:
+  PAFilterTask(std::string &input, std::string &output, std::string &sketch_output, std::string &summary, std::size_t &nb_kmers, std::size_t &nb_retained, std::size_t &nb_sampled, filter_options &opts, bool compress = true)
+    : km::ITask(4, false), m_input(input), m_output(output), m_sketch_output(sketch_output), m_summary(summary), m_nb_kmers(nb_kmers), m_nb_retained(nb_retained), m_nb_sampled(nb_sampled), m_opts(opts), m_compress(compress)
+  {}
+
+  void preprocess() {}
+  void postprocess() {}
+
+  void exec()
+  {
+    prefetching_reader<km::PAMatrixReader<8192>> reader(m_input, m_opts.prefetch);
+    km::Kmer<MAX_K> kmer; kmer.set_k(m_opts.kmer_size);
+
+    std::size_t n_samples{reader.infos().bits};
+    std::vector<uint8_t> bits(reader.infos().bytes);
+
+    auto make_writer = [&](const std::string &path) {
+      return path.empty() ? nullptr : std::make_unique<km::PAMatrixWriter<8192>>(path,
+        m_opts.kmer_size,
+        n_samples,
+        reader.infos().id,
+        reader.infos().partition,
+        m_compress);
+    };
+    auto writer = make_writer(m_output);
+    auto sketch_writer = make_writer(m_sketch_output);
+
+    // with an up-to-date summary, the retained k-mers are known without looking at their counts,
+    // and a partition without any is not read
+    filter_summary_reader summary;
+    std::size_t cutoff = 0, summary_kmers = 0;
+    long summary_nb_retained = summary_retained(m_summary, m_input, m_opts, summary_kmers);
+    if (summary_nb_retained == 0) { m_nb_kmers += summary_kmers; m_opts.nb_summarized++; return; }
+    bool from_summary = summary_nb_retained > 0 && open_summary(summary, m_summary, m_input, m_opts, cutoff);
+    std::vector<uint32_t> nb_present(from_summary ? summary.cutoffs().size() : 0);
+    if (from_summary) { m_opts.nb_summarized++; }
+
+    // otherwise, the summary is written with -C
+    std::vector<uint32_t> cutoffs = summary_cutoffs(m_opts);
+    std::vector<uint32_t> cutoff_present(cutoffs.size());
+    std::unique_ptr<filter_summary_writer> summary_writer;
+    if (!from_summary && !m_opts.summary_cutoffs.empty()) {
+      summary_writer = std::make_unique<filter_summary_writer>(m_summary, m_input, n_samples, cutoffs);
+      if (!summary_writer->good()) {
+        fmt::print(stderr, "[warning] cannot write summary \"{}\"\n", m_summary);
+        summary_writer.reset();
+      }
+    }
+
+    progress_meter &progress = progress_meter::global();
+    while (reader.template read<MAX_K>(kmer, bits)) {
+      m_nb_kmers++;
+      progress.add(PROGRESS_ROWS);
+      std::size_t n_present = popcount_bytes(bits.data(), bits.size());
+      bool retained;
+      if (from_summary && summary.next(nb_present.data())) {
+        retained = is_retained(nb_present[cutoff], n_samples, m_opts);
+      } else {
+        retained = m_opts.expr_text.empty() ? is_retained(n_present, n_samples, m_opts) : m_opts.expr(bits.data());
+      }
+      if (summary_writer) {
+        cutoff_present[0] = n_present;
+        summary_writer->add(cutoff_present.data());
+      }
+      if(retained) {
+        m_nb_retained++;
+        if (writer) { writer->template write<MAX_K>(kmer, bits); }
+        if (sketch_writer && is_sampled_kmer(kmer.to_string().c_str(), m_opts.kmer_size, m_opts.scale)) {
+          m_nb_sampled++;
+          sketch_writer->template write<MAX_K>(kmer, bits);
+        }
+      }
+    }
+
+    if (summary_writer && !summary_writer->finish()) {
+      fmt::print(stderr, "[warning] cannot write summary \"{}\"\n", m_summary);
+    }
+  }
+
+private:
+  std::string& m_input;
+  std::string& m_output;
+  std::string& m_sketch_output;
+  std::string& m_summary;
+  std::size_t& m_nb_kmers;
+  std::size_t& m_nb_retained;
+  std::size_t& m_nb_sampled;
   filter_options& m_opts;
   bool m_compress;
 };
@@ -108,29 +352,140 @@ struct filter_functor {
 
   void operator()(filter_options &opts)
   {
+    // with -d, only count the retained k-mers from the summaries
+    if (opts.dry_run) {
+      std::size_t nb_total = 0, nb_retained = 0;
+      for (auto const& entry : std::filesystem::directory_iterator{opts.matrices_dir}) {
+        if (!fs::is_regular_file(entry)) { continue; }
+        std::size_t nb_kmers = 0;
+        long n = summary_retained(opts.summary_dir/(entry.path().filename().string() + ".sum"), entry.path(), opts, nb_kmers);
+        if (n < 0) {
+          fmt::print(stderr, "[error] no up-to-date summary of partition \"{}\" with cutoff {} (see -C)\n", entry.path().c_str(), opts.min_abund);
+          std::exit(EXIT_FAILURE);
+        }
+        nb_total += nb_kmers;
+        nb_retained += n;
+      }
+      fmt::print(stderr, "[info] {} total kmers\n", nb_total);
+      fmt::print(stderr, "[info] {} retained kmers\n", nb_retained);
+      return;
+    }
+
+    // in sketch mode the output matrix is made of the sampled partitions, while the partitions
+    // with all the retained k-mers are only needed to write them with -K
+    bool sketch = opts.scale > 1;
+    bool keep_all = !sketch || !opts.kmers_output.empty();
+    fs::path sketch_dir = opts.filtered_dir/"sketch";
+    if (sketch) { fs::create_directories(sketch_dir); }
+
     std::vector<std::string> matrix_paths;
     std::vector<std::string> filtered_paths;
+    std::vector<std::string> sketch_paths;
+    std::vector<std::string> summary_paths;
     for (auto const& entry : std::filesystem::directory_iterator{opts.matrices_dir}) {
       if(fs::is_regular_file(entry)) {
         matrix_paths.push_back(entry.path());
-        filtered_paths.push_back(opts.filtered_dir/entry.path().filename());
+        filtered_paths.push_back(keep_all ? (opts.filtered_dir/entry.path().filename()).string() : "");
+        sketch_paths.push_back(sketch ? (sketch_dir/entry.path().filename()).string() : "");
+        summary_paths.push_back((opts.summary_dir/(entry.path().filename().string() + ".sum")).string());
       }
     }
 
-    std::size_t nb_threads = std::min(opts.nb_threads,matrix_paths.size());
-    km::TaskPool pool(nb_threads);
+    std::size_t nb_threads = std::max<std::size_t>(1, std::min(opts.nb_threads,matrix_paths.size()));
     std::vector<std::size_t> nb_total_kmers(matrix_paths.size(),0);
     std::vector<std::size_t> nb_retained(matrix_paths.size(),0);
+    std::vector<std::size_t> nb_sampled(matrix_paths.size(),0);
+    std::vector<km::task_t> tasks;
     for (std::size_t i=0; i < matrix_paths.size(); i++) {
-      pool.add_task(std::make_shared<FilterTask<MAX_K>>(matrix_paths[i], filtered_paths[i], nb_total_kmers[i], nb_retained[i], opts));
+      if (opts.pa_matrix) {
+        tasks.push_back(std::make_shared<PAFilterTask<MAX_K>>(matrix_paths[i], filtered_paths[i], sketch_paths[i], summary_paths[i], nb_total_kmers[i], nb_retained[i], nb_sampled[i], opts));
+      } else {
+        tasks.push_back(std::make_shared<FilterTask<MAX_K>>(matrix_paths[i], filtered_paths[i], sketch_paths[i], summary_paths[i], nb_total_kmers[i], nb_retained[i], nb_sampled[i], opts));
+      }
+    }
+
+    // the partitions are processed largest first, each thread taking the next one as soon as it
+    // is done: a large partition started last would otherwise keep a single thread busy while the
+    // others are idle. The outputs keep the order of the partitions for the aggregation.
+    std::vector<std::uintmax_t> sizes(matrix_paths.size(), 0);
+    for (std::size_t i=0; i < matrix_paths.size(); i++) {
+      std::error_code ec;
+      sizes[i] = fs::file_size(matrix_paths[i], ec);
+      if (ec) { sizes[i] = 0; }
     }
-    pool.join_all();
+    std::vector<std::size_t> order(matrix_paths.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return sizes[a] > sizes[b]; });
 
-    km::MatrixFileAggregator<MAX_K,DMAX_C> mfa(filtered_paths, opts.kmer_size);
-    opts.output.empty() ? mfa.write_as_text(std::cout) : mfa.write_as_text(opts.output);
+    progress_meter &progress = progress_meter::global();
+    progress.phase("filtering partitions");
+    progress.expect_input(std::reduce(sizes.begin(), sizes.end(), std::uintmax_t{0}));
+
+    using clock = std::chrono::steady_clock;
+    std::vector<double> busy(nb_threads, 0);
+    std::vector<std::size_t> nb_done(nb_threads, 0);
+    std::atomic<std::size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto start = clock::now();
+    auto worker = [&](std::size_t t) {
+      for (std::size_t i; (i = next++) < order.size(); ) {
+        auto begin = clock::now();
+        try {
+          km::task_t &task = tasks[order[i]];
+          task->preprocess();
+          task->exec();
+          task->postprocess();
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error) { error = std::current_exception(); }
+          next = order.size();
+        }
+        busy[t] += std::chrono::duration<double>(clock::now() - begin).count();
+        nb_done[t]++;
+      }
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t t = 1; t < nb_threads; ++t) { workers.emplace_back(worker, t); }
+    worker(0);
+    for (auto &t : workers) { t.join(); }
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    if (error) { std::rethrow_exception(error); }
 
+    if (nb_threads > 1 && elapsed > 0) {
+      std::string usage;
+      for (std::size_t t = 0; t < nb_threads; ++t) {
+        usage += fmt::format(" {}:{}/{:.0f}%", t, nb_done[t], 100 * busy[t] / elapsed);
+      }
+      fmt::print(stderr, "[info] threads busy {:.1f}% of {:.2f}s (thread:partitions/busy){}\n",
+                 100 * std::reduce(busy.begin(), busy.end()) / (nb_threads * elapsed), elapsed, usage);
+    }
+
+    progress.phase("writing the filtered matrix");
+    progress.watch_output(opts.output.string());
+    std::vector<std::string> &output_paths = sketch ? sketch_paths : filtered_paths;
+    if (opts.pa_matrix) {
+      km::PAMatrixFileAggregator<MAX_K> mfa(output_paths, opts.kmer_size);
+      opts.output.empty() ? mfa.write_as_text(std::cout) : mfa.write_as_text(opts.output);
+      if (!opts.kmers_output.empty()) {
+        km::PAMatrixFileAggregator<MAX_K>(filtered_paths, opts.kmer_size).write_kmers(opts.kmers_output);
+      }
+    } else {
+      km::MatrixFileAggregator<MAX_K,DMAX_C> mfa(output_paths, opts.kmer_size);
+      opts.output.empty() ? mfa.write_as_text(std::cout) : mfa.write_as_text(opts.output);
+      if (!opts.kmers_output.empty()) {
+        km::MatrixFileAggregator<MAX_K,DMAX_C>(filtered_paths, opts.kmer_size).write_kmers(opts.kmers_output);
+      }
+    }
+
+    if (opts.nb_summarized > 0) {
+      fmt::print(stderr, "[info] {} of {} partitions filtered from their summary\n", opts.nb_summarized.load(), matrix_paths.size());
+    }
     fmt::print(stderr, "[info] {} total kmers\n", std::reduce(nb_total_kmers.begin(), nb_total_kmers.end()));
     fmt::print(stderr, "[info] {} retained kmers\n", std::reduce(nb_retained.begin(), nb_retained.end()));
+    if (sketch) {
+      fmt::print(stderr, "[info] {} sampled kmers (scale {})\n", std::reduce(nb_sampled.begin(), nb_sampled.end()), opts.scale);
+    }
   }
 };
 
@@ -140,11 +495,30 @@ int main_ktfilter(int argc, char **argv) {
   filter_options opts;
 
   int c;
-  while ((c = getopt(argc, argv, "a:f:F:n:N:o:t:w:h")) != -1) {
+  while ((c = getopt(argc, argv, "a:C:de:f:F:g:n:N:o:p:S:K:t:w:h")) != -1) {
     switch (c) {
       case 'a':
         opts.min_abund = strtoul(optarg, NULL, 10);
         break;
+      case 'C':
+        for (char *p = optarg, *end; *p; p = (*end == ',') ? end + 1 : end) {
+          unsigned long cutoff = strtoul(p, &end, 10);
+          if (end == p || (*end != ',' && *end != '\0') || cutoff > UINT32_MAX) {
+            fmt::print(stderr, "[error] -C must be a comma-separated list of abundances\n");
+            return 1;
+          }
+          opts.summary_cutoffs.push_back(cutoff);
+        }
+        break;
+      case 'd':
+        opts.dry_run = true;
+        break;
+      case 'e':
+        opts.expr_text = optarg;
+        break;
+      case 'g':
+        opts.groups_file = optarg;
+        break;
       case 'n':
         opts.min_zeros = strtoul(optarg, NULL, 10);
         break;
@@ -154,6 +528,15 @@ int main_ktfilter(int argc, char **argv) {
       case 'o':
         opts.output = optarg;
         break;
+      case 'p':
+        opts.prefetch.depth = strtoul(optarg, NULL, 10);
+        break;
+      case 'S':
+        opts.scale = std::max(1UL, strtoul(optarg, NULL, 10));
+        break;
+      case 'K':
+        opts.kmers_output = optarg;
+        break;
       case 'f':
         opts.min_zero_frac_set = true;
         opts.min_zero_frac = atof(optarg);
@@ -202,13 +585,48 @@ int main_ktfilter(int argc, char **argv) {
     return 1;
   }
 
-  // retrieve k-mer size from one of the matrix files
+  // retrieve k-mer size, number of samples and matrix type from one of the matrix files
+  std::size_t n_samples = 0;
   for (auto const& entry : std::filesystem::directory_iterator{opts.matrices_dir}) {
-    km::MatrixReader reader(entry.path());
-    opts.kmer_size = reader.infos().kmer_size;
+    opts.pa_matrix = is_pa_matrix(entry.path());
+    if (opts.pa_matrix) {
+      km::PAMatrixReader<8192> reader(entry.path());
+      opts.kmer_size = reader.infos().kmer_size;
+      n_samples = reader.infos().bits;
+    } else {
+      km::MatrixReader reader(entry.path());
+      opts.kmer_size = reader.infos().kmer_size;
+      n_samples = reader.infos().nb_counts;
+    }
     break;
   }
+  opts.nb_samples = n_samples;
+  opts.summary_dir = kmtricks_dir/"matrices_summary";
+  if (!opts.summary_cutoffs.empty()) { fs::create_directories(opts.summary_dir); }
+  if (opts.dry_run && !opts.expr_text.empty()) {
+    fmt::print(stderr, "[error] -d cannot be used with -e\n");
+    return 1;
+  }
+
+  if (opts.pa_matrix) {
+    fmt::print(stderr, "[info] presence/absence matrix\n");
+    if (opts.min_abund > 1) {
+      fmt::print(stderr, "[warning] -a is ignored for presence/absence matrices (kmtricks --hard-min already applies)\n");
+    }
+  }
   
+  if (!opts.expr_text.empty()) {
+    sample_groups groups;
+    std::string error;
+    if (!opts.expr.parse(opts.expr_text, error)
+        || (!opts.groups_file.empty() && !load_sample_groups(opts.groups_file, fof_sample_ids(kmtricks_dir/"kmtricks.fof"), groups, error))
+        || !opts.expr.compile(n_samples, groups, std::min<std::size_t>(opts.min_abund, UINT32_MAX), opts.pa_matrix, error)) {
+      fmt::print(stderr, "[error] {}\n", error);
+      return 1;
+    }
+    fmt::print(stderr, "[info] filter: {}\n", opts.expr.str());
+  }
+
   if (opts.filtered_dir.empty()) { opts.filtered_dir = kmtricks_dir/"matrices_filtered"; }
 
   // create working directory and check it is not the same as the matrices directory
@@ -218,6 +636,12 @@ int main_ktfilter(int argc, char **argv) {
     std::exit(EXIT_FAILURE);
   }
   
+  if (opts.prefetch.depth > 0 && !opts.dry_run) {
+    fmt::print(stderr, "[info] partition reads: {} x {} KiB in flight ({}){}\n", opts.prefetch.depth, opts.prefetch.block_size >> 10,
+      prefetch_uses_io_uring() ? "io_uring" : "reader threads",
+      opts.prefetch.delay_us ? fmt::format(", delayed by {}us", opts.prefetch.delay_us) : "");
+  }
+
   try 
   { 
     km::const_loop_executor<0, KMER_N>::exec<filter_functor>(opts.kmer_size, opts);
@@ -227,6 +651,11 @@ int main_ktfilter(int argc, char **argv) {
     fmt::print(stderr, "[exception] {} - {}", e.get_name(), e.get_msg());
     std::exit(EXIT_FAILURE);
   }
+  catch (const std::exception &e)
+  {
+    fmt::print(stderr, "[error] {}\n", e.what());
+    std::exit(EXIT_FAILURE);
+  }
 
   return 0;
 }
@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "kmtricks.h"
+#include "common.h"
+#include "progress.h"
+
+namespace fs = std::filesystem;
+
+struct ktmerge_options {
+  fs::path run_dirs[2];
+  fs::path output_dir;
+  std::size_t nb_threads{1};
+  uint32_t kmer_size{31};
+  bool pa_matrix{false};
+  // partition id -> path of its matrix in each run
+  std::map<uint32_t, std::string> partitions[2];
+};
+
+// k-mers of a merged partition found in both runs or in only one of them
+struct ktmerge_stats {
+  std::size_t both{0};
+  std::size_t only[2]{0, 0};
+};
+
+
+// files of a kmtricks run describing how k-mers were assigned to partitions: runs can be merged
+// partition by partition only if they are identical
+static const char *KTMERGE_CONFIG_FILES[] = { "hash.info", "repartition_gatb/repartition.minimRepart" };
+
+static bool same_file_content(const fs::path &a, const fs::path &b) {
+  std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+  if (!fa || !fb) { return false; }
+  return std::equal(std::istreambuf_iterator<char>(fa), std::istreambuf_iterator<char>(),
+                    std::istreambuf_iterator<char>(fb), std::istreambuf_iterator<char>());
+}
+
+
+// copy the configuration of the first run and concatenate the kmtricks.fof of both runs, the
+// sample IDs being suffixed by the index of their run ("S1_0", "S1_1") if some are in both
+static void write_run_files(const ktmerge_options &opts) {
+  const fs::path &src = opts.run_dirs[0];
+  for (const char *name : { "hash.info", "options.txt" }) {
+    if (fs::is_regular_file(src/name)) { fs::copy_file(src/name, opts.output_dir/name, fs::copy_options::overwrite_existing); }
+  }
+  for (const char *name : { "config_gatb", "repartition_gatb" }) {
+    if (fs::is_directory(src/name)) {
+      fs::create_directories(opts.output_dir/name);
+      fs::copy(src/name, opts.output_dir/name, fs::copy_options::recursive | fs::copy_options::overwrite_existing);
+    }
+  }
+
+  std::vector<std::string> lines[2];
+  std::vector<std::string> ids;
+  for (int r = 0; r < 2; ++r) {
+    std::ifstream in(opts.run_dirs[r]/"kmtricks.fof");
+    for (std::string line; std::getline(in, line);) {
+      std::size_t pos = line.find(':');
+      if (pos == std::string::npos) { continue; }
+      std::string id = line.substr(0, pos);
+      id.erase(0, id.find_first_not_of(" \t"));
+      id.erase(id.find_last_not_of(" \t") + 1);
+      ids.push_back(id);
+      lines[r].push_back(line);
+    }
+  }
+  bool rename = std::set<std::string>(ids.begin(), ids.end()).size() != ids.size();
+  if (rename) {
+    fmt::print(stderr, "[warning] some sample IDs are in both runs, they are suffixed by \"_0\" and \"_1\" in the merged kmtricks.fof\n");
+  }
+  std::ofstream out(opts.output_dir/"kmtricks.fof");
+  std::size_t i = 0;
+  for (int r = 0; r < 2; ++r) {
+    for (const std::string &line : lines[r]) {
+      if (rename) {
+        out << ids[i] << "_" << r << " " << line.substr(line.find(':')) << '\n';
+      } else {
+        out << line << '\n';
+      }
+      ++i;
+    }
+  }
+}
+
+
+template<size_t MAX_K>
+struct ktmerge_functor {
+
+  using count_type = typename km::selectC<DMAX_C>::type;
+
+  // merge two sorted partitions into a partition with the samples of both runs, the k-mers absent
+  // from one run having zero counts for its samples
+  static ktmerge_stats merge_counts(const std::string paths[2], const std::string &output, const ktmerge_options &opts) {
+    std::unique_ptr<km::MatrixReader<8192>> readers[2];
+    std::size_t nb_counts[2];
+    for (int r = 0; r < 2; ++r) {
+      readers[r] = std::make_unique<km::MatrixReader<8192>>(paths[r]);
+      nb_counts[r] = readers[r]->infos().nb_counts;
+    }
+    auto &infos = readers[0]->infos();
+    km::MatrixWriter<8192> writer(output, opts.kmer_size, infos.count_slots, nb_counts[0] + nb_counts[1], infos.id, infos.partition, infos.compressed);
+
+    km::Kmer<MAX_K> kmers[2];
+    std::vector<count_type> counts[2] = { std::vector<count_type>(nb_counts[0]), std::vector<count_type>(nb_counts[1]) };
+    std::vector<count_type> merged(nb_counts[0] + nb_counts[1]);
+    bool has[2];
+    for (int r = 0; r < 2; ++r) {
+      kmers[r].set_k(opts.kmer_size);
+      has[r] = readers[r]->template read<MAX_K, DMAX_C>(kmers[r], counts[r]);
+    }
+
+    ktmerge_stats stats;
+    while (has[0] || has[1]) {
+      bool take[2] = { has[0] && (!has[1] || !(kmers[1] < kmers[0])), has[1] && (!has[0] || !(kmers[0] < kmers[1])) };
+      std::copy(counts[0].begin(), counts[0].end(), merged.begin());
+      std::copy(counts[1].begin(), counts[1].end(), merged.begin() + nb_counts[0]);
+      for (int r = 0; r < 2; ++r) {
+        if (!take[r]) { std::fill_n(merged.begin() + (r ? nb_counts[0] : 0), nb_counts[r], 0); }
+      }
+      writer.template write<MAX_K, DMAX_C>(kmers[take[0] ? 0 : 1], merged);
+      if (take[0] && take[1]) { stats.both++; } else { stats.only[take[0] ? 0 : 1]++; }
+      progress_meter::global().add(PROGRESS_ROWS);
+      for (int r = 0; r < 2; ++r) {
+        if (take[r]) { has[r] = readers[r]->template read<MAX_K, DMAX_C>(kmers[r], counts[r]); }
+      }
+    }
+    return stats;
+  }
+
+  // same for presence/absence partitions, the bits of the second run following those of the first
+  static ktmerge_stats merge_pa(const std::string paths[2], const std::string &output, const ktmerge_options &opts) {
+    std::unique_ptr<km::PAMatrixReader<8192>> readers[2];
+    std::size_t nb_bits[2];
+    for (int r = 0; r < 2; ++r) {
+      readers[r] = std::make_unique<km::PAMatrixReader<8192>>(paths[r]);
+      nb_bits[r] = readers[r]->infos().bits;
+    }
+    auto &infos = readers[0]->infos();
+    km::PAMatrixWriter<8192> writer(output, opts.kmer_size, nb_bits[0] + nb_bits[1], infos.id, infos.partition, infos.compressed);
+
+    km::Kmer<MAX_K> kmers[2];
+    std::vector<uint8_t> bits[2] = { std::vector<uint8_t>(NBYTES(nb_bits[0])), std::vector<uint8_t>(NBYTES(nb_bits[1])) };
+    std::vector<uint8_t> merged(NBYTES(nb_bits[0] + nb_bits[1]));
+    bool has[2];
+    for (int r = 0; r < 2; ++r) {
+      kmers[r].set_k(opts.kmer_size);
+      has[r] = readers[r]->template read<MAX_K>(kmers[r], bits[r]);
+    }
+
+    ktmerge_stats stats;
+    while (has[0] || has[1]) {
+      bool take[2] = { has[0] && (!has[1] || !(kmers[1] < kmers[0])), has[1] && (!has[0] || !(kmers[0] < kmers[1])) };
+      std::fill(merged.begin(), merged.end(), 0);
+      if (take[0]) { std::copy(bits[0].begin(), bits[0].end(), merged.begin()); }
+      if (take[1]) {
+        if (nb_bits[0] % 8 == 0) {
+          std::copy(bits[1].begin(), bits[1].end(), merged.begin() + nb_bits[0] / 8);
+        } else {
+          for (std::size_t j = 0; j < nb_bits[1]; ++j) {
+            if ((bits[1][j/8] >> (j%8)) & 1) { merged[(nb_bits[0]+j)/8] |= 1 << ((nb_bits[0]+j)%8); }
+          }
+        }
+      }
+      writer.template write<MAX_K>(kmers[take[0] ? 0 : 1], merged);
+      if (take[0] && take[1]) { stats.both++; } else { stats.only[take[0] ? 0 : 1]++; }
+      progress_meter::global().add(PROGRESS_ROWS);
+      for (int r = 0; r < 2; ++r) {
+        if (take[r]) { has[r] = readers[r]->template read<MAX_K>(kmers[r], bits[r]); }
+      }
+    }
+    return stats;
+  }
+
+  // number of samples of a run, read from any of its partitions
+  static std::size_t run_nb_samples(int r, const ktmerge_options &opts) {
+    const std::string &path = opts.partitions[r].begin()->second;
+    if (opts.pa_matrix) { return km::PAMatrixReader<8192>(path).infos().bits; }
+    return km::MatrixReader<8192>(path).infos().nb_counts;
+  }
+
+  void operator()(ktmerge_options &opts)
+  {
+    // partitions are merged the largest first, as in ktfilter
+    std::vector<uint32_t> ids;
+    std::vector<std::uintmax_t> sizes;
+    for (auto &[id, path] : opts.partitions[0]) {
+      std::error_code ec;
+      ids.push_back(id);
+      sizes.push_back(fs::file_size(path, ec) + fs::file_size(opts.partitions[1].at(id), ec));
+    }
+    std::vector<std::size_t> order(ids.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return sizes[a] > sizes[b]; });
+
+    // the bytes read and written are counted when a partition is done
+    progress_meter &progress = progress_meter::global();
+    progress.expect_input(std::reduce(sizes.begin(), sizes.end(), std::uintmax_t{0}));
+
+    std::vector<ktmerge_stats> stats(ids.size());
+    std::atomic<std::size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+      for (std::size_t i; (i = next++) < order.size(); ) {
+        uint32_t id = ids[order[i]];
+        std::string paths[2] = { opts.partitions[0].at(id), opts.partitions[1].at(id) };
+        std::string output = (opts.output_dir/"matrices"/fs::path(paths[0]).filename()).string();
+        try {
+          stats[order[i]] = opts.pa_matrix ? merge_pa(paths, output, opts) : merge_counts(paths, output, opts);
+          std::error_code ec;
+          std::uintmax_t output_size = fs::file_size(output, ec);
+          progress.add(PROGRESS_BYTES_IN, sizes[order[i]]);
+          progress.add(PROGRESS_BYTES_OUT, ec ? 0 : output_size);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error) { error = std::current_exception(); }
+          next = order.size();
+        }
+      }
+    };
+    std::size_t nb_threads = std::max<std::size_t>(1, std::min(opts.nb_threads, ids.size()));
+    std::vector<std::thread> workers;
+    for (std::size_t t = 1; t < nb_threads; ++t) { workers.emplace_back(worker); }
+    worker();
+    for (auto &t : workers) { t.join(); }
+    if (error) { std::rethrow_exception(error); }
+
+    ktmerge_stats total;
+    for (auto &s : stats) {
+      total.both += s.both;
+      total.only[0] += s.only[0];
+      total.only[1] += s.only[1];
+    }
+    fmt::print(stderr, "[info] {} partitions merged, {} + {} samples\n", ids.size(), run_nb_samples(0, opts), run_nb_samples(1, opts));
+    fmt::print(stderr, "[info] {} kmers in both runs\n", total.both);
+    fmt::print(stderr, "[info] {} kmers only in \"{}\"\n", total.only[0], opts.run_dirs[0].c_str());
+    fmt::print(stderr, "[info] {} kmers only in \"{}\"\n", total.only[1], opts.run_dirs[1].c_str());
+  }
+};
+
+
+static void print_ktmerge_usage() {
+  fmt::print("Usage: kmat_tools ktmerge [options] -o <output_dir> <kmtricks_run_dir_1> <kmtricks_run_dir_2>\n\n");
+  fmt::print("Merge the matrices of two kmtricks runs on different samples, partition by partition, into a kmtricks\n");
+  fmt::print("run directory with the samples of both (e.g. to be filtered by \"kmat_tools ktfilter\"). The runs must\n");
+  fmt::print("share their k-mer size and partitioning (same repartition and minimizer options, or \"kmtricks pipeline\"\n");
+  fmt::print("run with the --repart-from option of the first one). The k-mers absent from one run have zero counts\n");
+  fmt::print("for its samples.\n\n");
+  fmt::print("Options:\n");
+  fmt::print("  -o DIR    output directory (required)\n");
+  fmt::print("  -t INT    number of threads [1]\n");
+  fmt::print("  -h        print this help message\n");
+}
+
+
+int main_ktmerge(int argc, char **argv) {
+
+  ktmerge_options opts;
+  bool help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "o:t:h")) != -1) {
+    switch (c) {
+      case 'o':
+        opts.output_dir = optarg;
+        break;
+      case 't':
+        opts.nb_threads = std::max(1L, strtol(optarg, NULL, 10));
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(argc-optind != 2 || opts.output_dir.empty() || help_opt) {
+    print_ktmerge_usage();
+    return 0;
+  }
+  opts.run_dirs[0] = argv[optind];
+  opts.run_dirs[1] = argv[optind+1];
+
+  try
+  {
+    // index the partitions of each run by their id, checking that their matrices are compatible
+    uint32_t kmer_size[2] = { 0, 0 }, count_slots[2] = { 0, 0 };
+    bool pa[2] = { false, false };
+    for (int r = 0; r < 2; ++r) {
+      fs::path matrices_dir = opts.run_dirs[r]/"matrices";
+      if (!fs::is_directory(matrices_dir) || fs::is_empty(matrices_dir)) {
+        fmt::print(stderr, "[error] \"{}\" is not a kmtricks run directory with matrices\n", opts.run_dirs[r].c_str());
+        return 1;
+      }
+      for (auto const& entry : fs::directory_iterator{matrices_dir}) {
+        if (!fs::is_regular_file(entry)) { continue; }
+        uint32_t partition;
+        bool is_pa = is_pa_matrix(entry.path());
+        if (is_pa) {
+          km::PAMatrixReader<8192> reader(entry.path());
+          kmer_size[r] = reader.infos().kmer_size;
+          partition = reader.infos().partition;
+        } else {
+          km::MatrixReader reader(entry.path());
+          kmer_size[r] = reader.infos().kmer_size;
+          count_slots[r] = reader.infos().count_slots;
+          partition = reader.infos().partition;
+        }
+        if (!opts.partitions[r].empty() && is_pa != pa[r]) {
+          fmt::print(stderr, "[error] \"{}\" mixes count and presence/absence matrices\n", matrices_dir.c_str());
+          return 1;
+        }
+        pa[r] = is_pa;
+        if (!opts.partitions[r].emplace(partition, entry.path().string()).second) {
+          fmt::print(stderr, "[error] \"{}\" has several matrices for partition {}\n", matrices_dir.c_str(), partition);
+          return 1;
+        }
+      }
+    }
+    if (pa[0] != pa[1]) {
+      fmt::print(stderr, "[error] cannot merge a count matrix with a presence/absence matrix\n");
+      return 1;
+    }
+    if (kmer_size[0] != kmer_size[1] || count_slots[0] != count_slots[1]) {
+      fmt::print(stderr, "[error] the runs have different k-mer sizes or count sizes\n");
+      return 1;
+    }
+    if (opts.partitions[0].size() != opts.partitions[1].size()
+        || !std::equal(opts.partitions[0].begin(), opts.partitions[0].end(), opts.partitions[1].begin(),
+                       [](auto &a, auto &b) { return a.first == b.first; })) {
+      fmt::print(stderr, "[error] the runs do not have the same partitions ({} and {})\n", opts.partitions[0].size(), opts.partitions[1].size());
+      return 1;
+    }
+    opts.pa_matrix = pa[0];
+    opts.kmer_size = kmer_size[0];
+
+    // partition i of a run only holds the k-mers of partition i of the other one if k-mers were
+    // assigned to partitions in the same way
+    std::size_t nb_checked = 0;
+    for (const char *name : KTMERGE_CONFIG_FILES) {
+      if (!fs::is_regular_file(opts.run_dirs[0]/name) || !fs::is_regular_file(opts.run_dirs[1]/name)) { continue; }
+      if (!same_file_content(opts.run_dirs[0]/name, opts.run_dirs[1]/name)) {
+        fmt::print(stderr, "[error] the runs have a different \"{}\", their partitions cannot be merged\n", name);
+        return 1;
+      }
+      nb_checked++;
+    }
+    if (nb_checked == 0) {
+      fmt::print(stderr, "[warning] no kmtricks configuration found in both runs, cannot check that they share their partitioning\n");
+    }
+
+    fs::create_directories(opts.output_dir/"matrices");
+    if (!fs::is_empty(opts.output_dir/"matrices")) {
+      fmt::print(stderr, "[error] output directory \"{}\" already has matrices\n", (opts.output_dir/"matrices").c_str());
+      return 1;
+    }
+    if (opts.pa_matrix) { fmt::print(stderr, "[info] presence/absence matrices\n"); }
+    write_run_files(opts);
+
+    km::const_loop_executor<0, KMER_N>::exec<ktmerge_functor>(opts.kmer_size, opts);
+  }
+  catch (const km::km_exception &e)
+  {
+    fmt::print(stderr, "[exception] {} - {}", e.get_name(), e.get_msg());
+    std::exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
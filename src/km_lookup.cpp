@@ -0,0 +1,116 @@
+#include <cstddef>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include "../external/sshash/dictionary.hpp"
+
+#include "common.h"
+#include "kmer_count_store.h"
+#include "unitig_dict.h"
+
+
+int main_lookup(int argc, char **argv) {
+
+  char *out_fname = NULL;
+  bool help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "o:h")) != -1) {
+    switch (c) {
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(argc-optind != 3 || help_opt) {
+    fprintf(stdout, "Usage: kmat_tools lookup [options] <unitigs.dict> <kmers.store> <kmers.txt>\n\n");
+    fprintf(stdout, "Output the abundances of the k-mers of <kmers.txt> (first column, \"-\" for stdin) in all samples,\n");
+    fprintf(stdout, "from the dictionary and the k-mer abundance store written by \"kmat_tools unitig -D <unitigs.dict> -C <kmers.store>\".\n");
+    fprintf(stdout, "K-mers that are not in the dictionary are skipped.\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -o FILE   write the k-mer matrix rows to FILE [stdout]\n");
+    fprintf(stdout, "  -h        print this help message\n");
+    return 0;
+  }
+
+  const char *dict_fname = argv[optind];
+  const char *store_fname = argv[optind+1];
+  const char *kmers_fname = argv[optind+2];
+
+  if(!std::filesystem::exists(dict_fname)) {
+    fprintf(stderr, "[error] dictionary file \"%s\" does not exist\n", dict_fname);
+    return 1;
+  }
+
+  kmer_count_store_reader store;
+  if(!store.open(store_fname)) {
+    fprintf(stderr, "[error] cannot read k-mer abundance store \"%s\"\n", store_fname);
+    return 1;
+  }
+
+  sshash::dictionary kmer_dict;
+  unitig_names utg_names;
+  {
+    cout_to_cerr redirect;
+    load_unitig_dict(kmer_dict, utg_names, dict_fname);
+  }
+  if(kmer_dict.size() != store.nb_kmers()) {
+    fprintf(stderr, "[error] the k-mer abundance store \"%s\" was not built with the dictionary \"%s\"\n", store_fname, dict_fname);
+    return 1;
+  }
+
+  FILE *kmfile = strcmp(kmers_fname,"-") ? fopen(kmers_fname,"r") : stdin;
+  if(kmfile == NULL) {
+    fprintf(stderr, "[error] cannot open file \"%s\"\n", kmers_fname);
+    return 1;
+  }
+
+  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  if(outfile == NULL) {
+    if(kmfile != stdin) { fclose(kmfile); }
+    fprintf(stderr, "[error] cannot open output file \"%s\"\n", out_fname);
+    return 1;
+  }
+
+  std::size_t ksize = kmer_dict.k();
+  std::size_t n_samples = store.nb_samples();
+  std::vector<uint32_t> counts(n_samples);
+  std::size_t n_queries = 0, n_found = 0;
+  char *kmer = (char *)calloc(ksize+1,1);
+  char *line = NULL;
+  size_t line_size = 0;
+  int ret = 0;
+
+  while(next_kmer_and_line(kmer, ksize, &line, &line_size, kmfile)) {
+    ++n_queries;
+    auto res = kmer_dict.lookup_advanced(kmer);
+    if(res.kmer_id == sshash::constants::invalid_uint64) { continue; }
+    if(store.counts(res.kmer_id, counts.data()) == NULL) {
+      fprintf(stderr, "[error] k-mer abundance store \"%s\" is corrupted\n", store_fname);
+      ret = 1;
+      break;
+    }
+    ++n_found;
+    fputs(kmer, outfile);
+    for(uint32_t cnt : counts) { fprintf(outfile, " %u", cnt); }
+    fputc('\n', outfile);
+  }
+
+  fprintf(stderr, "[info] %lu\tk-mers queried\n", n_queries);
+  fprintf(stderr, "[info] %lu\tk-mers found\n", n_found);
+
+  free(kmer); free(line);
+  if(kmfile != stdin) { fclose(kmfile); }
+  if(outfile != stdout) { fclose(outfile); }
+
+  return ret;
+}
@@ -1,4 +1,6 @@
 #include "common.h"
+#include "kff.h"
+#include "progress.h"
 
 
 int main_merge(int argc, char **argv) {
@@ -36,7 +38,8 @@ int main_merge(int argc, char **argv) {
 
   if(argc-optind != 2 || help_opt) {
     fprintf(stdout, "Usage: kmat_tools merge [options] <matrix_1> <matrix_2>\n\n");
-    fprintf(stdout, "Merge two input kmer-sorted matrices.\n\n");
+    fprintf(stdout, "Merge two input kmer-sorted matrices.\n");
+    fprintf(stdout, "Input matrices can be text or KFF files, the output matrix is written in KFF if its name ends with \".kff\".\n\n");
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -k INT   size of k-mers of input matrices [31]\n");
     fprintf(stdout, "  -o FILE  write output matrix to FILE [stdout]\n");
@@ -45,20 +48,20 @@ int main_merge(int argc, char **argv) {
     return 0;
   }
 
-  FILE *mat_1 = fopen(argv[optind],"r");
+  FILE *mat_1 = open_kmer_matrix(argv[optind]);
   if(mat_1 == NULL) {
     fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind]);
     return 1;
   }
 
-  FILE *mat_2 = fopen(argv[optind+1],"r");
+  FILE *mat_2 = open_kmer_matrix(argv[optind+1]);
   if(mat_2 == NULL) {
     fprintf(stderr,"Cannot open file \"%s\"\n",argv[optind+1]);
     fclose(mat_1); 
     return 1;
   }
 
-  FILE *outfile = out_fname ? fopen(out_fname,"w") : stdout;
+  FILE *outfile = create_kmer_matrix(out_fname);
   if(outfile != stdout && outfile == NULL) {
     fprintf(stderr,"Cannot open output file \"%s\"\n",out_fname);
     fclose(mat_1);
@@ -66,6 +69,11 @@ int main_merge(int argc, char **argv) {
     return 1;
   }
 
+  progress_meter &progress = progress_meter::global();
+  progress.watch_input(mat_1);
+  progress.watch_input(mat_2);
+  progress.watch_output(outfile);
+
   char *kmer_1 = (char *)calloc(ksize+1,1);
   char *kmer_2 = (char *)calloc(ksize+1,1);
   char *line_1 = NULL, *line_2 = NULL;
@@ -103,6 +111,7 @@ int main_merge(int argc, char **argv) {
       has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
     }
     fputc('\n',outfile);
+    progress.add(PROGRESS_ROWS);
   }
 
   while(has_kmer_1) {
@@ -111,6 +120,7 @@ int main_merge(int argc, char **argv) {
     fputs(second_column(line_1),outfile);
     for(size_t i=0; i<n_sample_2; ++i){ fputs(" 0",outfile); }
     fputc('\n',outfile);
+    progress.add(PROGRESS_ROWS);
     has_kmer_1 = next_kmer_and_line(kmer_1, ksize, &line_1, &line_1_size, mat_1);
   }
 
@@ -120,6 +130,7 @@ int main_merge(int argc, char **argv) {
     fputc(' ',outfile);
     fputs(second_column(line_2),outfile);
     fputc('\n',outfile);
+    progress.add(PROGRESS_ROWS);
     has_kmer_2 = next_kmer_and_line(kmer_2, ksize, &line_2, &line_2_size, mat_2);
   }
 
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "../external/kseq++/seqio.hpp"
+#include "../external/sshash/dictionary.hpp"
+#include "../external/sshash/query/streaming_query_canonical_parsing.hpp"
+
+#include "common.h"
+#include "progress.h"
+#include "unitig_dict.h"
+
+
+// bounded queue of read batches shared between the reader and the query threads
+class batch_queue {
+public:
+  using batch_t = std::vector<klibpp::KSeq>;
+
+  batch_queue(std::size_t capacity) : m_capacity(capacity) {}
+
+  void push(batch_t &&batch) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_not_full.wait(lock, [this]{ return m_batches.size() < m_capacity; });
+    m_batches.push(std::move(batch));
+    m_not_empty.notify_one();
+  }
+
+  bool pop(batch_t &batch) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_not_empty.wait(lock, [this]{ return !m_batches.empty() || m_closed; });
+    if (m_batches.empty()) { return false; }
+    batch = std::move(m_batches.front());
+    m_batches.pop();
+    m_not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_not_empty.notify_all();
+  }
+
+private:
+  std::size_t m_capacity;
+  bool m_closed{false};
+  std::queue<batch_t> m_batches;
+  std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+};
+
+
+// saturating increment of a 16-bit k-mer counter
+static inline void counter_inc(std::atomic<uint16_t> &counter) {
+  uint16_t val = counter.load(std::memory_order_relaxed);
+  while (val != UINT16_MAX && !counter.compare_exchange_weak(val, val+1, std::memory_order_relaxed)) {}
+}
+
+
+// count occurrences of the dictionary k-mers in the reads of a FASTA/FASTQ file
+static std::size_t count_kmers(const sshash::dictionary &dict, const std::string &reads_file, std::vector<std::atomic<uint16_t>> &kmer_counts, std::size_t nb_threads) {
+
+  constexpr std::size_t batch_size = 4096;
+  batch_queue queue(2*nb_threads);
+  std::atomic<std::size_t> nb_reads{0};
+
+  auto worker = [&]() {
+    sshash::streaming_query_canonical_parsing query(&dict);
+    batch_queue::batch_t batch;
+    progress_meter &progress = progress_meter::global();
+    while (queue.pop(batch)) {
+      uint64_t nb_hits = 0, nb_lookups = 0;
+      for (auto &read : batch) {
+        if (read.seq.length() < dict.k()) { continue; }
+        query.start();
+        const char *seq = read.seq.c_str();
+        nb_lookups += read.seq.length() - dict.k() + 1;
+        for (std::size_t i = 0; i + dict.k() <= read.seq.length(); ++i) {
+          auto res = query.lookup_advanced(seq+i);
+          if (res.kmer_id != sshash::constants::invalid_uint64) {
+            counter_inc(kmer_counts[res.kmer_id]);
+            ++nb_hits;
+          }
+        }
+      }
+      nb_reads.fetch_add(batch.size(), std::memory_order_relaxed);
+      progress.add(PROGRESS_ROWS, batch.size());
+      progress.add(PROGRESS_HITS, nb_hits);
+      progress.add(PROGRESS_MISSES, nb_lookups - nb_hits);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (std::size_t i = 0; i < nb_threads; ++i) { workers.emplace_back(worker); }
+
+  klibpp::SeqStreamIn ssi(reads_file.c_str());
+  for (auto batch = ssi.read(batch_size); !batch.empty(); batch = ssi.read(batch_size)) {
+    queue.push(std::move(batch));
+  }
+  queue.close();
+
+  for (auto &t : workers) { t.join(); }
+
+  return nb_reads;
+}
+
+
+int main_quantify(int argc, char **argv) {
+
+  std::size_t ksize = 31;
+  std::size_t msize = 15;
+  std::size_t min_abund = 2;
+  std::size_t min_utg_len = 0;
+  std::size_t nb_threads = 1;
+  std::string out_fname;
+  std::string dict_fname;
+  std::string mat_fname;
+  bool out_writeseq = false;
+  bool help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "a:d:i:k:l:m:o:t:sh")) != -1) {
+    switch (c) {
+      case 'a':
+        min_abund = std::strtoul(optarg, NULL, 10);
+        break;
+      case 'd':
+        dict_fname = optarg;
+        break;
+      case 'i':
+        mat_fname = optarg;
+        break;
+      case 'k':
+        ksize = std::strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        min_utg_len = std::strtoul(optarg, NULL, 10);
+        break;
+      case 'm':
+        msize = std::strtoul(optarg, NULL, 10);
+        break;
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 't':
+        nb_threads = std::max((long)1, std::strtol(optarg, NULL, 10));
+        break;
+      case 's':
+        out_writeseq = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  std::size_t n_utg_args = dict_fname.empty() ? 1 : 0;
+  if(argc-optind < (int)n_utg_args+1 || help_opt) {
+    std::cout << "Usage: kmat_tools quantify [options] <unitigs.fasta> <reads_1.fastq> [<reads_2.fastq> ...]\n";
+    std::cout << "       kmat_tools quantify [options] -d <unitigs.dict> <reads_1.fastq> [<reads_2.fastq> ...]\n\n";
+    std::cout << "Quantifies unitigs in new samples directly from their reads (one sample per read file).\n";
+    std::cout << "Each sample is added as a new \"avg;frac\" column of the unitig matrix.\n\n";
+    std::cout << "Options:\n";
+    std::cout << "  -a INT   min abundance of a k-mer in a sample to be considered present [2]\n";
+    std::cout << "  -d FILE  load the k-mer dictionary from FILE instead of <unitigs.fasta> (see \"kmat_tools unitig -D\")\n";
+    std::cout << "  -i FILE  unitig matrix (built from the same unitigs) to which columns are appended\n";
+    std::cout << "  -k INT   k-mer size (must be <= 63) [31]\n";
+    std::cout << "  -l INT   only keep the unitigs at least INT bp long, as \"kmat_tools unitig -l\" [0]\n";
+    std::cout << "  -m INT   minimizer length (must be < k) [15]\n";
+    std::cout << "  -o FILE  write unitig matrix to FILE [stdout]\n";
+    std::cout << "  -t INT   number of threads [1]\n";
+    std::cout << "  -s       write the unitig sequence as first column instead of the identifier (ignored with -i)\n";
+    std::cout << "  -h       print this help message\n";
+    return 0;
+  }
+
+  std::string utg_file = n_utg_args ? argv[optind] : "";
+  if(n_utg_args && !std::filesystem::exists(utg_file.c_str())) {
+    std::cerr << "[error] unitig file \"" << utg_file << "\" does not exist" << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> reads_files(argv+optind+n_utg_args, argv+argc);
+  for(auto &fname : reads_files) {
+    if(!std::filesystem::exists(fname.c_str())) {
+      std::cerr << "[error] read file \"" << fname << "\" does not exist" << std::endl;
+      return 1;
+    }
+  }
+
+  if(!dict_fname.empty() && !std::filesystem::exists(dict_fname.c_str())) {
+    std::cerr << "[error] dictionary file \"" << dict_fname << "\" does not exist" << std::endl;
+    return 1;
+  }
+
+  if(min_utg_len > 0 && !dict_fname.empty()) {
+    std::cerr << "[error] -l cannot be used with -d (the unitigs of the dictionary are already selected)" << std::endl;
+    return 1;
+  }
+
+  if(!mat_fname.empty() && !std::filesystem::exists(mat_fname.c_str())) {
+    std::cerr << "[error] matrix file \"" << mat_fname << "\" does not exist" << std::endl;
+    return 1;
+  }
+
+  if(ksize <= 0) {
+    std::cerr << "[error] -k parameter must be greater than zero" << std::endl;
+    return 1;
+  } else if (ksize > 63) {
+    std::cerr << "[error] -k parameter must be at most 63" << std::endl;
+    return 1;
+  }
+
+  if(msize <= 0) {
+    std::cerr << "[error] -m parameter must be greater than zero" << std::endl;
+    return 1;
+  } else if (msize >= ksize) {
+    std::cerr << "[error] -m parameter must be smaller than k-mer size" << std::endl;
+    return 1;
+  }
+
+  if(min_abund <= 0 || min_abund > UINT16_MAX) {
+    std::cerr << "[error] -a parameter must be in the [1," << UINT16_MAX << "] interval" << std::endl;
+    return 1;
+  }
+
+  std::cerr << "[info] threads: " << nb_threads << std::endl;
+  std::cerr << "[info] min abundance: " << min_abund << std::endl;
+
+  progress_meter &progress = progress_meter::global();
+
+  sshash::dictionary kmer_dict;
+  unitig_names utg_names;
+  if(dict_fname.empty()) {
+    std::cerr << "[info] k-mer length: " << ksize << std::endl;
+    std::cerr << "[info] minimizer length: " << msize << std::endl;
+    if(min_utg_len > 0) { std::cerr << "[info] min unitig length: " << min_utg_len << std::endl; }
+    std::cerr << "[info] building k-mer dictionary"  << std::endl;
+    progress.phase("building the dictionary");
+    if(!build_unitig_dict(kmer_dict, utg_names, utg_file, ksize, msize, nb_threads, min_utg_len)) {
+      std::cerr << "[error] no unitig of \"" << utg_file << "\" is at least " << std::max(ksize, min_utg_len) << " bp long" << std::endl;
+      return 1;
+    }
+  } else {
+    std::cerr << "[info] loading k-mer dictionary from \"" << dict_fname << "\"" << std::endl;
+    progress.phase("loading the dictionary");
+    load_unitig_dict(kmer_dict, utg_names, dict_fname);
+    std::cerr << "[info] k-mer length: " << kmer_dict.k() << std::endl;
+    std::cerr << "[info] minimizer length: " << kmer_dict.m() << std::endl;
+  }
+
+  std::cerr << "[info] unitigs processed: " << kmer_dict.num_contigs() << std::endl;
+  std::cerr << "[info] k-mers processed: " << kmer_dict.size() << std::endl;
+
+  // quantify each sample
+
+  using sample_t = std::pair<uint32_t,uint32_t>;
+  std::size_t n_samples = reads_files.size();
+  std::size_t n_unitigs = kmer_dict.num_contigs();
+  std::vector<sample_t> utg_samples(n_unitigs * n_samples);
+  std::vector<std::atomic<uint16_t>> kmer_counts(kmer_dict.size());
+
+  for(std::size_t s = 0; s < n_samples; ++s) {
+    std::cerr << "[info] quantifying sample " << s+1 << "/" << n_samples << ": \"" << reads_files[s] << "\"" << std::endl;
+    progress.phase("quantifying sample " + std::to_string(s+1) + "/" + std::to_string(n_samples));
+
+    for(auto &cnt : kmer_counts) { cnt.store(0, std::memory_order_relaxed); }
+    std::size_t nb_reads = count_kmers(kmer_dict, reads_files[s], kmer_counts, nb_threads);
+    std::cerr << "[info] reads processed: " << nb_reads << std::endl;
+
+    auto accumulate = [&](std::size_t tid) {
+      for(uint64_t utg_id = tid; utg_id < n_unitigs; utg_id += nb_threads) {
+        auto [begin, end] = unitig_kmer_ids(kmer_dict, utg_id);
+        sample_t &counts = utg_samples[utg_id*n_samples+s];
+        for(uint64_t kmer_id = begin; kmer_id < end; ++kmer_id) {
+          uint32_t num = kmer_counts[kmer_id].load(std::memory_order_relaxed);
+          if(num < min_abund) { continue; }
+          counts.first = add_sat(counts.first, uint32_t{1});
+          counts.second = add_sat(counts.second, num);
+        }
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for(std::size_t t = 0; t < nb_threads; ++t) { workers.emplace_back(accumulate, t); }
+    for(auto &t : workers) { t.join(); }
+  }
+
+  // write output
+
+  std::ostream* fpout = &std::cout;
+  std::ofstream ofs;
+  if(!out_fname.empty()) {
+    ofs.open(out_fname.c_str());
+    if(!ofs.good()) {
+        std::cerr << "[error] cannot open output file \"" << out_fname << "\"\n";
+        return 1;
+    }
+    fpout = &ofs;
+  }
+
+  std::cerr << "[info] writing unitig matrix"  << std::endl;
+  progress.phase("writing the unitig matrix", n_unitigs);
+  progress.watch_output(out_fname);
+
+  auto format_columns = [&](uint64_t utg_id, std::string &buf) {
+    std::size_t utg_nb_kmers = kmer_dict.contig_size(utg_id);
+    for(std::size_t s = 0; s < n_samples; ++s) {
+      auto& p = utg_samples[utg_id*n_samples+s];
+      append_avg_frac(buf, p.first, p.second, utg_nb_kmers);
+    }
+  };
+
+  if(!mat_fname.empty()) {
+    std::ifstream mat(mat_fname);
+    std::string line;
+    uint64_t utg_id = 0;
+    while(std::getline(mat, line)) {
+      if(line.empty()) { continue; }
+      if(utg_id >= n_unitigs) { break; }
+      format_columns(utg_id++, line);
+      line.push_back('\n');
+      fpout->write(line.data(), line.size());
+      progress.add(PROGRESS_ROWS);
+      line.clear();
+    }
+    if(utg_id != n_unitigs || !line.empty()) {
+      std::cerr << "[error] the number of rows in \"" << mat_fname << "\" differs from the number of unitigs" << std::endl;
+      return 1;
+    }
+  } else {
+    write_unitig_rows(*fpout, kmer_dict, utg_names, out_writeseq, nb_threads, format_columns);
+  }
+
+  if(!out_fname.empty()) {
+    ofs.close();
+  }
+
+  return 0;
+}
@@ -1,21 +1,78 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+
 #include "common.h"
+#include "progress.h"
+
+
+// a chunk of whole lines of the matrix, whose k-mers are reverse-complemented (or put in
+// canonical form) into out, the rest of the lines being copied; empty lines are skipped
+struct reverse_chunk {
+  std::string in, out;
+  std::size_t n_lines{0};
+  std::size_t error_line{0};  // line of the chunk (1-based) of the first invalid k-mer, 0 if none
+  bool short_line{false};     // whether that line is shorter than k
+};
+
+template <size_t K>
+static void reverse_chunk_lines(reverse_chunk &chunk, size_t ksize, bool canonical) {
+  chunk.out.resize(chunk.in.size());
+  chunk.n_lines = chunk.error_line = 0;
+  chunk.short_line = false;
+  const char *p = chunk.in.data(), *end = p + chunk.in.size();
+  char *out = &chunk.out[0];
+  while(p < end) {
+    const char *eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    eol = (eol == NULL) ? end : eol + 1;
+    ++chunk.n_lines;
+    if(*p != '\n') {
+      const char *kmer_end = std::find_if(p, eol, [](char c) { return c == '\n' || c == '\r'; });
+      if((size_t)(kmer_end - p) < ksize) { chunk.error_line = chunk.n_lines; chunk.short_line = true; break; }
+      bool valid = canonical ? canonical_kmer_k<K>(p, out, ksize) : reverse_complement_k<K>(p, out, ksize);
+      if(!valid) { chunk.error_line = chunk.n_lines; break; }
+      memcpy(out + ksize, p + ksize, (eol - p) - ksize);
+      out += eol - p;
+    }
+    p = eol;
+  }
+  chunk.out.resize(out - chunk.out.data());
+}
 
 
 int main_reverse(int argc, char **argv) {
 
   int ksize = 31;
   char *out_fname = NULL;
+  size_t nb_threads = 1;
+  bool canonical = false;
   bool help_opt = false;
 
+  static struct option long_options[] = {
+    { "canonical", no_argument, NULL, 'c' },
+    { NULL, 0, NULL, 0 }
+  };
+
   int c;
-  while ((c = getopt(argc, argv, "k:o:h")) != -1) {
+  while ((c = getopt_long(argc, argv, "ck:o:t:h", long_options, NULL)) != -1) {
     switch (c) {
+      case 'c':
+        canonical = true;
+        break;
       case 'k':
         ksize = strtol(optarg, NULL, 10);
         break;
       case 'o':
         out_fname = optarg;
         break;
+      case 't':
+        nb_threads = std::max(1L, strtol(optarg, NULL, 10));
+        break;
       case 'h':
         help_opt = true;
         break;
@@ -26,7 +83,7 @@ int main_reverse(int argc, char **argv) {
     }
   }
 
-  if(ksize <= 0) { 
+  if(ksize <= 0) {
     fprintf(stderr, "[error] invalid value of k: %d\n", ksize);
     return 1;
   }
@@ -37,6 +94,9 @@ int main_reverse(int argc, char **argv) {
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -k INT   k-mer size [31]\n");
     fprintf(stdout, "  -o FILE  output reverse-complement matrix to FILE [stdout]\n");
+    fprintf(stdout, "  -t INT   number of threads, each one processing a chunk of lines [1]\n");
+    fprintf(stdout, "  -c, --canonical  output the canonical form of the k-mers instead (the smallest of the\n");
+    fprintf(stdout, "                   k-mer and its reverse complement, in the kmtricks order A < C < T < G)\n");
     fprintf(stdout, "  -h       print this help message\n");
     return 0;
   }
@@ -54,52 +114,75 @@ int main_reverse(int argc, char **argv) {
     return 1;
   }
 
-  char *kmer = (char *)calloc(ksize+1,1);
-  char *line = NULL;
-  size_t line_size=0, line_num=0;
-
-  ssize_t ch_read = getline(&line, &line_size, infile);
-  while(ch_read >= 0) {
-    ++line_num;
-    
-    // empty line
-    if(ch_read == 0 || line[0]=='\n') { 
-      continue; 
-    }
-    
-    if(ch_read < ksize) {
-      fprintf(stderr,"[error] cannot read a k-mer of size %d at line %zu\n", ksize, line_num);
-      free(kmer); free(line);
-      if(infile != stdin){ fclose(infile); }
-      if(outfile != stdout){ fclose(outfile); }
-      return 2;
-    }
+  progress_meter &progress = progress_meter::global();
+  progress.watch_input(infile);
+  progress.watch_output(outfile);
+
+  // kernels specialized for the usual k-mer sizes
+  void (*process_chunk)(reverse_chunk&, size_t, bool) = NULL;
+  with_kmer_size(ksize, [&](auto K) { process_chunk = &reverse_chunk_lines<decltype(K)::value>; });
 
-    for(int i=0; i<=ksize/2; ++i) {
-      kmer[i] = rctable[(int)line[ksize-i-1]];
-      kmer[ksize-i-1] = rctable[(int)line[i]];
-      if(!isnuc[(int)line[ksize-i-1]] || !isnuc[(int)line[i]]) {
-        fprintf(stderr,"[error] invalid k-mer at line %zu: %s\n", line_num, line);
-        free(kmer); free(line);
-        if(infile != stdin){ fclose(infile); }
-        if(outfile != stdout){ fclose(outfile); }
-        return 2;
+  // chunks of whole lines are read in turn, processed by the threads, then written in order
+  constexpr std::size_t chunk_size = 1 << 22;
+  std::vector<reverse_chunk> chunks(nb_threads);
+  std::string carry;
+  size_t line_num = 0;
+  int ret = 0;
+  bool eof = false;
+  while(!eof && ret == 0) {
+    std::size_t n_chunks = 0;
+    for(; n_chunks < nb_threads && !eof; ++n_chunks) {
+      std::string &buf = chunks[n_chunks].in;
+      buf.swap(carry);
+      carry.clear();
+      std::size_t old_size = buf.size();
+      buf.resize(old_size + chunk_size);
+      std::size_t n = fread(&buf[old_size], 1, chunk_size, infile);
+      buf.resize(old_size + n);
+      if(n < chunk_size) {
+        eof = true;
+      } else {
+        // keep the last partial line for the next chunk
+        std::size_t last = buf.rfind('\n');
+        std::size_t cut = (last == std::string::npos) ? 0 : last + 1;
+        carry.assign(buf, cut, std::string::npos);
+        buf.resize(cut);
       }
     }
 
-    for(int i=0; i<ksize; ++i) {
-      line[i] = kmer[i];
-    }
+    std::atomic<std::size_t> next{0};
+    auto worker = [&]() {
+      for(std::size_t i; (i = next++) < n_chunks; ) { process_chunk(chunks[i], ksize, canonical); }
+    };
+    std::vector<std::thread> workers;
+    for(std::size_t t = 1; t < n_chunks; ++t) { workers.emplace_back(worker); }
+    worker();
+    for(auto &t : workers) { t.join(); }
 
-    fputs(line, outfile);
-    //fputc('\n', outfile);
-    ch_read = getline(&line, &line_size, infile);
+    for(std::size_t i = 0; i < n_chunks && ret == 0; ++i) {
+      reverse_chunk &chunk = chunks[i];
+      fwrite(chunk.out.data(), 1, chunk.out.size(), outfile);
+      if(chunk.error_line == 0) {
+        line_num += chunk.n_lines;
+        progress.add(PROGRESS_ROWS, chunk.n_lines);
+        continue;
+      }
+      line_num += chunk.error_line;
+      if(chunk.short_line) {
+        fprintf(stderr,"[error] cannot read a k-mer of size %d at line %zu\n", ksize, line_num);
+      } else {
+        // the line where the invalid k-mer was found, without its end
+        const char *line = chunk.in.data();
+        for(std::size_t l = 1; l < chunk.error_line; ++l) { line = strchr(line, '\n') + 1; }
+        fprintf(stderr,"[error] invalid k-mer at line %zu: %.*s\n", line_num, (int)strcspn(line, "\r\n"), line);
+      }
+      ret = 2;
+    }
   }
 
-  fprintf(stderr,"[info] %zu lines processed successfully\n", line_num);
-  free(kmer); free(line);
+  if(ret == 0) { fprintf(stderr,"[info] %zu lines processed successfully\n", line_num); }
   if(infile != stdin){ fclose(infile); }
   if(outfile != stdout){ fclose(outfile); }
 
-  return 0;
+  return ret;
 }
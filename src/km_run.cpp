@@ -0,0 +1,748 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "common.h"
+#include "kff.h"
+
+namespace fs = std::filesystem;
+
+
+struct run_options {
+  std::string input_file;
+  std::string input_matrix;
+  fs::path output_dir{"output"};
+  std::size_t ksize{31};
+  std::string msize{"auto"};
+  std::size_t min_abund{2};
+  std::size_t utg_len{0};
+  std::size_t nb_threads{4};
+  std::size_t rec_min{1};
+  std::vector<std::string> param_n;
+  std::vector<std::string> param_N;
+  bool write_seq{false};
+  bool presence_only{false};
+  bool no_streaming{false};
+  bool recompute{false};
+  bool use_ggcat{true};
+  std::size_t sketch_scale{1};
+};
+
+static void print_run_usage() {
+  run_options opt;
+  fmt::print("Usage: kmat_tools run [options] <input_fof.txt>\n\n");
+  fmt::print("Run the muset pipeline, overlapping stages whose data can be streamed from one to the next.\n\n");
+  fmt::print("Options:\n");
+  fmt::print("  -i FILE   skip matrix construction and run the pipeline with a previously computed text or KFF matrix\n");
+  fmt::print("  -k INT    k-mer size [{}]\n", opt.ksize);
+  fmt::print("  -a INT    min abundance to keep a k-mer [{}]\n", opt.min_abund);
+  fmt::print("  -l INT    minimum size of the unitigs to be retained in the final matrix [2k-1]\n");
+  fmt::print("  -o PATH   output directory [{}]\n", opt.output_dir.c_str());
+  fmt::print("  -m INT    minimizer length, or \"auto\" to let \"kmat_tools unitig\" choose it [{}]\n", opt.msize);
+  fmt::print("            (the default was 15 before \"auto\" was added; use -m 15 to keep the former behaviour)\n");
+  fmt::print("  -n INT    minimum number of samples from which a k-mer should be absent (mutually exclusive with -f)\n");
+  fmt::print("  -f FLOAT  fraction of samples from which a k-mer should be absent [0.1] (mutually exclusive with -n)\n");
+  fmt::print("  -N INT    minimum number of samples in which a k-mer should be present (mutually exclusive with -F)\n");
+  fmt::print("  -F FLOAT  fraction of samples in which a k-mer should be present [0.1] (mutually exclusive with -N)\n");
+  fmt::print("  -t INT    number of threads shared by the running stages [{}]\n", opt.nb_threads);
+  fmt::print("  -s        write the unitig sequence in the first column of the output matrix instead of the identifier\n");
+  fmt::print("  -P        only keep k-mer presence/absence (kmtricks PA matrix), the average abundance is then the k-mer fraction\n");
+  fmt::print("  -c        build unitigs with \"kmat_tools compact\" instead of ggcat\n");
+  fmt::print("  -g        build unitigs with ggcat (default)\n");
+  fmt::print("  -S INT    sketch mode: the unitig matrix is computed from the k-mers sampled with FracMinHash at scale INT\n");
+  fmt::print("            (see \"kmat_tools unitig -S\"), unitigs are still built from all the filtered k-mers (implies -W)\n");
+  fmt::print("  -W        run stages one after the other writing all intermediate files to disk\n");
+  fmt::print("  -R        run all stages, even those whose results in the output directory are up to date\n");
+  fmt::print("  -h        print this help message\n");
+}
+
+
+// a pipeline stage run as a child process
+// a stage starts as soon as all stages in `after` completed successfully: stages connected
+// by a pipe or a FIFO (and not by an `after` dependency) therefore run concurrently
+// `inputs` and `outputs` are the files (or directories) the stage reads and writes, used to
+// decide whether the results of a previous run can be reused; stages of the same `group`
+// exchange data through pipes and are therefore all run unless all of them are up to date
+// (except for an up-to-date stage whose output is copied to a file, read again by its consumer)
+struct stage {
+  std::string name;
+  std::vector<std::string> cmd;
+  std::vector<std::size_t> after;
+  std::vector<fs::path> inputs;
+  std::vector<fs::path> outputs;
+  fs::path workdir; // removed before the stage runs
+  int group{-1};
+  fs::path tee_file; // when set, the stdout of the stage is copied to this file and to the stdin of `tee_to`
+  std::size_t tee_to{0};
+  int stdin_fd{-1};
+  int stdout_fd{-1};
+  pid_t pid{-1};
+  bool done{false};
+  std::thread tee;
+  std::chrono::steady_clock::time_point start_time;
+
+  stage(std::string name, std::vector<std::string> cmd, std::vector<std::size_t> after = {},
+        std::vector<fs::path> inputs = {}, std::vector<fs::path> outputs = {})
+    : name(std::move(name)), cmd(std::move(cmd)), after(std::move(after)),
+      inputs(std::move(inputs)), outputs(std::move(outputs)) {}
+};
+
+
+// copies everything read from in_fd to both out_file and out_fd (an in-process "tee")
+static void tee_stream(int in_fd, fs::path out_file, int out_fd) {
+  FILE *out = fopen(out_file.c_str(), "w");
+  if (out == NULL) {
+    fmt::print(stderr, "[error] cannot open output file \"{}\"\n", out_file.c_str());
+  }
+  std::vector<char> buf(1 << 20);
+  ssize_t n;
+  while ((n = read(in_fd, buf.data(), buf.size())) != 0) {
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) { break; }
+    if (out != NULL) { fwrite(buf.data(), 1, n, out); }
+    for (ssize_t w = 0, ret = 0; out_fd >= 0 && w < n; w += ret) {
+      ret = write(out_fd, buf.data()+w, n-w);
+      if (ret < 0 && errno == EINTR) { ret = 0; continue; }
+      if (ret < 0) { close(out_fd); out_fd = -1; } // consumer exited, keep writing the file
+    }
+  }
+  if (out != NULL) { fclose(out); }
+  if (out_fd >= 0) { close(out_fd); }
+  close(in_fd);
+}
+
+
+// content fingerprint of a file: its size and a hash of (at most) 16 blocks of 64KiB evenly
+// spaced in the file, so that fingerprinting large matrices or read sets stays cheap
+struct file_fingerprint {
+  uint64_t size{0};
+  int64_t mtime{0};
+  uint64_t hash{0};
+};
+
+static uint64_t sampled_hash(const fs::path &file, uint64_t size) {
+  constexpr uint64_t block_size = 1 << 16;
+  constexpr uint64_t nb_blocks = 16;
+  uint64_t h = 14695981039346656037ULL ^ size; // FNV-1a
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) { return 0; }
+  std::vector<unsigned char> buf(block_size);
+  uint64_t stride = size > nb_blocks * block_size ? (size - block_size) / (nb_blocks - 1) : block_size;
+  for (uint64_t off = 0; off < size; off += stride) {
+    ssize_t n = pread(fd, buf.data(), block_size, off);
+    if (n <= 0) { break; }
+    for (ssize_t i = 0; i < n; ++i) { h = (h ^ buf[i]) * 1099511628211ULL; }
+  }
+  close(fd);
+  return h;
+}
+
+
+// records, for each completed stage, a manifest of its command line (thread counts excluded),
+// of the fingerprints of its executable, inputs and outputs; a stage whose manifest still
+// matches the current files does not need to run again
+// a manifest is a text file with one "arg VALUE" line per command-line argument followed by one
+// "file MTIME SIZE HASH PATH" line per file (directories are expanded to the files they contain)
+class stage_cache {
+public:
+  stage_cache(fs::path dir) : m_dir(std::move(dir)) {}
+
+  bool is_valid(const stage &s) {
+    std::ifstream in(manifest(s));
+    if (!in) { return false; }
+    std::vector<std::string> recorded;
+    for (std::string line; std::getline(in, line);) {
+      file_fingerprint fp;
+      char path[4096];
+      // remember recorded fingerprints: files whose size and mtime did not change are not hashed again
+      if (sscanf(line.c_str(), "file %ld %lu %lu %4095[^\n]", &fp.mtime, &fp.size, &fp.hash, path) == 4) {
+        m_known.emplace(path, fp);
+      }
+      recorded.push_back(strip_mtime(line));
+    }
+    std::vector<std::string> current = entries(s);
+    if (current.empty()) { return false; } // a declared file is missing
+    for (auto &line : current) { line = strip_mtime(line); }
+    return current == recorded;
+  }
+
+  void remove(const stage &s) {
+    std::error_code ec;
+    fs::remove(manifest(s), ec);
+  }
+
+  void save(const stage &s) {
+    std::error_code ec;
+    fs::create_directories(m_dir, ec);
+    for (auto &p : s.outputs) { forget(p); } // just written
+    std::vector<std::string> current = entries(s);
+    if (current.empty()) { return; }
+    fs::path tmp = manifest(s).string() + ".tmp";
+    {
+      std::ofstream out(tmp);
+      for (auto &line : current) { out << line << '\n'; }
+      if (!out) { return; }
+    }
+    fs::rename(tmp, manifest(s), ec);
+  }
+
+private:
+  fs::path manifest(const stage &s) const { return m_dir / (s.name + ".manifest"); }
+
+  static std::string strip_mtime(const std::string &line) {
+    if (line.compare(0, 5, "file ") != 0) { return line; }
+    return "file" + line.substr(line.find(' ', 5));
+  }
+
+  // executable of a command as resolved by execvp (or kmat_tools itself)
+  static fs::path executable(const std::string &cmd) {
+    std::error_code ec;
+    if (cmd == "kmat_tools") { return fs::read_symlink("/proc/self/exe", ec); }
+    if (cmd.find('/') != std::string::npos) { return cmd; }
+    const char *path = getenv("PATH");
+    std::string dirs = path ? path : "";
+    for (std::size_t begin = 0, end; begin <= dirs.size(); begin = end + 1) {
+      end = std::min(dirs.find(':', begin), dirs.size());
+      fs::path exe = fs::path(dirs.substr(begin, end - begin)) / cmd;
+      if (access(exe.c_str(), X_OK) == 0) { return exe; }
+    }
+    return cmd;
+  }
+
+  void forget(const fs::path &p) {
+    std::error_code ec;
+    if (fs::is_directory(p, ec)) {
+      for (auto &e : fs::recursive_directory_iterator(p, ec)) { m_known.erase(e.path().string()); }
+    }
+    m_known.erase(p.string());
+  }
+
+  bool add_file(const fs::path &file, std::vector<std::string> &lines) {
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) { return false; }
+    file_fingerprint fp{ (uint64_t)st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, 0 };
+    auto it = m_known.find(file.string());
+    if (it != m_known.end() && it->second.size == fp.size && it->second.mtime == fp.mtime) {
+      fp.hash = it->second.hash;
+    } else {
+      fp.hash = sampled_hash(file, fp.size);
+      m_known[file.string()] = fp;
+    }
+    lines.push_back(fmt::format("file {} {} {} {}", fp.mtime, fp.size, fp.hash, file.c_str()));
+    return true;
+  }
+
+  bool add_path(const fs::path &p, std::vector<std::string> &lines) {
+    std::error_code ec;
+    if (!fs::is_directory(p, ec)) { return add_file(p, lines); }
+    std::vector<fs::path> files;
+    for (auto &e : fs::recursive_directory_iterator(p, ec)) {
+      if (e.is_regular_file()) { files.push_back(e.path()); }
+    }
+    std::sort(files.begin(), files.end());
+    for (auto &f : files) {
+      if (!add_file(f, lines)) { return false; }
+    }
+    return true;
+  }
+
+  // manifest lines describing the current state of a stage (empty if a file is missing)
+  std::vector<std::string> entries(const stage &s) {
+    std::vector<std::string> lines;
+    for (std::size_t i = 0; i < s.cmd.size(); ++i) {
+      bool is_threads = i > 0 && (s.cmd[i-1] == "-t" || s.cmd[i-1] == "-j");
+      lines.push_back("arg " + (is_threads ? std::string("*") : s.cmd[i]));
+    }
+    bool ok = add_path(executable(s.cmd[0]), lines);
+    for (auto &p : s.inputs) { ok = ok && add_path(p, lines); }
+    for (auto &p : s.outputs) { ok = ok && add_path(p, lines); }
+    if (!ok) { lines.clear(); }
+    return lines;
+  }
+
+  fs::path m_dir;
+  std::unordered_map<std::string, file_fingerprint> m_known;
+};
+
+
+class pipeline {
+public:
+  pipeline(stage_cache &cache, bool use_cache) : m_cache(cache), m_use_cache(use_cache) {}
+
+  std::size_t add(stage s) {
+    m_stages.push_back(std::move(s));
+    return m_stages.size()-1;
+  }
+
+  stage& operator[](std::size_t i) { return m_stages[i]; }
+
+  // run until all stages completed or one of them failed
+  bool run() {
+    std::size_t nb_done = 0;
+    while (nb_done < m_stages.size()) {
+      // skipping a stage may make its successors ready: repeat until nothing changes
+      for (bool skipped = true; skipped;) {
+        skipped = false;
+        for (std::size_t i = 0; i < m_stages.size(); ++i) {
+          if (m_stages[i].pid >= 0 || m_stages[i].done || !is_ready(m_stages[i])) { continue; }
+          std::vector<std::size_t> members = group_of(i);
+          if (m_use_cache && std::all_of(members.begin(), members.end(), [this](std::size_t j){ return m_cache.is_valid(m_stages[j]); })) {
+            for (auto j : members) {
+              fmt::print(stderr, "[info] stage \"{}\" is up to date, skipped\n", m_stages[j].name);
+              m_stages[j].done = true;
+              nb_done++;
+            }
+            skipped = true;
+            continue;
+          }
+          for (auto j : members) {
+            stage &s = m_stages[j];
+            if (!s.tee_file.empty() && m_use_cache && m_cache.is_valid(s)) {
+              // the output of the stage is up to date: its consumer reads the file of the previous run
+              fmt::print(stderr, "[info] stage \"{}\" is up to date, skipped\n", s.name);
+              m_stages[s.tee_to].stdin_fd = open(s.tee_file.c_str(), O_RDONLY | O_CLOEXEC);
+              s.done = true;
+              nb_done++;
+              continue;
+            }
+            if (!launch(s)) { terminate(); return false; }
+          }
+        }
+      }
+      if (nb_done == m_stages.size()) { break; }
+
+      int status;
+      pid_t pid = waitpid(-1, &status, 0);
+      if (pid < 0) {
+        if (errno == EINTR) { continue; }
+        break;
+      }
+
+      auto it = std::find_if(m_stages.begin(), m_stages.end(), [pid](const stage &s){ return s.pid == pid; });
+      if (it == m_stages.end()) { continue; }
+
+      double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - it->start_time).count();
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fmt::print(stderr, "[error] stage \"{}\" failed after {:.1f}s\n", it->name, elapsed);
+        terminate();
+        return false;
+      }
+      fmt::print(stderr, "[info] stage \"{}\" completed in {:.1f}s\n", it->name, elapsed);
+      if (it->tee.joinable()) { it->tee.join(); } // the copy of its output must be complete
+      m_cache.save(*it);
+      it->done = true;
+      nb_done++;
+    }
+
+    return nb_done == m_stages.size();
+  }
+
+private:
+  bool is_ready(const stage &s) const {
+    return std::all_of(s.after.begin(), s.after.end(), [this](std::size_t i){ return m_stages[i].done; });
+  }
+
+  std::vector<std::size_t> group_of(std::size_t i) const {
+    if (m_stages[i].group < 0) { return { i }; }
+    std::vector<std::size_t> members;
+    for (std::size_t j = 0; j < m_stages.size(); ++j) {
+      if (m_stages[j].group == m_stages[i].group) { members.push_back(j); }
+    }
+    return members;
+  }
+
+  bool launch(stage &s) {
+    std::string cmdline;
+    for (auto &arg : s.cmd) { cmdline += (cmdline.empty() ? "" : " ") + arg; }
+    fmt::print(stderr, "[info] stage \"{}\" starting: {}\n", s.name, cmdline);
+
+    // outputs of a previous (possibly interrupted) run are not valid anymore
+    m_cache.remove(s);
+    std::error_code ec;
+    if (!s.workdir.empty()) { fs::remove_all(s.workdir, ec); }
+    for (auto &p : s.outputs) { fs::remove_all(p, ec); }
+
+    if (!s.tee_file.empty()) {
+      int p_out[2], p_in[2];
+      if (pipe2(p_out, O_CLOEXEC) != 0) {
+        fmt::print(stderr, "[error] cannot create pipes for stage \"{}\"\n", s.name);
+        return false;
+      }
+      if (pipe2(p_in, O_CLOEXEC) != 0) {
+        fmt::print(stderr, "[error] cannot create pipes for stage \"{}\"\n", s.name);
+        close(p_out[0]); close(p_out[1]);
+        return false;
+      }
+      s.stdout_fd = p_out[1];
+      m_stages[s.tee_to].stdin_fd = p_in[0];
+      s.tee = std::thread(tee_stream, p_out[0], s.tee_file, p_in[1]);
+    }
+
+    std::vector<char*> argv;
+    for (auto &arg : s.cmd) { argv.push_back(const_cast<char*>(arg.c_str())); }
+    argv.push_back(nullptr);
+
+    s.start_time = std::chrono::steady_clock::now();
+    s.pid = fork();
+    if (s.pid < 0) {
+      fmt::print(stderr, "[error] cannot start stage \"{}\"\n", s.name);
+      close_pipes(s); // lets a tee thread reading the stdout of the stage finish
+      return false;
+    }
+    if (s.pid == 0) {
+      signal(SIGPIPE, SIG_DFL);
+      if (s.stdin_fd >= 0) { dup2(s.stdin_fd, STDIN_FILENO); }
+      if (s.stdout_fd >= 0) { dup2(s.stdout_fd, STDOUT_FILENO); }
+      if (s.cmd[0] == "kmat_tools") {
+        execv("/proc/self/exe", argv.data());
+      }
+      execvp(argv[0], argv.data());
+      fprintf(stderr, "[error] cannot execute \"%s\"\n", argv[0]);
+      _exit(127);
+    }
+
+    // the child owns its ends of the pipes now: the write end of a tee'd stdout must not stay
+    // open in the parent, or the tee thread would never see EOF if the stage fails
+    close_pipes(s);
+    return true;
+  }
+
+  static void close_pipes(stage &s) {
+    if (s.stdin_fd >= 0) { close(s.stdin_fd); s.stdin_fd = -1; }
+    if (s.stdout_fd >= 0) { close(s.stdout_fd); s.stdout_fd = -1; }
+  }
+
+  void terminate() {
+    for (auto &s : m_stages) {
+      if (s.pid > 0 && !s.done) { kill(s.pid, SIGTERM); }
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {}
+    // a tee thread blocks on EOF of its producer's stdout, or on a full pipe to a consumer
+    // that was never started: close the ends held for stages not launched before joining
+    for (auto &s : m_stages) { close_pipes(s); }
+    for (auto &s : m_stages) {
+      if (s.tee.joinable()) { s.tee.join(); }
+    }
+  }
+
+  std::vector<stage> m_stages;
+  stage_cache &m_cache;
+  bool m_use_cache;
+};
+
+
+// split a thread budget among concurrent stages proportionally to their weights
+static std::vector<std::size_t> split_threads(std::size_t nb_threads, const std::vector<std::size_t> &weights) {
+  std::size_t total = std::max<std::size_t>(1, std::accumulate(weights.begin(), weights.end(), std::size_t{0}));
+  std::vector<std::size_t> ret;
+  for (auto w : weights) { ret.push_back(std::max<std::size_t>(1, nb_threads * w / total)); }
+  return ret;
+}
+
+
+// sequence files listed in a kmtricks input file ("ID : FILE_1 ; FILE_2 ; ...")
+static std::vector<fs::path> fof_files(const std::string &fof) {
+  std::vector<fs::path> files;
+  std::ifstream in(fof);
+  for (std::string line; std::getline(in, line);) {
+    std::size_t pos = line.find(':');
+    if (pos == std::string::npos) { continue; }
+    std::istringstream iss(line.substr(pos+1));
+    for (std::string f; std::getline(iss, f, ';');) {
+      f.erase(0, f.find_first_not_of(" \t"));
+      f.erase(f.find_last_not_of(" \t\r") + 1);
+      if (!f.empty()) { files.push_back(f); }
+    }
+  }
+  return files;
+}
+
+
+int main_run(int argc, char **argv) {
+
+  run_options opts;
+  bool is_custom_utg_len = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "i:k:a:l:o:m:n:f:N:F:t:S:sPcgWRh")) != -1) {
+    switch (c) {
+      case 'i':
+        opts.input_matrix = optarg;
+        break;
+      case 'k':
+        opts.ksize = strtoul(optarg, NULL, 10);
+        break;
+      case 'a':
+        opts.min_abund = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        opts.utg_len = strtoul(optarg, NULL, 10);
+        is_custom_utg_len = true;
+        break;
+      case 'o':
+        opts.output_dir = optarg;
+        break;
+      case 'm':
+        opts.msize = optarg;
+        break;
+      case 'n':
+      case 'f':
+        if (!opts.param_n.empty()) {
+          fmt::print(stderr, "[error] options -n and -f are mutually exclusive\n");
+          return 1;
+        }
+        opts.param_n = { std::string("-") + (char)c, optarg };
+        break;
+      case 'N':
+        opts.rec_min = strtoul(optarg, NULL, 10);
+        [[fallthrough]];
+      case 'F':
+        if (!opts.param_N.empty()) {
+          fmt::print(stderr, "[error] options -N and -F are mutually exclusive\n");
+          return 1;
+        }
+        opts.param_N = { std::string("-") + (char)c, optarg };
+        break;
+      case 't':
+        opts.nb_threads = std::max(1, std::stoi(optarg));
+        break;
+      case 's':
+        opts.write_seq = true;
+        break;
+      case 'P':
+        opts.presence_only = true;
+        break;
+      case 'c':
+        opts.use_ggcat = false;
+        break;
+      case 'g':
+        opts.use_ggcat = true;
+        break;
+      case 'S':
+        opts.sketch_scale = std::max(1, std::stoi(optarg));
+        break;
+      case 'W':
+        opts.no_streaming = true;
+        break;
+      case 'R':
+        opts.recompute = true;
+        break;
+      case 'h':
+        print_run_usage();
+        return 0;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  bool skip_matrix_construction = !opts.input_matrix.empty();
+  if (argc-optind != (skip_matrix_construction ? 0 : 1)) {
+    print_run_usage();
+    return 0;
+  }
+
+  if (!skip_matrix_construction) {
+    opts.input_file = argv[optind];
+    if (!fs::is_regular_file(opts.input_file)) {
+      fmt::print(stderr, "[error] input file \"{}\" does not exist\n", opts.input_file);
+      return 1;
+    }
+  } else if (!fs::is_regular_file(opts.input_matrix) || fs::is_empty(opts.input_matrix)) {
+    fmt::print(stderr, "[error] input matrix \"{}\" is not a file or is empty\n", opts.input_matrix);
+    return 1;
+  }
+
+  if (opts.ksize >= 64) {
+    fmt::print(stderr, "[error] k-mer size (-k) should be less than 64\n");
+    return 1;
+  }
+  if (opts.msize != "auto" && strtoul(opts.msize.c_str(), NULL, 10) >= opts.ksize) {
+    fmt::print(stderr, "[error] minimizer length (-m) must be smaller than k-mer size (-k)\n");
+    return 1;
+  }
+
+  if (opts.param_n.empty() && opts.param_N.empty()) {
+    opts.param_n = { "-f", "0.1" };
+    opts.param_N = { "-F", "0.1" };
+  } else if (opts.param_n.empty() || opts.param_N.empty()) {
+    fmt::print(stderr, "[error] either both -n/-f and -N/-F must be specified or none of them\n");
+    return 1;
+  }
+
+  if (!is_custom_utg_len) { opts.utg_len = 2*opts.ksize - 1; }
+
+  // in sketch mode the filtered matrix and the k-mers given to the unitig builder are two
+  // different outputs of the filter stage, which cannot both be streamed
+  bool sketch = opts.sketch_scale > 1;
+  if (sketch) { opts.no_streaming = true; }
+
+  fs::create_directories(opts.output_dir);
+
+  if (skip_matrix_construction) {
+    FILE *mat = open_kmer_matrix(opts.input_matrix.c_str());
+    char *line = NULL;
+    size_t line_size = 0;
+    std::size_t klen = (mat && getline(&line, &line_size, mat) > 0) ? strcspn(line, " \t\n") : 0;
+    free(line);
+    if (mat) { fclose(mat); }
+    if (klen != opts.ksize) {
+      fmt::print(stderr, "[error] the k-mer length of the input matrix is {}, while k is set to {}\n", klen, opts.ksize);
+      return 1;
+    }
+  }
+
+  // the SIGPIPE default action is restored in the stages
+  signal(SIGPIPE, SIG_IGN);
+
+  // make external tools in the same directory of kmat_tools available first
+  {
+    std::error_code ec;
+    fs::path exe_dir = fs::read_symlink("/proc/self/exe", ec).parent_path();
+    const char *path = getenv("PATH");
+    std::string new_path = exe_dir.string() + (path ? std::string(":") + path : "");
+    if (!ec) { setenv("PATH", new_path.c_str(), 1); }
+  }
+
+  const std::size_t T = opts.nb_threads;
+  const fs::path out = opts.output_dir;
+  const fs::path kmtricks_dir = out/"kmtricks";
+  const fs::path filtered_matrix = out/"filtered_matrix.txt";
+  const fs::path filtered_kmers = out/"filtered_kmers.txt";
+  const fs::path unitig_kmers = sketch ? filtered_kmers : filtered_matrix;
+  const fs::path kmer_fasta = out/"kmer_matrix.fasta";
+  const fs::path unitigs = out/"unitigs.fa";
+  const fs::path unitigs_filtered = out/"unitigs_filtered.fa";
+  const fs::path unitig_matrix = out/"unitigs.mat";
+
+  // the pipeline DAG: kmtricks -> filter -> fasta -> ggcat -> unitig (which filters the unitigs by length)
+  // or, with -c: kmtricks -> filter -> compact -> unitig
+  // unless -W is used, the filtered matrix is written to disk and, at the same time, streamed
+  // to the fasta (or compact) stage; the output of fasta is streamed to ggcat through a FIFO:
+  // these stages run concurrently and share the thread budget
+  // stages whose manifest in the output directory matches their current inputs, outputs,
+  // parameters and executable are skipped (e.g., changing -l only reruns unitig)
+
+  // threads of the concurrent stages (one is left to the tee): filter, then fasta (or compact), then ggcat
+  std::size_t U = T > 1 ? T-1 : 1;
+  auto split = opts.no_streaming ? std::vector<std::size_t>{T, T, T}
+             : opts.use_ggcat ? split_threads(U, {1, 1, 2}) : split_threads(U, {1, 1});
+  stage_cache cache(out/".manifests");
+  pipeline p(cache, !opts.recompute);
+
+  std::size_t kmtricks = 0;
+  fs::path kmtricks_matrices = kmtricks_dir/"matrices";
+  if (!skip_matrix_construction) {
+    stage s{ "kmtricks", { "kmtricks", "pipeline", "--file", opts.input_file, "--kmer-size", std::to_string(opts.ksize),
+      "--hard-min", std::to_string(opts.min_abund), "--mode", opts.presence_only ? "kmer:pa:bin" : "kmer:count:bin", "--cpr", "--run-dir", kmtricks_dir.string(),
+      "-t", std::to_string(T), "--recurrence-min", std::to_string(opts.rec_min) } };
+    s.inputs = fof_files(opts.input_file);
+    s.inputs.insert(s.inputs.begin(), opts.input_file);
+    s.outputs = { kmtricks_matrices };
+    s.workdir = kmtricks_dir; // kmtricks requires a run directory which does not exist
+    kmtricks = p.add(std::move(s));
+  }
+  std::vector<std::size_t> after_kmtricks;
+  if (!skip_matrix_construction) { after_kmtricks.push_back(kmtricks); }
+
+  std::vector<std::string> filter_cmd;
+  if (skip_matrix_construction) {
+    filter_cmd = { "kmat_tools", "filter", "-a", std::to_string(opts.min_abund) };
+  } else {
+    // the partition summaries let a rerun with other -n/-N thresholds skip the count comparisons
+    filter_cmd = { "kmat_tools", "ktfilter", "-t", std::to_string(split[0]), "-a", std::to_string(opts.min_abund),
+      "-C", std::to_string(opts.min_abund) };
+  }
+  filter_cmd.insert(filter_cmd.end(), opts.param_n.begin(), opts.param_n.end());
+  filter_cmd.insert(filter_cmd.end(), opts.param_N.begin(), opts.param_N.end());
+  if (sketch) { filter_cmd.insert(filter_cmd.end(), { "-S", std::to_string(opts.sketch_scale), "-K", filtered_kmers.string() }); }
+  if (opts.no_streaming) { filter_cmd.insert(filter_cmd.end(), { "-o", filtered_matrix.string() }); }
+  filter_cmd.push_back(skip_matrix_construction ? opts.input_matrix : kmtricks_dir.string());
+
+  std::vector<fs::path> filter_outputs = { filtered_matrix };
+  if (sketch) { filter_outputs.push_back(filtered_kmers); }
+  std::size_t filter = p.add({ "filter", filter_cmd, after_kmtricks,
+    { skip_matrix_construction ? fs::path(opts.input_matrix) : kmtricks_matrices }, filter_outputs });
+  std::size_t fasta = 0, ggcat = 0, compact = 0, utg_builder = 0;
+  std::string filtered_input = opts.no_streaming ? unitig_kmers.string() : "-";
+  if (opts.use_ggcat) {
+    fasta = p.add({ "fasta", { "kmat_tools", "fasta", "-c", "-t", std::to_string(split[1]), "-o", kmer_fasta.string(), filtered_input },
+      after_kmtricks, { unitig_kmers } });
+    ggcat = p.add({ "ggcat", { "ggcat", "build", kmer_fasta.string(), "-o", unitigs.string(),
+      "-j", std::to_string(split[2]), "-s", "1", "-k", std::to_string(opts.ksize) }, after_kmtricks, { unitig_kmers }, { unitigs } });
+    utg_builder = ggcat;
+  } else {
+    compact = p.add({ "compact", { "kmat_tools", "compact", "-l", std::to_string(opts.utg_len), "-t", std::to_string(split[1]),
+      "-o", unitigs_filtered.string(), filtered_input }, after_kmtricks, { unitig_kmers }, { unitigs_filtered } });
+    utg_builder = compact;
+  }
+
+  std::vector<std::string> unitig_cmd = { "kmat_tools", "unitig", "-k", std::to_string(opts.ksize), "-m", opts.msize,
+    "-o", unitig_matrix.string(), "-t", std::to_string(T) };
+  if (opts.write_seq) { unitig_cmd.push_back("-s"); }
+  if (opts.presence_only) { unitig_cmd.push_back("-P"); }
+  if (sketch) { unitig_cmd.push_back("-S"); }
+  if (opts.use_ggcat) { unitig_cmd.insert(unitig_cmd.end(), { "-l", std::to_string(opts.utg_len) }); }
+  const fs::path &unitigs_fasta = opts.use_ggcat ? unitigs : unitigs_filtered;
+  unitig_cmd.insert(unitig_cmd.end(), { unitigs_fasta.string(), filtered_matrix.string() });
+  p.add({ "unitig", unitig_cmd, { filter, utg_builder }, { unitigs_fasta, filtered_matrix }, { unitig_matrix } });
+
+  if (opts.no_streaming && opts.use_ggcat) {
+    p[fasta].after = { filter };
+    p[fasta].outputs = { kmer_fasta };
+    p[ggcat].after = { fasta };
+    p[ggcat].inputs = { kmer_fasta };
+  } else if (opts.no_streaming) {
+    p[compact].after = { filter };
+  } else if (opts.use_ggcat) {
+    fs::remove(kmer_fasta);
+    if (mkfifo(kmer_fasta.c_str(), 0600) != 0) {
+      fmt::print(stderr, "[error] cannot create FIFO \"{}\"\n", kmer_fasta.c_str());
+      return 1;
+    }
+    p[filter].tee_file = filtered_matrix;
+    p[filter].tee_to = fasta;
+    p[filter].group = p[fasta].group = p[ggcat].group = 0;
+  } else {
+    p[filter].tee_file = filtered_matrix;
+    p[filter].tee_to = compact;
+    p[filter].group = p[compact].group = 0;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  bool ok = p.run();
+  if (!opts.no_streaming && opts.use_ggcat) { fs::remove(kmer_fasta); }
+
+  if (!ok) {
+    if (fs::exists(filtered_matrix) && fs::is_empty(filtered_matrix)) {
+      fmt::print(stderr, "[error] your filters were too stringent: the filtered k-mer matrix \"{}\" is empty\n", filtered_matrix.c_str());
+    } else if (fs::exists(unitigs_filtered) && fs::is_empty(unitigs_filtered)) {
+      fmt::print(stderr, "[error] your filters were too stringent: no unitig is at least {} bp long\n", opts.utg_len);
+    }
+    return 1;
+  }
+
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  fmt::print(stderr, "[info] output unitig matrix written to: {}\n", fs::absolute(unitig_matrix).c_str());
+  fmt::print(stderr, "[info] pipeline completed in {:.1f}s\n", elapsed);
+
+  return 0;
+}
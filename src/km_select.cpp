@@ -1,4 +1,5 @@
 #include "common.h"
+#include "progress.h"
 
 
 int main_select(int argc, char **argv) {
@@ -71,6 +72,10 @@ int main_select(int argc, char **argv) {
     return 1;
   }
 
+  progress_meter &progress = progress_meter::global();
+  progress.watch_input(matfile);
+  progress.watch_output(outfile);
+
   char *sel_kmer = (char *)calloc(ksize+1,1);
   char *mat_kmer = (char *)calloc(ksize+1,1);
   char *line = NULL;
@@ -86,12 +91,14 @@ int main_select(int argc, char **argv) {
       ret_sel = next_kmer(sel_kmer, ksize, selfile);
       ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile);
       tot_kmers += ret_mat;
+      progress.add(PROGRESS_ROWS, ret_mat);
     } else if(ret_cmp < 0) {
       ret_sel = next_kmer(sel_kmer, ksize, selfile);
     } else { // ret_cmp > 0
       if(!do_select){ fputs(line,outfile); kept_kmers++; }
       ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile);
       tot_kmers += ret_mat;
+      progress.add(PROGRESS_ROWS, ret_mat);
     }
   }
   
@@ -100,6 +107,7 @@ int main_select(int argc, char **argv) {
     if(!do_select) { fputs(line,outfile); kept_kmers++; }
     ret_mat = next_kmer_and_line(mat_kmer, ksize, &line, &line_size, matfile);
     tot_kmers += ret_mat;
+    progress.add(PROGRESS_ROWS, ret_mat);
   }
 
   fprintf(stderr, "[info] %lu\ttotal k-mers\n", tot_kmers);
@@ -2,18 +2,28 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "progress.h"
+
 #define KMAT_TOOLS_VERSION "v0.2"
 
 int main_basic_filter(int argc, char *argv[]);
+int main_columns(int argc, char *argv[]);
+int main_compact(int argc, char *argv[]);
 int main_convert(int argc, char *argv[]);
 int main_diff(int argc, char *argv[]);
+int main_dist(int argc, char *argv[]);
 int main_fasta(int argc, char *argv[]);
 int main_fafmt(int argc, char *argv[]);
 int main_ktfilter(int argc, char *argv[]);
+int main_ktmerge(int argc, char *argv[]);
+int main_lookup(int argc, char *argv[]);
 int main_merge(int argc, char *argv[]);
+int main_quantify(int argc, char *argv[]);
 int main_reverse(int argc, char *argv[]);
+int main_run(int argc, char *argv[]);
 int main_select(int argc, char *argv[]);
 int main_unitig(int argc, char *argv[]);
+int main_unitig_reduce(int argc, char *argv[]);
 
 static int usage()
 {
@@ -26,37 +36,74 @@ static int usage()
     fprintf(stderr, "  kmat_tools <command> <arguments>\n\n");
 
     fprintf(stderr, "COMMANDS\n");
+    fprintf(stderr, "  columns  - select a subset of the samples of a k-mer or unitig matrix\n");
+    fprintf(stderr, "  compact  - build the unitigs of the de Bruijn graph of the k-mers of a matrix\n");
     fprintf(stderr, "  convert  - convert ggcat jsonl color output into a csv unitig matrix\n");
     fprintf(stderr, "  diff     - difference between two sorted k-mer matrices\n");
+    fprintf(stderr, "  dist     - pairwise sample distances of a bit-packed presence/absence unitig matrix\n");
     fprintf(stderr, "  fasta    - output a k-mer matrix in FASTA format\n");
     fprintf(stderr, "  fafmt    - filter a FASTA file by length and write sequences in single lines\n");
     fprintf(stderr, "  filter   - filter a text k-mer matrix by selecting k-mers that are potentially differential\n");
     fprintf(stderr, "  ktfilter - filter a kmtricks matrix by selecting k-mers that are potentially differential\n");
+    fprintf(stderr, "  ktmerge  - merge the matrices of two kmtricks runs on different samples\n");
+    fprintf(stderr, "  lookup   - query k-mer abundances from the k-mer store written by \"unitig -C\"\n");
     fprintf(stderr, "  merge    - merge two input sorted k-mer matrices\n");
+    fprintf(stderr, "  quantify - add samples to a unitig matrix by quantifying unitigs from sequencing reads\n");
     fprintf(stderr, "  reverse  - reverse complement k-mers in a matrix\n");
+    fprintf(stderr, "  run      - run the muset pipeline overlapping its stages\n");
     fprintf(stderr, "  select   - select only a subset of k-mers\n");
     fprintf(stderr, "  unitig   - build a unitig matrix\n");
-    fprintf(stderr, "  version  - print version\n");
+    fprintf(stderr, "  unitig-reduce - merge the partial unitig matrices of \"unitig --shard\"\n");
+    fprintf(stderr, "  version  - print version\n\n");
+
+    fprintf(stderr, "ENVIRONMENT\n");
+    fprintf(stderr, "  KMAT_PROGRESS=SECONDS  print the progress of the command (rows/s, MB/s, ETA) every SECONDS\n");
+    fprintf(stderr, "  KMAT_METRICS_DIR=DIR   write the progress of the command to DIR/kmat_tools_<command>.prom, in the\n");
+    fprintf(stderr, "                         format of the textfile collector of the node exporter (every KMAT_PROGRESS\n");
+    fprintf(stderr, "                         seconds, 15 by default)\n");
     fprintf(stderr, "\n");
     return 0;
 }
 
+typedef int (*command_main)(int argc, char *argv[]);
+
+static command_main find_command(const char *cmd)
+{
+    if (strcmp(cmd, "columns") == 0) { return main_columns; }
+    else if (strcmp(cmd, "compact") == 0) { return main_compact; }
+    else if (strcmp(cmd, "diff") == 0) { return main_diff; }
+    else if (strcmp(cmd, "dist") == 0) { return main_dist; }
+    else if (strcmp(cmd, "fasta") == 0) { return main_fasta; }
+    else if (strcmp(cmd, "fafmt") == 0) { return main_fafmt; }
+    else if (strcmp(cmd, "filter") == 0) { return main_basic_filter; }
+    else if (strcmp(cmd, "ktfilter") == 0) { return main_ktfilter; }
+    else if (strcmp(cmd, "ktmerge") == 0) { return main_ktmerge; }
+    else if (strcmp(cmd, "lookup") == 0) { return main_lookup; }
+    else if (strcmp(cmd, "merge") == 0) { return main_merge; }
+    else if (strcmp(cmd, "quantify") == 0) { return main_quantify; }
+    else if (strcmp(cmd, "reverse") == 0) { return main_reverse; }
+    else if (strcmp(cmd, "run") == 0) { return main_run; }
+    else if (strcmp(cmd, "select") == 0) { return main_select; }
+    else if (strcmp(cmd, "unitig") == 0) { return main_unitig; }
+    else if (strcmp(cmd, "unitig-reduce") == 0) { return main_unitig_reduce; }
+    else if (strcmp(cmd, "convert") == 0) { return main_convert; }
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2 || strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) { 
         return usage(); 
     }
 
-    if (strcmp(argv[1], "diff") == 0) { return main_diff(argc-1, argv+1); }
-    else if (strcmp(argv[1], "fasta") == 0) { return main_fasta(argc-1, argv+1); }
-    else if (strcmp(argv[1], "fafmt") == 0) { return main_fafmt(argc-1, argv+1); }
-    else if (strcmp(argv[1], "filter") == 0) { return main_basic_filter(argc-1, argv+1); }
-    else if (strcmp(argv[1], "ktfilter") == 0) { return main_ktfilter(argc-1, argv+1); }
-    else if (strcmp(argv[1], "merge") == 0) { return main_merge(argc-1, argv+1); }
-    else if (strcmp(argv[1], "reverse") == 0) { return main_reverse(argc-1, argv+1); }
-    else if (strcmp(argv[1], "select") == 0) { return main_select(argc-1, argv+1); }
-    else if (strcmp(argv[1], "unitig") == 0) { return main_unitig(argc-1, argv+1); }
-    else if (strcmp(argv[1], "convert") == 0) { return main_convert(argc-1, argv+1); }
+    command_main cmd_main = find_command(argv[1]);
+    if (cmd_main != NULL) {
+        // progress of the command (see usage), the stages of "run" reporting their own
+        if (strcmp(argv[1], "run") != 0) { progress_meter::global().start(argv[1]); }
+        int ret = cmd_main(argc-1, argv+1);
+        progress_meter::global().stop();
+        return ret;
+    }
 
     if (strcmp(argv[1], "version") == 0 || strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-v") == 0) {
         fprintf(stderr, "kmat_tools %s\n", KMAT_TOOLS_VERSION);
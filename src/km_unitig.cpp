@@ -1,34 +1,235 @@
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <fstream>
-#include <iostream>
 #include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <filesystem>
+#include <thread>
+
+#include <getopt.h>
 
-#include "../external/kseq++/seqio.hpp"
 #include "../external/sshash/dictionary.hpp"
 
+#include "kmtricks.h"
+#include "bit_matrix.h"
 #include "common.h"
+#include "kff.h"
+#include "kmer_count_store.h"
+#include "minimizer_probe.h"
+#include "partition_prefetch.h"
+#include "progress.h"
+#include "unitig_chains.h"
+#include "unitig_dict.h"
+#include "unitig_partial.h"
+#include "unitig_profiles.h"
+#include "unitig_quantiles.h"
+
+namespace fs = std::filesystem;
+
+
+// accumulate the (hits,sum) pairs of the unitigs, n_samples per unitig, from kmtricks matrix
+// partitions (count or presence/absence) processed by nb_threads threads, one partition at a
+// time each; the k-mers of a unitig are spread over several partitions, so the updates of a
+// row are serialized by locks striped over the unitig identifiers
+template<size_t MAX_K>
+struct shard_functor {
+
+  using count_type = typename km::selectC<DMAX_C>::type;
+
+  void operator()(const sshash::dictionary &dict, const std::vector<std::string> &paths, std::size_t n_samples, std::size_t nb_threads,
+                  std::vector<std::pair<uint32_t,uint32_t>> &utg_samples, std::string &error)
+  {
+    constexpr std::size_t nb_locks = 1024;
+    std::vector<std::mutex> locks(nb_locks);
+    std::atomic<std::size_t> next{0};
+    std::mutex error_mutex;
+
+    progress_meter &progress = progress_meter::global();
+    auto add_row = [&](const km::Kmer<MAX_K> &kmer, const std::vector<count_type> &counts) {
+      auto res = dict.lookup_advanced(kmer.to_string().c_str());
+      progress.add(PROGRESS_ROWS);
+      if (res.kmer_id == sshash::constants::invalid_uint64) { progress.add(PROGRESS_MISSES); return; }
+      progress.add(PROGRESS_HITS);
+      std::lock_guard<std::mutex> lock(locks[res.contig_id % nb_locks]);
+      auto *row = utg_samples.data() + res.contig_id * n_samples;
+      for (std::size_t s = 0; s < n_samples; ++s) {
+        row[s].first = add_sat(row[s].first, uint32_t{counts[s] > 0});
+        row[s].second = add_sat(row[s].second, uint32_t(counts[s]));
+      }
+    };
+
+    // the next blocks of a partition are read while its k-mers are looked up
+    prefetch_options prefetch;
+    auto worker = [&]() {
+      km::Kmer<MAX_K> kmer; kmer.set_k(dict.k());
+      std::vector<count_type> counts(n_samples);
+      for (std::size_t i; (i = next++) < paths.size(); ) {
+        try {
+          if (is_pa_matrix(paths[i])) {
+            prefetching_reader<km::PAMatrixReader<8192>> reader(paths[i], prefetch);
+            if (reader.infos().bits != n_samples) { throw std::runtime_error("\"" + paths[i] + "\" has a different number of samples"); }
+            std::vector<uint8_t> bits(reader.infos().bytes);
+            while (reader.template read<MAX_K>(kmer, bits)) {
+              for (std::size_t s = 0; s < n_samples; ++s) { counts[s] = (bits[s/8] >> (s%8)) & 1; }
+              add_row(kmer, counts);
+            }
+          } else {
+            prefetching_reader<km::MatrixReader<8192>> reader(paths[i], prefetch);
+            if (reader.infos().nb_counts != n_samples) { throw std::runtime_error("\"" + paths[i] + "\" has a different number of samples"); }
+            while (reader.template read<MAX_K, DMAX_C>(kmer, counts)) { add_row(kmer, counts); }
+          }
+        } catch (const km::km_exception &e) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          error = e.get_name() + " - " + e.get_msg();
+        } catch (const std::exception &e) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          error = e.what();
+        }
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t t = 0; t < std::min(nb_threads, paths.size()); ++t) { workers.emplace_back(worker); }
+    for (auto &t : workers) { t.join(); }
+  }
+};
+
+
+// parse a "i/n" shard specification (0 <= i < n)
+static bool parse_shard(const char *arg, uint32_t &shard, uint32_t &nb_shards) {
+  char *end;
+  unsigned long i = strtoul(arg, &end, 10);
+  if (end == arg || *end != '/') { return false; }
+  const char *arg_n = end+1;
+  unsigned long n = strtoul(arg_n, &end, 10);
+  if (end == arg_n || *end != '\0' || n == 0 || i >= n || n > UINT32_MAX) { return false; }
+  shard = i; nb_shards = n;
+  return true;
+}
+
+
+// compute the partial unitig matrix of one shard of the partitions stored in a directory
+// (partition j belongs to shard j mod n, in the lexicographic order of the file names)
+static int unitig_shard(const sshash::dictionary &kmer_dict, const std::string &parts_dir, uint32_t shard, uint32_t nb_shards, std::size_t nb_threads, const std::string &out_fname) {
+
+  std::vector<std::string> all_paths;
+  for (auto const& entry : fs::directory_iterator{parts_dir}) {
+    if (fs::is_regular_file(entry)) { all_paths.push_back(entry.path()); }
+  }
+  std::sort(all_paths.begin(), all_paths.end());
+  if (all_paths.empty()) {
+    std::cerr << "[error] partitions directory \"" << parts_dir << "\" is empty" << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> paths;
+  for (std::size_t j = shard; j < all_paths.size(); j += nb_shards) { paths.push_back(all_paths[j]); }
+
+  // the number of samples and the k-mer size are retrieved from the first partition of the
+  // directory, so that all the shards agree even when some of them have no partition
+  std::size_t n_samples, kmer_size;
+  try {
+    if (is_pa_matrix(all_paths[0])) {
+      km::PAMatrixReader<8192> reader(all_paths[0]);
+      n_samples = reader.infos().bits;
+      kmer_size = reader.infos().kmer_size;
+    } else {
+      km::MatrixReader reader(all_paths[0]);
+      n_samples = reader.infos().nb_counts;
+      kmer_size = reader.infos().kmer_size;
+    }
+  } catch (const km::km_exception &e) {
+    std::cerr << "[error] \"" << all_paths[0] << "\" is not a kmtricks matrix partition" << std::endl;
+    return 1;
+  }
+
+  if (kmer_size != kmer_dict.k()) {
+    std::cerr << "[error] the k-mer size of the partitions (" << kmer_size << ") differs from the one of the dictionary (" << kmer_dict.k() << ")" << std::endl;
+    return 1;
+  }
+
+  std::cerr << "[info] shard " << shard << "/" << nb_shards << ": " << paths.size() << " of " << all_paths.size() << " partitions" << std::endl;
+  std::cerr << "[info] samples: " << n_samples << std::endl;
+
+  progress_meter &progress = progress_meter::global();
+  progress.phase("reading partitions");
+  for (const std::string &path : paths) {
+    std::error_code ec;
+    std::uintmax_t size = fs::file_size(path, ec);
+    progress.expect_input(ec ? 0 : size);
+  }
+
+  std::vector<std::pair<uint32_t,uint32_t>> utg_samples(kmer_dict.num_contigs() * n_samples);
+  std::string error;
+  km::const_loop_executor<0, KMER_N>::exec<shard_functor>(kmer_size, kmer_dict, paths, n_samples, nb_threads, utg_samples, error);
+  if (!error.empty()) {
+    std::cerr << "[error] " << error << std::endl;
+    return 1;
+  }
+
+  unitig_partial_header hdr{};
+  hdr.shard = shard;
+  hdr.nb_shards = nb_shards;
+  hdr.nb_unitigs = kmer_dict.num_contigs();
+  hdr.nb_kmers = kmer_dict.size();
+  hdr.nb_samples = n_samples;
+
+  std::cerr << "[info] writing partial unitig matrix" << std::endl;
+  progress.phase("writing the partial unitig matrix");
+  progress.watch_output(out_fname);
+  if (!write_unitig_partial(out_fname, hdr, utg_samples)) {
+    std::cerr << "[error] cannot write partial unitig matrix to \"" << out_fname << "\"" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
 
 
 int main_unitig(int argc, char **argv) {
 
   std::size_t ksize = 31;
   std::size_t msize = 15;
+  bool auto_msize = false;
+  std::size_t min_utg_len = 0;
   std::size_t nb_threads = 1;
   std::string out_fname;
+  std::string dict_fname;
   bool out_writeseq = false;
+  bool presence_only = false;
+  bool sketch = false;
   bool help_opt = false;
+  std::string load_dict_fname;
+  std::string store_fname;
+  std::string bits_fname;
+  std::string profiles_prefix;
+  std::string profiles_fname;
+  double min_frac = 0.8;
+  std::size_t nb_quantile_kmers = 0;
+  double merge_tol = -1;
+  uint32_t shard = 0, nb_shards = 0;
+
+  static struct option long_options[] = {
+    { "shard", required_argument, NULL, 'p' },
+    { NULL, 0, NULL, 0 }
+  };
 
   int c;
-  while ((c = getopt(argc, argv, "k:m:o:t:sh")) != -1) {
+  while ((c = getopt_long(argc, argv, "k:m:l:o:t:b:r:d:D:C:p:Q:u:U:M:sPSh", long_options, NULL)) != -1) {
     switch (c) {
       case 'k':
         ksize = std::strtoul(optarg, NULL, 10);
         break;
       case 'm':
-        msize = std::strtoul(optarg, NULL, 10);
+        auto_msize = (strcmp(optarg, "auto") == 0);
+        msize = auto_msize ? 0 : std::strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        min_utg_len = std::strtoul(optarg, NULL, 10);
         break;
       case 'o':
         out_fname = optarg;
@@ -39,6 +240,45 @@ int main_unitig(int argc, char **argv) {
       case 's':
         out_writeseq = true;
         break;
+      case 'd':
+        load_dict_fname = optarg;
+        break;
+      case 'C':
+        store_fname = optarg;
+        break;
+      case 'b':
+        bits_fname = optarg;
+        break;
+      case 'r':
+        min_frac = std::atof(optarg);
+        break;
+      case 'D':
+        dict_fname = optarg;
+        break;
+      case 'p':
+        if(!parse_shard(optarg, shard, nb_shards)) {
+          std::cerr << "[error] --shard must be of the form I/N with 0 <= I < N" << std::endl;
+          return 1;
+        }
+        break;
+      case 'Q':
+        nb_quantile_kmers = std::strtoul(optarg, NULL, 10);
+        break;
+      case 'M':
+        merge_tol = std::max(0.0, std::atof(optarg));
+        break;
+      case 'u':
+        profiles_prefix = optarg;
+        break;
+      case 'U':
+        profiles_fname = optarg;
+        break;
+      case 'P':
+        presence_only = true;
+        break;
+      case 'S':
+        sketch = true;
+        break;
       case 'h':
         help_opt = true;
         break;
@@ -49,26 +289,66 @@ int main_unitig(int argc, char **argv) {
     }
   }
 
-  if(argc-optind != 2 || help_opt) {
-    std::cout << "Usage: kmat_tools unitig [options] <unitigs.fasta> <kmer_matrix>\n\n";
-    std::cout << "Creates a unitig matrix.\n\n";
+  std::size_t n_utg_args = load_dict_fname.empty() ? 1 : 0;
+  if(argc-optind != (int)n_utg_args+1 || help_opt) {
+    std::cout << "Usage: kmat_tools unitig [options] <unitigs.fasta> <kmer_matrix>\n";
+    std::cout << "       kmat_tools unitig [options] -d <unitigs.dict> <kmer_matrix>\n";
+    std::cout << "       kmat_tools unitig [options] --shard I/N -o <partial.bin> [-d <unitigs.dict> | <unitigs.fasta>] <partitions_dir>\n\n";
+    std::cout << "Creates a unitig matrix from a k-mer matrix (text or KFF file).\n";
+    std::cout << "With --shard, only the partitions I, I+N, I+2N, ... of a directory of kmtricks matrix partitions\n";
+    std::cout << "(e.g. the \"matrices_filtered\" directory written by \"kmat_tools ktfilter\") are processed and a\n";
+    std::cout << "partial matrix is written, the partial matrices of the N shards being merged by \"kmat_tools unitig-reduce\".\n\n";
     std::cout << "Options:\n";
     std::cout << "  -k INT   k-mer size (must be <= 63) [31]\n";
-    std::cout << "  -m INT   minimizer length (must be < k) [15]\n";
+    std::cout << "  -m INT   minimizer length (must be < k), or \"auto\" to choose the one predicted to give the\n";
+    std::cout << "           fastest k-mer lookups from a sample of the unitigs [15]\n";
+    std::cout << "  -l INT   only keep the unitigs at least INT bp long, e.g. to give the raw (possibly gzipped)\n";
+    std::cout << "           output of ggcat without filtering it with \"kmat_tools fafmt\" first [0]\n";
     std::cout << "  -o FILE  write unitig matrix to FILE [stdout]\n";
     std::cout << "  -t INT   number of threads [1]\n";
     std::cout << "  -s       write the unitig sequence as first column instead of the identifier\n";
+    std::cout << "  -d FILE  load the k-mer dictionary from FILE instead of <unitigs.fasta> (see -D)\n";
+    std::cout << "  -D FILE  save the k-mer dictionary to FILE (it can be reused by \"kmat_tools quantify\")\n";
+    std::cout << "  -b FILE  also write a bit-packed, sample-major presence/absence unitig matrix to FILE (see \"kmat_tools dist\")\n";
+    std::cout << "  -r FLOAT min fraction of the k-mers of a unitig present in a sample for the unitig to be present with -b [0.8]\n";
+    std::cout << "  -C FILE  also write the abundances of the k-mers to FILE, compressed and ordered by their identifiers\n";
+    std::cout << "           in the dictionary, to be queried with \"kmat_tools lookup\" along with the dictionary (see -D)\n";
+    std::cout << "  -Q INT   also output the median and the interquartile range of the abundances of the k-mers of\n";
+    std::cout << "           each unitig in each sample (\"avg;frac;median;iqr\" columns), computed from INT k-mers evenly\n";
+    std::cout << "           spaced along the unitig (exact for unitigs of at most INT k-mers), using 4*INT bytes per\n";
+    std::cout << "           unitig and sample\n";
+    std::cout << "  -M FLOAT merge the chains of adjacent unitigs, with no other unitig at their junctions, whose k-mer\n";
+    std::cout << "           fractions differ by at most FLOAT in every sample and average abundances by at most FLOAT\n";
+    std::cout << "           times the largest one (0 for equal values): a row is written per chain, whose identifiers\n";
+    std::cout << "           are separated by commas (or its sequence with -s), and its values are computed over its k-mers\n";
+    std::cout << "  -u STR   also write the distinct rows of the unitig matrix (\"profiles\") to STR.profiles, one per line\n";
+    std::cout << "           after its identifier, and the profile of each unitig to STR.map; the full matrix is then\n";
+    std::cout << "           only written with -o\n";
+    std::cout << "  -U FILE  same as -u in a single compact binary file\n";
+    std::cout << "  -p, --shard I/N  only process shard I (0-based) out of N of a directory of kmtricks matrix partitions\n";
+    std::cout << "                   and write the partial matrix to the -o file (-P is implied by presence/absence partitions)\n";
+    std::cout << "  -P       only use k-mer presence (any non-zero value) to compute unitig k-mer fractions, for\n";
+    std::cout << "           presence/absence matrices (the average abundance is then equal to the fraction)\n";
+    std::cout << "  -S       the k-mer matrix is a FracMinHash sample (see \"kmat_tools filter -S\"): k-mer fractions\n";
+    std::cout << "           are computed over the sampled k-mers of each unitig, and two columns are added after\n";
+    std::cout << "           the first one: the number of sampled k-mers of the unitig and the half-width of the\n";
+    std::cout << "           95% confidence interval of its k-mer fractions (1.00 when no k-mer is sampled)\n";
     std::cout << "  -h       print this help message\n";
     return 0;
   }
 
-  std::string utg_file = argv[optind];
-  if(!std::filesystem::exists(utg_file.c_str())) {
+  std::string utg_file = n_utg_args ? argv[optind] : "";
+  if(n_utg_args && !std::filesystem::exists(utg_file.c_str())) {
     std::cerr << "[error] unitig file \"" << utg_file << "\" does not exist" << std::endl;
     return 1;
   }
 
-  std::string mat_file = argv[optind+1];
+  if(!load_dict_fname.empty() && !std::filesystem::exists(load_dict_fname.c_str())) {
+    std::cerr << "[error] dictionary file \"" << load_dict_fname << "\" does not exist" << std::endl;
+    return 1;
+  }
+
+  std::string mat_file = argv[optind+n_utg_args];
   if(!std::filesystem::exists(mat_file.c_str())) {
     std::cerr << "[error] matrix file \"" << mat_file << "\" does not exist" << std::endl;
     return 1;
@@ -82,7 +362,7 @@ int main_unitig(int argc, char **argv) {
     return 1;
   }
 
-  if(msize <= 0) { 
+  if(msize <= 0 && !auto_msize) { 
     std::cerr << "[error] -m parameter must be greater than zero" << std::endl;
     return 1;
   } else if (msize >= ksize) {
@@ -90,48 +370,102 @@ int main_unitig(int argc, char **argv) {
     return 1;
   }
 
+  if(min_utg_len > 0 && !load_dict_fname.empty()) {
+    std::cerr << "[error] -l cannot be used with -d (the unitigs of the dictionary are already selected)" << std::endl;
+    return 1;
+  }
+
+  if(nb_quantile_kmers > 0 && (presence_only || sketch || merge_tol >= 0)) {
+    std::cerr << "[error] -Q cannot be used with -P, -S or -M" << std::endl;
+    return 1;
+  }
+
+  if(nb_shards > 0) {
+    if(out_fname.empty()) {
+      std::cerr << "[error] --shard requires an output file (-o)" << std::endl;
+      return 1;
+    } else if(!fs::is_directory(mat_file)) {
+      std::cerr << "[error] with --shard, \"" << mat_file << "\" must be a directory of kmtricks matrix partitions" << std::endl;
+      return 1;
+    } else if(sketch || !store_fname.empty() || !bits_fname.empty() || nb_quantile_kmers > 0 || !profiles_prefix.empty() || !profiles_fname.empty() || merge_tol >= 0) {
+      std::cerr << "[error] -S, -C, -b, -Q, -M, -u and -U cannot be used with --shard" << std::endl;
+      return 1;
+    }
+  }
+
   // print some info to stderr
 
-  std::cerr << "[info] k-mer length: " << ksize << std::endl;
-  std::cerr << "[info] minimizer length: " << msize << std::endl;
   std::cerr << "[info] threads: " << nb_threads << std::endl;
 
-  // build sshash-based dictionary of k-mers
+  progress_meter &progress = progress_meter::global();
 
-  std::cerr << "[info] building k-mer dictionary"  << std::endl;
+  // build (or load) sshash-based dictionary of k-mers
 
   sshash::dictionary kmer_dict;
-  {
-    // std::ofstream ofs("sshash.log", std::ios::out);
-    // std::streambuf *coutbuf = std::cout.rdbuf();
-    // if (ofs.good()) {
-    //   std::cout.rdbuf(ofs.rdbuf());
-    // }
-
-    sshash::build_configuration build_config;
-    build_config.k = ksize;
-    build_config.m = msize;
-    build_config.c = 5.0;
-    build_config.pthash_threads = nb_threads;
-    build_config.canonical_parsing = true;
-    build_config.verbose = false;
-
-    kmer_dict.build(utg_file, build_config);
+  unitig_names utg_names;
+  if(load_dict_fname.empty()) {
+    std::cerr << "[info] k-mer length: " << ksize << std::endl;
+    if(auto_msize) {
+      std::cerr << "[info] probing minimizer lengths on a sample of the unitigs" << std::endl;
+      progress.phase("probing minimizer lengths");
+      std::vector<minimizer_probe> probes = choose_minimizer_len(utg_file, ksize, nb_threads, min_utg_len);
+      if(probes.empty()) {
+        std::cerr << "[error] no unitig of \"" << utg_file << "\" is at least " << std::max(ksize, min_utg_len) << " bp long" << std::endl;
+        return 1;
+      }
+      minimizer_probe chosen = probes[0];
+      std::sort(probes.begin(), probes.end(), [](auto &a, auto &b){ return a.m < b.m; });
+      for(const minimizer_probe &p : probes) {
+        std::cerr << "[info]   m=" << p.m << (p.m == chosen.m ? "*" : "") << std::fixed << std::setprecision(2)
+                  << "\tbucket size " << p.avg_bucket << "\tskew " << 100.0*p.skew_frac << "%"
+                  << "\t" << p.bits_per_kmer << " bits/k-mer\t" << std::setprecision(1) << p.lookup_ns << " ns/lookup" << std::endl;
+      }
+      std::cerr << std::defaultfloat;
+      msize = chosen.m;
+      std::cerr << "[info] predicted lookup throughput: " << std::fixed << std::setprecision(2) << 1e3 / chosen.lookup_ns
+                << "M k-mers/s per thread" << std::defaultfloat << std::endl;
+    }
+    std::cerr << "[info] minimizer length: " << msize << std::endl;
+    if(min_utg_len > 0) { std::cerr << "[info] min unitig length: " << min_utg_len << std::endl; }
+    std::cerr << "[info] building k-mer dictionary"  << std::endl;
+    progress.phase("building the dictionary");
+    if(!build_unitig_dict(kmer_dict, utg_names, utg_file, ksize, msize, nb_threads, min_utg_len)) {
+      std::cerr << "[error] no unitig of \"" << utg_file << "\" is at least " << std::max(ksize, min_utg_len) << " bp long" << std::endl;
+      return 1;
+    }
+  } else {
+    std::cerr << "[info] loading k-mer dictionary from \"" << load_dict_fname << "\"" << std::endl;
+    progress.phase("loading the dictionary");
+    load_unitig_dict(kmer_dict, utg_names, load_dict_fname);
+    ksize = kmer_dict.k();
+    std::cerr << "[info] k-mer length: " << ksize << std::endl;
+    std::cerr << "[info] minimizer length: " << kmer_dict.m() << std::endl;
+  }
 
-    // std::cout.rdbuf(coutbuf);
+  if(!dict_fname.empty()) {
+    std::cerr << "[info] saving k-mer dictionary to \"" << dict_fname << "\"" << std::endl;
+    progress.phase("saving the dictionary");
+    save_unitig_dict(kmer_dict, utg_names, dict_fname);
   }
 
   std::cerr << "[info] unitigs processed: " << kmer_dict.num_contigs() << std::endl;
   std::cerr << "[info] k-mers processed: " << kmer_dict.size() << std::endl;
 
+  if(nb_shards > 0) {
+    return unitig_shard(kmer_dict, mat_file, shard, nb_shards, nb_threads, out_fname);
+  }
+
   // process matrix file
 
-  FILE *mat = fopen(mat_file.c_str(),"r");
+  FILE *mat = open_kmer_matrix(mat_file.c_str());
   if(mat == NULL) {
     std::cerr << "[error] cannot open matrix file \"" << mat_file <<"\"\n";
     return 1;
   }
 
+  progress.phase("reading the k-mer matrix");
+  progress.watch_input(mat);
+
   char *kmer = (char *)calloc(ksize+1,1);
   char *line = NULL;
   size_t line_size = 0;
@@ -142,28 +476,84 @@ int main_unitig(int argc, char **argv) {
   fprintf(stderr,"[info] samples: %lu\n", n_samples);
 
   using sample_t = std::pair<uint32_t,uint32_t>;
-  std::vector<std::vector<sample_t>> utg_samples(kmer_dict.num_contigs());
-  for(auto& counts: utg_samples) {
-    counts.resize(n_samples);
+  std::vector<std::vector<sample_t>> utg_samples;
+  if(!presence_only) {
+    utg_samples.resize(kmer_dict.num_contigs());
+    for(auto& counts: utg_samples) {
+      counts.resize(n_samples);
+    }
+  }
+
+  // with -P, one row of presence bits per k-mer identifier: the k-mers of a unitig have
+  // consecutive identifiers, hence their rows can be counted column-wise at once
+  std::size_t n_words = bit_row_words(n_samples);
+  std::vector<uint64_t> kmer_bits(presence_only ? kmer_dict.size() * n_words : 0);
+
+  // with -S, number of k-mers of each unitig found in the (sampled) matrix
+  std::vector<uint32_t> utg_sampled(sketch ? kmer_dict.num_contigs() : 0);
+
+  // with -Q, the abundances of a fixed sample of the k-mers of each unitig
+  std::unique_ptr<unitig_quantiles> quantiles;
+  if(nb_quantile_kmers > 0) {
+    // no more slots than the k-mers of the longest unitig
+    std::size_t max_utg_kmers = 0;
+    for(uint64_t i = 0; i < kmer_dict.num_contigs(); ++i) { max_utg_kmers = std::max<std::size_t>(max_utg_kmers, kmer_dict.contig_size(i)); }
+    nb_quantile_kmers = std::min(nb_quantile_kmers, max_utg_kmers);
+    quantiles = std::make_unique<unitig_quantiles>(kmer_dict.num_contigs(), n_samples, nb_quantile_kmers,
+                                                   [&kmer_dict](uint64_t i) { return kmer_dict.contig_size(i); });
+    std::cerr << "[info] abundance quantiles: up to " << nb_quantile_kmers << " k-mers per unitig, "
+              << std::fixed << std::setprecision(1) << quantiles->bytes() / 1e6 << " MB" << std::defaultfloat << std::endl;
+  }
+
+  // with -C, the rows of the matrix are also added to the k-mer abundance store
+  std::unique_ptr<kmer_count_store_writer> store;
+  if(!store_fname.empty()) {
+    store = std::make_unique<kmer_count_store_writer>(store_fname, kmer_dict.size(), n_samples);
+    if(!store->good()) {
+      std::cerr << "[error] cannot create temporary files for the k-mer abundance store \"" << store_fname << "\"" << std::endl;
+      return 1;
+    }
   }
 
   while(has_kmer) {
     line_count++;
+    progress.add(PROGRESS_ROWS);
 
     auto res = kmer_dict.lookup_advanced(kmer);
+    progress.add(res.kmer_id == sshash::constants::invalid_uint64 ? PROGRESS_MISSES : PROGRESS_HITS);
     if (res.kmer_id == sshash::constants::invalid_uint64) {
         has_kmer = next_kmer_and_line(kmer, ksize, &line, &line_size, mat);
         continue;
     }
 
+    if(sketch) { utg_sampled[res.contig_id]++; }
+
+    if(store && !store->add(res.kmer_id, second_column(line))) {
+      std::cerr << "[error] line " << line_count << " of the matrix does not have " << n_samples << " samples" << std::endl;
+      return 1;
+    }
+
+    if(presence_only) {
+      uint64_t *row = kmer_bits.data() + res.kmer_id * n_words;
+      std::fill(row, row + n_words, 0);
+      if(parse_bit_row(second_column(line), row) != n_samples) {
+        std::cerr << "[error] line " << line_count << " of the matrix does not have " << n_samples << " samples" << std::endl;
+        return 1;
+      }
+      has_kmer = next_kmer_and_line(kmer, ksize, &line, &line_size, mat);
+      continue;
+    }
+
     std::size_t utg_id = res.contig_id;
     auto& counts = utg_samples[utg_id];
+    long slot = quantiles ? quantiles->slot(res.kmer_id_in_contig, res.contig_size) : -1;
     char *start = second_column(line);
     int c = 0; char *tok = strtok(start," \t\n");
     while(tok) {
       uint32_t num = strtoul(tok,NULL,10);
       counts[c].first = add_sat(counts[c].first, uint32_t{num > 0});
       counts[c].second = add_sat(counts[c].second, num);
+      if(slot >= 0 && (std::size_t)c < n_samples) { quantiles->slots(utg_id, c)[slot] = num; }
       tok = strtok(NULL," \t\n");
       c++;
     }
@@ -175,6 +565,20 @@ int main_unitig(int argc, char **argv) {
   free(line);
   fclose(mat);
 
+  if(store) {
+    std::cerr << "[info] writing k-mer abundance store to \"" << store_fname << "\"" << std::endl;
+    progress.phase("writing the k-mer abundance store");
+    progress.watch_output(store_fname);
+    if(!store->finish()) {
+      std::cerr << "[error] cannot write k-mer abundance store \"" << store_fname << "\"" << std::endl;
+      return 1;
+    }
+    store.reset();
+  }
+
+  // with -u or -U, the full matrix is only written to the -o file
+  bool with_profiles = !profiles_prefix.empty() || !profiles_fname.empty();
+  bool write_matrix = !with_profiles || !out_fname.empty();
   std::ostream* fpout = &std::cout;
   std::ofstream ofs;
   if(!out_fname.empty()) {
@@ -186,33 +590,149 @@ int main_unitig(int argc, char **argv) {
     fpout = &ofs;
   }
 
-  *fpout << std::fixed << std::setprecision(2);
-
   // write output
-  std::cerr << "[info] writing unitig matrix"  << std::endl;
-
-  klibpp::KSeq unitig;
-  klibpp::SeqStreamIn utg_ssi(utg_file.c_str());
-
-  for(uint64_t utg_id=0; utg_ssi >> unitig; utg_id++) {  
 
-    *fpout << (out_writeseq ? unitig.seq : unitig.name);
-    
-    auto& counts = utg_samples[utg_id];
-    
-    std::size_t utg_nb_kmers = unitig.seq.length()-ksize+1;
-    for(auto p : counts) {
-        double frac = (1.0 * p.first)/utg_nb_kmers;
-        double avg_coverage = (1.0 * p.second)/utg_nb_kmers;
-        *fpout << ' ' << avg_coverage << ';' << frac;
+  // the values of a row (a unitig or, with -M, a chain of unitigs) are averaged over its k-mers in
+  // the matrix, i.e. all its k-mers or, with -S, the sampled ones (preceded by their number and the
+  // confidence of the estimate); the k-mers of a unitig present in each sample and the sum of their
+  // abundances (the same with -P) are added to hits and sums, of 64*n_words elements
+  auto add_unitig_counts = [&](uint64_t utg_id, uint32_t *hits, uint32_t *sums) {
+    if(presence_only) {
+      auto [begin, end] = unitig_kmer_ids(kmer_dict, utg_id);
+      column_popcount(kmer_bits.data() + begin * n_words, end - begin, n_words, hits);
+      std::copy(hits, hits + n_samples, sums);
+      return;
+    }
+    for(std::size_t s = 0; s < n_samples; ++s) {
+      auto p = utg_samples[utg_id][s];
+      hits[s] = add_sat(hits[s], p.first);
+      sums[s] = add_sat(sums[s], p.second);
+    }
+  };
+
+  // with -b, the presence of each unitig in each sample is also recorded in a sample-major bit matrix
+  sample_bit_matrix utg_bits(bits_fname.empty() ? 0 : n_samples, kmer_dict.num_contigs());
+  auto set_presence = [&](uint64_t utg_id, std::size_t s, uint32_t nb_present, std::size_t utg_nb_kmers) {
+    if(!bits_fname.empty() && nb_present >= min_frac * utg_nb_kmers) { utg_bits.set(s, utg_id); }
+  };
+
+  auto format_unitigs = [&](const uint64_t *utgs, std::size_t n, std::string &buf) {
+    thread_local std::vector<uint32_t> hits, sums;
+    hits.assign(64 * n_words, 0);
+    sums.assign(64 * n_words, 0);
+    std::size_t nb_kmers = 0, nb_sampled = 0;
+    for(std::size_t i = 0; i < n; ++i) {
+      add_unitig_counts(utgs[i], hits.data(), sums.data());
+      nb_kmers += kmer_dict.contig_size(utgs[i]);
+      if(sketch) { nb_sampled += utg_sampled[utgs[i]]; }
     }
+    std::size_t utg_nb_kmers = nb_kmers;
+    if(sketch) {
+      append_sketch_columns(buf, nb_sampled, nb_kmers);
+      utg_nb_kmers = std::max<std::size_t>(1, nb_sampled);
+    }
+    for(std::size_t s = 0; s < n_samples; ++s) {
+      append_avg_frac(buf, hits[s], sums[s], utg_nb_kmers);
+      if(quantiles) { quantiles->append(buf, utgs[0], s); }
+      for(std::size_t i = 0; i < n; ++i) { set_presence(utgs[i], s, hits[s], utg_nb_kmers); }
+    }
+  };
+
+  // with -M, adjacent unitigs are merged if their k-mer fractions differ by at most merge_tol in every
+  // sample, and their average abundances by at most merge_tol times the largest one
+  unitig_chains chains;
+  bool merge = merge_tol >= 0;
+  if(merge) {
+    auto similar = [&](uint64_t u, uint64_t v) {
+      thread_local std::vector<uint32_t> hits[2], sums[2];
+      double nb_kmers[2];
+      uint64_t utgs[2] = { u, v };
+      for(int i = 0; i < 2; ++i) {
+        hits[i].assign(64 * n_words, 0);
+        sums[i].assign(64 * n_words, 0);
+        add_unitig_counts(utgs[i], hits[i].data(), sums[i].data());
+        nb_kmers[i] = sketch ? std::max<uint32_t>(1, utg_sampled[utgs[i]]) : kmer_dict.contig_size(utgs[i]);
+      }
+      for(std::size_t s = 0; s < n_samples; ++s) {
+        double frac[2] = { hits[0][s] / nb_kmers[0], hits[1][s] / nb_kmers[1] };
+        double avg[2] = { sums[0][s] / nb_kmers[0], sums[1][s] / nb_kmers[1] };
+        if(std::abs(frac[0] - frac[1]) > merge_tol || std::abs(avg[0] - avg[1]) > merge_tol * std::max(avg[0], avg[1])) { return false; }
+      }
+      return true;
+    };
+    std::cerr << "[info] merging chains of adjacent unitigs" << std::endl;
+    progress.phase("merging chains of unitigs");
+    build_unitig_chains(kmer_dict, nb_threads, similar, chains);
+    std::cerr << "[info] unitig chains: " << chains.size() << std::endl;
+  }
 
-    *fpout << '\n';
+  auto append_name = [&](uint64_t row, std::string &buf) {
+    if(merge && out_writeseq) {
+      chains.append_seq(kmer_dict, row, buf);
+    } else if(merge) {
+      chains.append_names(utg_names, row, buf);
+    } else if(out_writeseq) {
+      append_unitig_seq(kmer_dict, row, buf);
+    } else {
+      buf.append(utg_names[row]);
+    }
+  };
+  auto format_columns = [&](uint64_t row, std::string &buf) {
+    if(merge) {
+      format_unitigs(chains.begin(row), chains.length(row), buf);
+    } else {
+      format_unitigs(&row, 1, buf);
+    }
+  };
+
+  // the rows are written and/or grouped by profile (-u/-U)
+  uint64_t n_rows = merge ? chains.size() : kmer_dict.num_contigs();
+  unitig_profiles utg_profiles;
+  if(write_matrix) {
+    std::cerr << "[info] writing unitig matrix"  << std::endl;
+    progress.phase("writing the unitig matrix", n_rows);
+    progress.watch_output(out_fname);
+    write_matrix_rows(*fpout, n_rows, nb_threads, append_name, format_columns);
+  }
+  if(with_profiles) {
+    progress.phase("grouping the rows by profile");
+    build_unitig_profiles(n_rows, nb_threads, format_columns, utg_profiles);
   }
 
   if(!out_fname.empty()) {
     ofs.close();
   }
 
+  if(with_profiles) {
+    std::cerr << "[info] distinct unitig profiles: " << utg_profiles.profiles.size() << " ("
+              << std::fixed << std::setprecision(1) << 100.0 * utg_profiles.profiles.size() / std::max<uint64_t>(1, n_rows)
+              << "% of the rows)" << std::defaultfloat << std::endl;
+  }
+  if(!profiles_prefix.empty()) {
+    std::cerr << "[info] writing unitig profiles to \"" << profiles_prefix << ".profiles\" and \"" << profiles_prefix << ".map\"" << std::endl;
+    std::ofstream profiles_out(profiles_prefix + ".profiles"), map_out(profiles_prefix + ".map");
+    if(!profiles_out.good() || !map_out.good()) {
+      std::cerr << "[error] cannot open output files \"" << profiles_prefix << ".profiles\" and \"" << profiles_prefix << ".map\"" << std::endl;
+      return 1;
+    }
+    utg_profiles.write_profiles(profiles_out);
+    utg_profiles.write_map(map_out, append_name);
+  }
+  if(!profiles_fname.empty()) {
+    std::cerr << "[info] writing unitig profiles to \"" << profiles_fname << "\"" << std::endl;
+    if(!utg_profiles.save(profiles_fname)) {
+      std::cerr << "[error] cannot write unitig profiles \"" << profiles_fname << "\"" << std::endl;
+      return 1;
+    }
+  }
+
+  if(!bits_fname.empty()) {
+    std::cerr << "[info] writing bit-packed presence/absence matrix to \"" << bits_fname << "\"" << std::endl;
+    if(!utg_bits.save(bits_fname)) {
+      std::cerr << "[error] cannot write bit-packed presence/absence matrix \"" << bits_fname << "\"" << std::endl;
+      return 1;
+    }
+  }
+
   return 0;
 }
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "../external/sshash/dictionary.hpp"
+
+#include "common.h"
+#include "unitig_dict.h"
+#include "unitig_partial.h"
+
+
+int main_unitig_reduce(int argc, char **argv) {
+
+  std::size_t nb_threads = 1;
+  std::string out_fname;
+  bool out_writeseq = false;
+  bool help_opt = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "o:t:sh")) != -1) {
+    switch (c) {
+      case 'o':
+        out_fname = optarg;
+        break;
+      case 't':
+        nb_threads = std::max((long)1, std::strtol(optarg, NULL, 10));
+        break;
+      case 's':
+        out_writeseq = true;
+        break;
+      case 'h':
+        help_opt = true;
+        break;
+      case '?':
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if(argc-optind < 2 || help_opt) {
+    std::cout << "Usage: kmat_tools unitig-reduce [options] <unitigs.dict> <partial_1.bin> [<partial_2.bin> ...]\n\n";
+    std::cout << "Merges the partial unitig matrices computed by \"kmat_tools unitig --shard I/N\" for all the shards\n";
+    std::cout << "against the k-mer dictionary <unitigs.dict> (see \"kmat_tools unitig -D\") into a unitig matrix.\n\n";
+    std::cout << "Options:\n";
+    std::cout << "  -o FILE  write unitig matrix to FILE [stdout]\n";
+    std::cout << "  -t INT   number of threads [1]\n";
+    std::cout << "  -s       write the unitig sequence as first column instead of the identifier\n";
+    std::cout << "  -h       print this help message\n";
+    return 0;
+  }
+
+  std::string dict_fname = argv[optind];
+  if(!std::filesystem::exists(dict_fname.c_str())) {
+    std::cerr << "[error] dictionary file \"" << dict_fname << "\" does not exist" << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> partial_files(argv+optind+1, argv+argc);
+
+  std::cerr << "[info] loading k-mer dictionary from \"" << dict_fname << "\"" << std::endl;
+  sshash::dictionary kmer_dict;
+  unitig_names utg_names;
+  load_unitig_dict(kmer_dict, utg_names, dict_fname);
+  std::cerr << "[info] unitigs: " << kmer_dict.num_contigs() << std::endl;
+
+  // merge the partial matrices, checking that they come from the same dictionary and
+  // that each shard is given exactly once
+
+  using sample_t = std::pair<uint32_t,uint32_t>;
+  std::vector<sample_t> utg_samples;
+  std::vector<bool> seen_shards;
+  std::size_t n_samples = 0;
+
+  for(std::size_t i = 0; i < partial_files.size(); ++i) {
+    const std::string &fname = partial_files[i];
+    FILE *fp = fopen(fname.c_str(), "rb");
+    if(fp == NULL) {
+      std::cerr << "[error] cannot open partial matrix \"" << fname << "\"" << std::endl;
+      return 1;
+    }
+
+    unitig_partial_header hdr;
+    if(!read_unitig_partial_header(fp, hdr)) {
+      std::cerr << "[error] \"" << fname << "\" is not a partial unitig matrix" << std::endl;
+      fclose(fp);
+      return 1;
+    }
+    if(hdr.nb_unitigs != kmer_dict.num_contigs() || hdr.nb_kmers != kmer_dict.size()) {
+      std::cerr << "[error] \"" << fname << "\" was not computed with the dictionary \"" << dict_fname << "\"" << std::endl;
+      fclose(fp);
+      return 1;
+    }
+
+    if(i == 0) {
+      n_samples = hdr.nb_samples;
+      seen_shards.assign(hdr.nb_shards, false);
+      utg_samples.resize(kmer_dict.num_contigs() * n_samples);
+      std::cerr << "[info] samples: " << n_samples << std::endl;
+      std::cerr << "[info] shards: " << hdr.nb_shards << std::endl;
+    } else if(hdr.nb_samples != n_samples || hdr.nb_shards != seen_shards.size()) {
+      std::cerr << "[error] \"" << fname << "\" has a different number of samples or shards than \"" << partial_files[0] << "\"" << std::endl;
+      fclose(fp);
+      return 1;
+    }
+
+    if(seen_shards[hdr.shard]) {
+      std::cerr << "[error] shard " << hdr.shard << " is given more than once" << std::endl;
+      fclose(fp);
+      return 1;
+    }
+    seen_shards[hdr.shard] = true;
+
+    bool ok = add_unitig_partial(fp, hdr, utg_samples);
+    fclose(fp);
+    if(!ok) {
+      std::cerr << "[error] partial matrix \"" << fname << "\" is truncated or corrupted" << std::endl;
+      return 1;
+    }
+  }
+
+  auto missing = std::find(seen_shards.begin(), seen_shards.end(), false);
+  if(missing != seen_shards.end()) {
+    std::cerr << "[error] missing partial matrix of shard " << (missing - seen_shards.begin()) << "/" << seen_shards.size() << std::endl;
+    return 1;
+  }
+
+  // write output
+
+  std::ostream* fpout = &std::cout;
+  std::ofstream ofs;
+  if(!out_fname.empty()) {
+    ofs.open(out_fname.c_str());
+    if(!ofs.good()) {
+        std::cerr << "[error] cannot open output file \"" << out_fname << "\"\n";
+        return 1;
+    }
+    fpout = &ofs;
+  }
+
+  std::cerr << "[info] writing unitig matrix"  << std::endl;
+
+  write_unitig_rows(*fpout, kmer_dict, utg_names, out_writeseq, nb_threads, [&](uint64_t utg_id, std::string &buf) {
+    std::size_t utg_nb_kmers = kmer_dict.contig_size(utg_id);
+    for(std::size_t s = 0; s < n_samples; ++s) {
+      auto &p = utg_samples[utg_id*n_samples+s];
+      append_avg_frac(buf, p.first, p.second, utg_nb_kmers);
+    }
+  });
+
+  if(!out_fname.empty()) {
+    ofs.close();
+  }
+
+  return 0;
+}
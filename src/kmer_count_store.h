@@ -0,0 +1,267 @@
+#ifndef KM_KMER_COUNT_STORE_H
+#define KM_KMER_COUNT_STORE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+
+// per-k-mer abundances of a k-mer matrix laid out in the order of the k-mer identifiers of a
+// sshash dictionary of unitigs (see "kmat_tools unitig -C"), where consecutive identifiers are
+// consecutive k-mers of a unitig and their abundances are strongly correlated
+//
+// file layout: a fixed-size header, then the blocks of KMER_COUNT_BLOCK consecutive k-mer
+// identifiers, then the index of the blocks (nb_blocks+1 offsets from the beginning of the file)
+// a block stores, one sample after the other, the abundances of its k-mers encoded as varints:
+// the zigzag-encoded difference with the previous abundance (0 for the first k-mer) when it is
+// not 0, or 0 followed by the number of consecutive k-mers with an unchanged abundance
+
+static const char KMER_COUNT_STORE_MAGIC[8] = { 'K', 'M', 'C', 'N', 'T', 'S', 'T', '1' };
+static const std::size_t KMER_COUNT_BLOCK = 256;
+
+struct kmer_count_store_header {
+  char magic[8];
+  uint64_t nb_kmers;   // size of the dictionary
+  uint64_t nb_samples;
+  uint64_t block_size;
+  uint64_t nb_blocks;
+  uint64_t index_offset;
+};
+
+
+static inline uint64_t zigzag(int64_t v) { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+static inline int64_t unzigzag(uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+// encode/decode the abundances of the k-mers of a block for one sample
+static inline void encode_count_run(std::string &buf, const uint32_t *vals, std::size_t n) {
+  uint32_t prev = 0;
+  for(std::size_t i = 0; i < n; ) {
+    if(vals[i] == prev) {
+      std::size_t r = 1;
+      while(i+r < n && vals[i+r] == prev) { ++r; }
+      put_varint(buf, 0);
+      put_varint(buf, r);
+      i += r;
+    } else {
+      put_varint(buf, zigzag(int64_t(vals[i]) - int64_t(prev)));
+      prev = vals[i++];
+    }
+  }
+}
+
+static inline bool decode_count_run(const uint8_t *&p, const uint8_t *end, uint32_t *vals, std::size_t n) {
+  uint32_t prev = 0;
+  for(std::size_t i = 0; i < n; ) {
+    if(p >= end) { return false; }
+    uint64_t x = get_varint(p, end);
+    if(x == 0) {
+      uint64_t r = get_varint(p, end);
+      if(r == 0 || i + r > n) { return false; }
+      std::fill(vals+i, vals+i+r, prev);
+      i += r;
+    } else {
+      prev = uint32_t(int64_t(prev) + unzigzag(x));
+      vals[i++] = prev;
+    }
+  }
+  return true;
+}
+
+
+// builds a store from matrix rows given in any order: rows are first spilled to temporary
+// files, one per range of k-mer identifiers, each of which is then sorted and encoded
+class kmer_count_store_writer {
+public:
+  static constexpr std::size_t nb_buckets = 256;
+
+  kmer_count_store_writer(const std::string &fname, uint64_t nb_kmers, uint64_t nb_samples)
+    : m_fname(fname), m_tmp_dir(fname + ".tmp"), m_nb_kmers(nb_kmers), m_nb_samples(nb_samples)
+  {
+    uint64_t nb_blocks = (nb_kmers + KMER_COUNT_BLOCK - 1) / KMER_COUNT_BLOCK;
+    m_bucket_blocks = std::max<uint64_t>(1, (nb_blocks + nb_buckets - 1) / nb_buckets);
+    std::filesystem::create_directories(m_tmp_dir);
+    for(std::size_t b = 0; b < nb_buckets; ++b) {
+      FILE *fp = fopen(bucket_path(b).c_str(), "wb");
+      if(fp == NULL) { m_ok = false; break; }
+      m_buckets.push_back(fp);
+    }
+  }
+
+  ~kmer_count_store_writer() {
+    for(FILE *fp : m_buckets) { if(fp) { fclose(fp); } }
+    std::error_code ec;
+    std::filesystem::remove_all(m_tmp_dir, ec);
+  }
+
+  bool good() const { return m_ok; }
+
+  // add the abundances of a k-mer given as the (space-separated) values of a matrix row
+  bool add(uint64_t kmer_id, const char *values) {
+    m_buf.clear();
+    put_varint(m_buf, kmer_id);
+    const char *p = values;
+    uint64_t n = 0;
+    while(true) {
+      char *end;
+      unsigned long v = strtoul(p, &end, 10);
+      if(end == p) { break; }
+      put_varint(m_buf, std::min<unsigned long>(v, UINT32_MAX));
+      p = end;
+      ++n;
+    }
+    if(n != m_nb_samples || kmer_id >= m_nb_kmers) { return false; }
+    FILE *fp = m_buckets[kmer_id / (m_bucket_blocks * KMER_COUNT_BLOCK)];
+    return fwrite(m_buf.data(), 1, m_buf.size(), fp) == m_buf.size();
+  }
+
+  // sort and encode the spilled rows, then write the store
+  bool finish() {
+    for(FILE *&fp : m_buckets) { fclose(fp); fp = NULL; }
+
+    FILE *out = fopen(m_fname.c_str(), "wb");
+    if(out == NULL) { return false; }
+
+    kmer_count_store_header hdr{};
+    memcpy(hdr.magic, KMER_COUNT_STORE_MAGIC, sizeof(hdr.magic));
+    hdr.nb_kmers = m_nb_kmers;
+    hdr.nb_samples = m_nb_samples;
+    hdr.block_size = KMER_COUNT_BLOCK;
+    hdr.nb_blocks = (m_nb_kmers + KMER_COUNT_BLOCK - 1) / KMER_COUNT_BLOCK;
+    fwrite(&hdr, sizeof(hdr), 1, out); // rewritten at the end with the index offset
+
+    std::vector<uint64_t> index;
+    uint64_t offset = sizeof(hdr);
+    std::vector<uint32_t> vals(KMER_COUNT_BLOCK * m_nb_samples);
+    std::string buf;
+
+    for(std::size_t b = 0; b < nb_buckets; ++b) {
+      std::vector<uint8_t> data = read_file(bucket_path(b));
+
+      // (k-mer id, position of its abundances) of the rows of the bucket, sorted by k-mer id
+      std::vector<std::pair<uint64_t,std::size_t>> rows;
+      const uint8_t *p = data.data(), *end = data.data() + data.size();
+      while(p < end) {
+        uint64_t kmer_id = get_varint(p, end);
+        rows.emplace_back(kmer_id, p - data.data());
+        for(uint64_t s = 0; s < m_nb_samples; ++s) { get_varint(p, end); }
+      }
+      std::stable_sort(rows.begin(), rows.end(), [](auto &a, auto &b){ return a.first < b.first; });
+
+      uint64_t first_block = b * m_bucket_blocks;
+      uint64_t last_block = std::min<uint64_t>(hdr.nb_blocks, first_block + m_bucket_blocks);
+      auto row = rows.begin();
+      for(uint64_t block = first_block; block < last_block; ++block) {
+        uint64_t first_kmer = block * KMER_COUNT_BLOCK;
+        std::size_t n = std::min<uint64_t>(KMER_COUNT_BLOCK, m_nb_kmers - first_kmer);
+        std::fill(vals.begin(), vals.end(), 0);
+        for(; row != rows.end() && row->first < first_kmer + n; ++row) {
+          const uint8_t *q = data.data() + row->second;
+          for(uint64_t s = 0; s < m_nb_samples; ++s) {
+            vals[s * KMER_COUNT_BLOCK + (row->first - first_kmer)] = get_varint(q, end);
+          }
+        }
+        buf.clear();
+        for(uint64_t s = 0; s < m_nb_samples; ++s) { encode_count_run(buf, vals.data() + s * KMER_COUNT_BLOCK, n); }
+        index.push_back(offset);
+        fwrite(buf.data(), 1, buf.size(), out);
+        offset += buf.size();
+      }
+      std::filesystem::remove(bucket_path(b));
+    }
+    index.push_back(offset);
+
+    hdr.index_offset = offset;
+    fwrite(index.data(), sizeof(uint64_t), index.size(), out);
+    rewind(out);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    bool ok = !ferror(out);
+    return (fclose(out) == 0) && ok;
+  }
+
+private:
+  std::string bucket_path(std::size_t b) const { return (m_tmp_dir / ("bucket_" + std::to_string(b))).string(); }
+
+  static std::vector<uint8_t> read_file(const std::string &path) {
+    std::vector<uint8_t> data;
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(fp == NULL) { return data; }
+    uint8_t chunk[1 << 16];
+    std::size_t n;
+    while((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) { data.insert(data.end(), chunk, chunk+n); }
+    fclose(fp);
+    return data;
+  }
+
+  std::string m_fname;
+  std::filesystem::path m_tmp_dir;
+  uint64_t m_nb_kmers;
+  uint64_t m_nb_samples;
+  uint64_t m_bucket_blocks;
+  std::vector<FILE*> m_buckets;
+  std::string m_buf;
+  bool m_ok{true};
+};
+
+
+// random access to the abundances of a k-mer given its identifier: the block of the k-mer is
+// read and decoded (the last decoded block is kept, so that the k-mers of a unitig are cheap)
+class kmer_count_store_reader {
+public:
+  bool open(const std::string &fname) {
+    m_fp = fopen(fname.c_str(), "rb");
+    if(m_fp == NULL) { return false; }
+    if(fread(&m_hdr, sizeof(m_hdr), 1, m_fp) != 1 || memcmp(m_hdr.magic, KMER_COUNT_STORE_MAGIC, sizeof(m_hdr.magic)) != 0) { return false; }
+    m_index.resize(m_hdr.nb_blocks + 1);
+    if(fseeko(m_fp, m_hdr.index_offset, SEEK_SET) != 0) { return false; }
+    if(fread(m_index.data(), sizeof(uint64_t), m_index.size(), m_fp) != m_index.size()) { return false; }
+    m_vals.resize(m_hdr.block_size * m_hdr.nb_samples);
+    return true;
+  }
+
+  ~kmer_count_store_reader() { if(m_fp) { fclose(m_fp); } }
+
+  uint64_t nb_kmers() const { return m_hdr.nb_kmers; }
+  uint64_t nb_samples() const { return m_hdr.nb_samples; }
+
+  // abundances of a k-mer in all samples (nb_samples() values), NULL on error
+  const uint32_t* counts(uint64_t kmer_id, uint32_t *out) {
+    if(kmer_id >= m_hdr.nb_kmers) { return NULL; }
+    uint64_t block = kmer_id / m_hdr.block_size;
+    if(block != m_block && !load_block(block)) { return NULL; }
+    uint64_t pos = kmer_id % m_hdr.block_size;
+    for(uint64_t s = 0; s < m_hdr.nb_samples; ++s) { out[s] = m_vals[s * m_hdr.block_size + pos]; }
+    return out;
+  }
+
+private:
+  bool load_block(uint64_t block) {
+    m_block = UINT64_MAX;
+    m_data.resize(m_index[block+1] - m_index[block]);
+    if(fseeko(m_fp, m_index[block], SEEK_SET) != 0) { return false; }
+    if(fread(m_data.data(), 1, m_data.size(), m_fp) != m_data.size()) { return false; }
+    std::size_t n = std::min<uint64_t>(m_hdr.block_size, m_hdr.nb_kmers - block * m_hdr.block_size);
+    const uint8_t *p = m_data.data(), *end = p + m_data.size();
+    for(uint64_t s = 0; s < m_hdr.nb_samples; ++s) {
+      if(!decode_count_run(p, end, m_vals.data() + s * m_hdr.block_size, n)) { return false; }
+    }
+    m_block = block;
+    return true;
+  }
+
+  FILE *m_fp{NULL};
+  kmer_count_store_header m_hdr{};
+  std::vector<uint64_t> m_index;
+  std::vector<uint8_t> m_data;
+  std::vector<uint32_t> m_vals;
+  uint64_t m_block{UINT64_MAX};
+};
+
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef KM_KMER_GRAPH_H
+#define KM_KMER_GRAPH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// k-mers (k <= 63) packed with 2 bits per nucleotide (A,C,G,T = 0,1,2,3), the first nucleotide
+// in the most significant bits; kmer_t is uint64_t for k < 32 and __uint128_t otherwise, so that
+// the all-ones value is never a valid k-mer and can mark empty slots
+
+static inline int nuc_code(char c) {
+  switch (c) {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+    default: return -1;
+  }
+}
+
+static const char code_nuc[4] = { 'A', 'C', 'G', 'T' };
+
+
+// a k-mer along with its reverse complement, to walk the bidirected de Bruijn graph
+template <typename kmer_t>
+struct oriented_kmer {
+  kmer_t fwd;
+  kmer_t rev;
+  kmer_t canonical() const { return fwd < rev ? fwd : rev; }
+};
+
+
+// set of canonical k-mers split in buckets (by hash) stored as open addressing tables in a
+// single array, plus one "claimed" bit per slot that threads can set concurrently when
+// walking the graph so that each k-mer is output exactly once
+template <typename kmer_t>
+class kmer_set {
+public:
+  static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+  static constexpr kmer_t empty = ~kmer_t{0};
+
+  kmer_set(std::size_t k, std::size_t nb_buckets)
+    : m_k(k), m_mask((kmer_t{1} << (2*k)) - 1), m_buckets(nb_buckets), m_staged(nb_buckets) {}
+
+  std::size_t k() const { return m_k; }
+  std::size_t size() const { return m_size; }
+  std::size_t nb_buckets() const { return m_buckets.size(); }
+
+  // encode the first k characters of s, returns false if it contains a non-ACGT character
+  bool encode(const char *s, oriented_kmer<kmer_t> &kmer) const {
+    kmer.fwd = kmer.rev = 0;
+    for (std::size_t i = 0; i < m_k; ++i) {
+      int c = nuc_code(s[i]);
+      if (c < 0) { return false; }
+      kmer.fwd = (kmer.fwd << 2) | kmer_t(c);
+      kmer.rev |= kmer_t(3-c) << (2*i);
+    }
+    return true;
+  }
+
+  void decode(kmer_t kmer, std::string &out) const {
+    for (std::size_t i = m_k; i-- > 0;) { out.push_back(code_nuc[(kmer >> (2*i)) & 3]); }
+  }
+
+  oriented_kmer<kmer_t> orient(kmer_t canonical) const {
+    oriented_kmer<kmer_t> kmer{ canonical, 0 };
+    for (std::size_t i = 0; i < m_k; ++i) { kmer.rev = (kmer.rev << 2) | (3 - ((canonical >> (2*i)) & 3)); }
+    return kmer;
+  }
+
+  // the k-mer obtained appending (resp. prepending) nucleotide c
+  oriented_kmer<kmer_t> next(const oriented_kmer<kmer_t> &kmer, int c) const {
+    return { ((kmer.fwd << 2) | kmer_t(c)) & m_mask, (kmer.rev >> 2) | (kmer_t(3-c) << (2*m_k-2)) };
+  }
+
+  oriented_kmer<kmer_t> prev(const oriented_kmer<kmer_t> &kmer, int c) const {
+    return { (kmer.fwd >> 2) | (kmer_t(c) << (2*m_k-2)), ((kmer.rev << 2) | kmer_t(3-c)) & m_mask };
+  }
+
+  // stage a k-mer for insertion, build() must be called once all k-mers are staged
+  void add(const oriented_kmer<kmer_t> &kmer) {
+    kmer_t canonical = kmer.canonical();
+    m_staged[hash(canonical) % m_buckets.size()].push_back(canonical);
+  }
+
+  // build the bucket tables in parallel (duplicate k-mers are inserted once)
+  void build(std::size_t nb_threads) {
+    std::size_t offset = 0;
+    for (std::size_t b = 0; b < m_buckets.size(); ++b) {
+      std::size_t capacity = 16;
+      while (capacity < 2 * m_staged[b].size()) { capacity *= 2; }
+      m_buckets[b] = { offset, capacity - 1 };
+      offset += capacity;
+    }
+    m_slots.assign(offset, empty);
+    m_claimed.reset(new std::atomic<uint64_t>[(offset + 63) / 64]);
+    for (std::size_t i = 0; i < (offset + 63) / 64; ++i) { m_claimed[i].store(0, std::memory_order_relaxed); }
+
+    std::atomic<std::size_t> nb_distinct{0};
+    for_each_bucket(nb_threads, [&](std::size_t b) {
+      std::size_t n = 0;
+      for (kmer_t kmer : m_staged[b]) {
+        std::size_t slot = probe(b, kmer);
+        if (m_slots[slot] == empty) { m_slots[slot] = kmer; n++; }
+      }
+      std::vector<kmer_t>().swap(m_staged[b]);
+      nb_distinct += n;
+    });
+    m_size = nb_distinct;
+  }
+
+  // position of a k-mer in the set, or npos
+  std::size_t find(const oriented_kmer<kmer_t> &kmer) const {
+    kmer_t canonical = kmer.canonical();
+    std::size_t slot = probe(hash(canonical) % m_buckets.size(), canonical);
+    return m_slots[slot] == empty ? npos : slot;
+  }
+
+  kmer_t at(std::size_t pos) const { return m_slots[pos]; }
+
+  // atomically mark a k-mer as claimed, returns true for the caller which claimed it first
+  bool claim(std::size_t pos) {
+    uint64_t bit = uint64_t{1} << (pos % 64);
+    return !(m_claimed[pos/64].fetch_or(bit, std::memory_order_relaxed) & bit);
+  }
+
+  bool is_claimed(std::size_t pos) const {
+    return m_claimed[pos/64].load(std::memory_order_relaxed) & (uint64_t{1} << (pos % 64));
+  }
+
+  // number of successors (resp. predecessors) of a k-mer in the set, the last one found is stored in c
+  int out_degree(const oriented_kmer<kmer_t> &kmer, int &c) const {
+    int deg = 0;
+    for (int x = 0; x < 4; ++x) {
+      if (find(next(kmer, x)) != npos) { deg++; c = x; }
+    }
+    return deg;
+  }
+
+  int in_degree(const oriented_kmer<kmer_t> &kmer, int &c) const {
+    int deg = 0;
+    for (int x = 0; x < 4; ++x) {
+      if (find(prev(kmer, x)) != npos) { deg++; c = x; }
+    }
+    return deg;
+  }
+
+  // call f(pos) for the position of every k-mer of bucket b
+  template <typename Visitor>
+  void visit_bucket(std::size_t b, Visitor f) const {
+    for (std::size_t pos = m_buckets[b].offset; pos <= m_buckets[b].offset + m_buckets[b].mask; ++pos) {
+      if (m_slots[pos] != empty) { f(pos); }
+    }
+  }
+
+  // run f(b) on all buckets, distributed among threads
+  template <typename Function>
+  void for_each_bucket(std::size_t nb_threads, Function f) const {
+    std::atomic<std::size_t> next_bucket{0};
+    auto worker = [&]() {
+      for (std::size_t b = next_bucket++; b < m_buckets.size(); b = next_bucket++) { f(b); }
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t t = 0; t < nb_threads; ++t) { workers.emplace_back(worker); }
+    for (auto &t : workers) { t.join(); }
+  }
+
+private:
+  struct bucket {
+    std::size_t offset;
+    std::size_t mask;
+  };
+
+  static uint64_t hash(kmer_t kmer) {
+    uint64_t x = uint64_t(kmer) ^ uint64_t(kmer >> 32 >> 32) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 31; x *= 0x7FB5D329728EA185ULL;
+    x ^= x >> 27; x *= 0x81DADEF4BC2DD44DULL;
+    return x ^ (x >> 33);
+  }
+
+  // slot of a k-mer in its bucket, or of the empty slot where it would be inserted
+  std::size_t probe(std::size_t b, kmer_t kmer) const {
+    const bucket &bk = m_buckets[b];
+    std::size_t i = (hash(kmer) / m_buckets.size()) & bk.mask;
+    while (m_slots[bk.offset + i] != empty && m_slots[bk.offset + i] != kmer) { i = (i + 1) & bk.mask; }
+    return bk.offset + i;
+  }
+
+  std::size_t m_k;
+  kmer_t m_mask;
+  std::size_t m_size{0};
+  std::vector<bucket> m_buckets;
+  std::vector<std::vector<kmer_t>> m_staged;
+  std::vector<kmer_t> m_slots;
+  std::unique_ptr<std::atomic<uint64_t>[]> m_claimed;
+};
+
+
+// k-mer size of a text matrix from its first non-empty line, which is left in *line_ptr
+static std::size_t matrix_kmer_size(FILE *fp, char **line_ptr, size_t *line_size) {
+  ssize_t ch_read;
+  while ((ch_read = getline(line_ptr, line_size, fp)) >= 0 && (*line_ptr)[0] == '\n') {}
+  return ch_read > 0 ? strcspn(*line_ptr, " \t\n") : 0;
+}
+
+
+// stage the k-mers of a text matrix (*line_ptr holding its first line) for insertion in a set
+// returns the number of valid k-mers read
+template <typename kmer_t>
+static std::size_t read_matrix_kmers(FILE *fp, kmer_set<kmer_t> &set, char **line_ptr, size_t *line_size) {
+  oriented_kmer<kmer_t> kmer;
+  char *line = *line_ptr;
+  std::size_t line_num = 0, kmer_count = 0;
+  for (ssize_t ch_read = strlen(line); ch_read >= 0; ch_read = getline(line_ptr, line_size, fp), line = *line_ptr) {
+    ++line_num;
+    if (line[0] == '\n' || line[0] == '\0') { continue; }
+    std::size_t len = strcspn(line, " \t\n");
+    if (len != set.k() || !set.encode(line, kmer)) {
+      line[len] = '\0';
+      fprintf(stderr, "[warning] skipping invalid k-mer at line %zu: \"%s\"\n", line_num, line);
+      continue;
+    }
+    set.add(kmer);
+    kmer_count++;
+  }
+  return kmer_count;
+}
+
+
+// greedily chain the k-mers of a set into simplitigs (spectrum-preserving strings): every
+// k-mer of the set occurs exactly once, in either orientation, in the output strings
+// out(str) is called concurrently by the worker threads for each simplitig
+template <typename kmer_t, typename Output>
+static void compute_simplitigs(kmer_set<kmer_t> &set, std::size_t nb_threads, Output out) {
+  set.for_each_bucket(nb_threads, [&](std::size_t b) {
+    std::string seq, left;
+    set.visit_bucket(b, [&](std::size_t pos) {
+      if (!set.claim(pos)) { return; }
+      oriented_kmer<kmer_t> start = set.orient(set.at(pos));
+      seq.clear();
+      left.clear();
+      set.decode(start.fwd, seq);
+      for (auto kmer = start; ;) { // extend right
+        int c = 0;
+        for (; c < 4; ++c) {
+          std::size_t p = set.find(set.next(kmer, c));
+          if (p != set.npos && set.claim(p)) { break; }
+        }
+        if (c == 4) { break; }
+        kmer = set.next(kmer, c);
+        seq.push_back(code_nuc[c]);
+      }
+      for (auto kmer = start; ;) { // extend left
+        int c = 0;
+        for (; c < 4; ++c) {
+          std::size_t p = set.find(set.prev(kmer, c));
+          if (p != set.npos && set.claim(p)) { break; }
+        }
+        if (c == 4) { break; }
+        kmer = set.prev(kmer, c);
+        left.push_back(code_nuc[c]);
+      }
+      if (!left.empty()) {
+        std::reverse(left.begin(), left.end());
+        seq.insert(0, left);
+      }
+      out(seq);
+    });
+  });
+}
+
+
+// build the maximal unitigs of the (bidirected) de Bruijn graph of a set of k-mers
+// a unitig is walked from both of its ends (by different threads, without locking) and only the
+// walk starting from the smallest end is output; k-mers of output unitigs are then claimed, so
+// that the remaining ones, forming cycles with no end, are output by a last sequential pass
+// out(str, b) is called concurrently by the threads, for unitigs starting in different buckets b
+// (b is nb_buckets() for cycles)
+template <typename kmer_t, typename Output>
+static void compute_unitigs(kmer_set<kmer_t> &set, std::size_t nb_threads, Output out) {
+  using okmer = oriented_kmer<kmer_t>;
+
+  // the k-mer following x in its unitig, if any
+  // (with an even k, a palindromic k-mer is its own reverse complement: a walk through it would
+  // come back on the k-mers it just went through, so it forms a unitig by itself)
+  auto extend = [&set](const okmer &x, okmer &y) {
+    int c, d;
+    if (x.fwd == x.rev || set.out_degree(x, c) != 1) { return false; }
+    y = set.next(x, c);
+    return y.fwd != y.rev && set.in_degree(y, d) == 1 && y.canonical() != x.canonical();
+  };
+
+  auto walk = [&](okmer start, std::string &seq, bool claim) {
+    seq.clear();
+    set.decode(start.fwd, seq);
+    okmer x = start, y;
+    while (extend(x, y) && y.canonical() != start.canonical()) {
+      if (claim && !set.claim(set.find(y))) { break; }
+      seq.push_back(code_nuc[y.fwd & 3]);
+      x = y;
+    }
+    return x;
+  };
+
+  set.for_each_bucket(nb_threads, [&](std::size_t b) {
+    std::string seq;
+    set.visit_bucket(b, [&](std::size_t pos) {
+      okmer kmer = set.orient(set.at(pos));
+      okmer rc = { kmer.rev, kmer.fwd };
+      for (okmer start : { kmer, rc }) {
+        okmer p, back = { start.rev, start.fwd };
+        if (extend(back, p)) { continue; } // not the left end of a unitig
+        okmer end = walk(start, seq, false);
+        // a walk which stopped coming back to its start (hairpin) cannot be started from its other end,
+        // a unitig equal to its reverse complement is output by the walk claiming its start first
+        bool closed = extend(end, p);
+        if (!closed && (start.fwd > end.rev || (start.fwd == end.rev && !set.claim(pos)))) { continue; }
+        for (okmer x = start, y; ; x = y) { // claim the k-mers of the unitig
+          set.claim(set.find(x));
+          if (x.fwd == end.fwd || !extend(x, y)) { break; }
+        }
+        out(seq, b);
+      }
+    });
+  });
+
+  // cycles
+  std::string seq;
+  for (std::size_t b = 0; b < set.nb_buckets(); ++b) {
+    set.visit_bucket(b, [&](std::size_t pos) {
+      if (!set.claim(pos)) { return; }
+      walk(set.orient(set.at(pos)), seq, true);
+      out(seq, set.nb_buckets());
+    });
+  }
+}
+
+
+#endif
@@ -17,4 +17,15 @@
 #include <kmtricks/task_pool.hpp>
 
 // require lz4
-#include <kmtricks/io/matrix_file.hpp>
\ No newline at end of file
+#include <kmtricks/io/matrix_file.hpp>
+#include <kmtricks/io/pa_matrix_file.hpp>
+
+// a kmtricks presence/absence matrix file stores one bit per sample
+static inline bool is_pa_matrix(const std::string &path) {
+  try {
+    km::PAMatrixReader<8192> reader(path);
+    return true;
+  } catch (const km::km_exception &e) {
+    return false;
+  }
+}
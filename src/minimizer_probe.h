@@ -0,0 +1,229 @@
+#ifndef KM_MINIMIZER_PROBE_H
+#define KM_MINIMIZER_PROBE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../external/kseq++/seqio.hpp"
+#include "../external/sshash/dictionary.hpp"
+
+#include "common.h"
+
+
+// choice of the minimizer length of a sshash dictionary of unitigs ("kmat_tools unitig -m auto")
+//
+// the super-k-mers of a sample of the unitigs are computed for several minimizer lengths, exactly
+// as the sshash builder does (random minimizers, canonical parsing), and the sizes of the buckets
+// of the whole dictionary are extrapolated from the sample: a super-k-mer whose minimizer is shared
+// by c super-k-mers of a sample holding a fraction f of the k-mers is in a bucket of 1+(c-1)/f
+// super-k-mers. The cost of a lookup is then predicted from the number of random memory accesses
+// it makes (minimizer MPHF, bucket boundaries, then either a scan of the super-k-mers of the bucket
+// or, for buckets larger than 2^min_l, two queries of the skew index), plus the time to compute
+// the minimizers of a k-mer, which is measured.
+
+struct minimizer_probe {
+  std::size_t m;
+  double nb_super_kmers;  // estimated for the whole dictionary
+  double nb_buckets;      // i.e. distinct minimizers
+  double avg_bucket;      // average number of super-k-mers in the bucket of a k-mer
+  double skew_frac;       // fraction of the k-mers in buckets handled by the skew index
+  double bits_per_kmer;   // estimated space of the dictionary
+  double lookup_ns;       // predicted time of the lookup of a k-mer of the dictionary
+};
+
+struct unitig_sample {
+  std::vector<std::string> seqs;
+  uint64_t nb_kmers{0};   // in all the unitigs (of length >= max(k, min_length))
+  uint64_t nb_bases{0};
+  double frac{1.0};       // fraction of the k-mers in the sample
+};
+
+
+// sample unitigs (deterministically) until about max_kmers k-mers, reading the file twice
+// and skipping the unitigs shorter than min_length (or k), as build_unitig_dict
+static unitig_sample sample_unitigs(const std::string &utg_file, std::size_t ksize, uint64_t max_kmers, std::size_t min_length = 0) {
+  min_length = std::max(ksize, min_length);
+  unitig_sample sample;
+  klibpp::KSeq record;
+  {
+    klibpp::SeqStreamIn ssi(utg_file.c_str());
+    while(ssi >> record) {
+      if(record.seq.length() < min_length) { continue; }
+      sample.nb_kmers += record.seq.length() - ksize + 1;
+      sample.nb_bases += record.seq.length();
+    }
+  }
+  if(sample.nb_kmers == 0) { return sample; }
+
+  double p = std::min(1.0, (double)max_kmers / sample.nb_kmers);
+  uint64_t nb_sampled = 0, i = 0;
+  klibpp::SeqStreamIn ssi(utg_file.c_str());
+  while(ssi >> record) {
+    if(record.seq.length() < min_length) { continue; }
+    if(p < 1.0 && (double)mix64(i++) >= p * 18446744073709551616.0) { continue; }
+    nb_sampled += record.seq.length() - ksize + 1;
+    sample.seqs.push_back(std::move(record.seq));
+  }
+  sample.frac = (double)nb_sampled / sample.nb_kmers;
+  return sample;
+}
+
+
+// indexes of the minimum of the sliding windows of w values (the first one on ties, as sshash)
+static void sliding_argmin(const std::vector<uint64_t> &vals, std::size_t w, std::vector<uint32_t> &argmin) {
+  std::deque<uint32_t> q;
+  argmin.clear();
+  for(uint32_t i = 0; i < vals.size(); ++i) {
+    while(!q.empty() && vals[q.back()] > vals[i]) { q.pop_back(); }
+    q.push_back(i);
+    if(q.front() + w <= i) { q.pop_front(); }
+    if(i + 1 >= w) { argmin.push_back(q.front()); }
+  }
+}
+
+
+// time to compute the two minimizers of a k-mer, as done for each lookup (the best of a few runs
+// over the k-mers of the longest unitig of the sample)
+static double minimizers_ns(const unitig_sample &sample, std::size_t ksize, std::size_t msize) {
+  const uint64_t seed = sshash::constants::seed;
+  const std::string &seq = *std::max_element(sample.seqs.begin(), sample.seqs.end(),
+                                             [](auto &a, auto &b){ return a.length() < b.length(); });
+  std::size_t n_kmers = seq.length() - ksize + 1;
+  constexpr std::size_t n_queries = 1 << 14;
+  volatile uint64_t sink = 0;
+  double best = 0;
+  for(int run = 0; run < 3; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    for(std::size_t q = 0; q < n_queries; ++q) {
+      sshash::kmer_t kmer = sshash::util::string_to_uint_kmer(seq.data() + q % n_kmers, ksize);
+      sshash::kmer_t kmer_rc = sshash::util::compute_reverse_complement(kmer, ksize);
+      sink = sink + sshash::util::compute_minimizer(kmer, ksize, msize, seed)
+                  + sshash::util::compute_minimizer(kmer_rc, ksize, msize, seed);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    best = run ? std::min(best, elapsed.count() / n_queries) : elapsed.count() / n_queries;
+  }
+  return best;
+}
+
+
+static minimizer_probe probe_minimizer_len(const unitig_sample &sample, std::size_t ksize, std::size_t msize) {
+  constexpr double access_ns = 80.0;  // random memory access
+  constexpr double compare_ns = 1.0;  // k-mer comparison while scanning a super-k-mer
+  const uint64_t seed = sshash::constants::seed;
+  const std::size_t w = ksize - msize + 1;
+
+  minimizer_probe probe{};
+  probe.m = msize;
+  if(sample.seqs.empty()) { return probe; }
+
+  // super-k-mers of the sample: minimizer and number of k-mers
+  std::vector<std::pair<uint64_t,uint32_t>> super_kmers;
+  std::unordered_map<uint64_t,uint32_t> bucket_sizes;
+  std::vector<uint64_t> fwd, rev, hfwd, hrev;
+  std::vector<uint32_t> min_fwd, min_rev;
+  for(const std::string &seq : sample.seqs) {
+    std::size_t n_mmers = seq.length() - msize + 1;
+    fwd.resize(n_mmers); rev.resize(n_mmers); hfwd.resize(n_mmers); hrev.resize(n_mmers);
+    for(std::size_t i = 0; i < n_mmers; ++i) {
+      fwd[i] = static_cast<uint64_t>(sshash::util::string_to_uint_kmer(seq.data()+i, msize));
+      rev[i] = static_cast<uint64_t>(sshash::util::compute_reverse_complement(fwd[i], msize));
+      hfwd[i] = sshash::murmurhash2_64::hash(fwd[i], seed);
+      hrev[i] = sshash::murmurhash2_64::hash(rev[i], seed);
+    }
+    sliding_argmin(hfwd, w, min_fwd);
+    sliding_argmin(hrev, w, min_rev);
+    for(std::size_t j = 0; j < min_fwd.size(); ++j) {
+      uint64_t minimizer = std::min(fwd[min_fwd[j]], rev[min_rev[j]]);
+      if(j > 0 && super_kmers.back().first == minimizer) {
+        super_kmers.back().second++;
+      } else {
+        super_kmers.emplace_back(minimizer, 1);
+        bucket_sizes[minimizer]++;
+      }
+    }
+  }
+
+  // extrapolate to the whole dictionary
+  const double skew_min_size = double(1ULL << sshash::constants::min_l);
+  double nb_kmers = 0, cost = 0, bucket_sum = 0, skew_kmers = 0, skew_bits = 0, nb_buckets = 0;
+  for(auto [minimizer, n] : super_kmers) {
+    double b = 1.0 + (bucket_sizes[minimizer] - 1) / sample.frac;
+    double c = 2 * access_ns;
+    if(b > skew_min_size) {
+      // the k-mer and its reverse complement are looked up in the skew index half of the time
+      c += 1.5 * (2 * access_ns) + 3 * access_ns;
+      skew_kmers += n;
+      skew_bits += n * (3.5 + std::log2(b));
+    } else {
+      c += (b + 1) / 2 * (3 * access_ns + w * compare_ns);
+    }
+    nb_kmers += n;
+    cost += n * c;
+    bucket_sum += n * b;
+    nb_buckets += 1.0 / b;
+  }
+
+  probe.nb_super_kmers = super_kmers.size() / sample.frac;
+  probe.nb_buckets = nb_buckets / sample.frac;
+  probe.avg_bucket = bucket_sum / nb_kmers;
+  probe.skew_frac = skew_kmers / nb_kmers;
+  probe.lookup_ns = cost / nb_kmers;  // without the computation of the minimizers (see minimizers_ns)
+
+  // strings, super-k-mer offsets, minimizer MPHF (~3.5 bits per key), bucket boundaries and skew index
+  double offset_bits = std::ceil(std::log2(2.0 * sample.nb_bases + 1));
+  double bucket_bits = 2.0 + std::log2(std::max(1.0, probe.nb_super_kmers / probe.nb_buckets));
+  double bits = 2.0 * sample.nb_bases + probe.nb_super_kmers * offset_bits
+              + probe.nb_buckets * (3.5 + bucket_bits) + skew_bits / sample.frac;
+  probe.bits_per_kmer = bits / sample.nb_kmers;
+
+  return probe;
+}
+
+
+// probe minimizer lengths around log4 of the number of k-mers (from which random minimizers
+// start to be mostly unique) and return the probes, the chosen one first: the most compact
+// dictionary among those whose predicted lookup time is within 5% of the fastest one
+// (no probe is returned when no unitig is long enough to hold a k-mer)
+static std::vector<minimizer_probe> choose_minimizer_len(const std::string &utg_file, std::size_t ksize, std::size_t nb_threads,
+                                                         std::size_t min_length = 0) {
+  constexpr uint64_t max_sample_kmers = 2000000;
+
+  unitig_sample sample = sample_unitigs(utg_file, ksize, max_sample_kmers, min_length);
+  if(sample.nb_kmers == 0 || sample.seqs.empty()) { return {}; }
+
+  long center = (long)std::ceil(std::log(std::max<uint64_t>(sample.nb_kmers, 4)) / std::log(4.0));
+  long hi = std::min<long>({ center + 8, (long)ksize - 1, (long)sshash::constants::max_m });
+  long lo = std::max<long>(1, std::min<long>(center - 1, hi));
+
+  std::vector<minimizer_probe> probes(hi - lo + 1);
+  std::atomic<std::size_t> next{0};
+  auto worker = [&]() {
+    for(std::size_t i; (i = next++) < probes.size(); ) { probes[i] = probe_minimizer_len(sample, ksize, lo + i); }
+  };
+  std::vector<std::thread> workers;
+  for(std::size_t t = 0; t < std::min(nb_threads, probes.size()); ++t) { workers.emplace_back(worker); }
+  for(auto &t : workers) { t.join(); }
+
+  // timed one after the other, not to be disturbed by the other threads
+  for(minimizer_probe &p : probes) { p.lookup_ns += minimizers_ns(sample, ksize, p.m); }
+
+  double fastest = std::min_element(probes.begin(), probes.end(), [](auto &a, auto &b){ return a.lookup_ns < b.lookup_ns; })->lookup_ns;
+  auto best = probes.begin();
+  for(auto it = probes.begin(); it != probes.end(); ++it) {
+    if(it->lookup_ns <= 1.05 * fastest && (best->lookup_ns > 1.05 * fastest || it->bits_per_kmer < best->bits_per_kmer)) { best = it; }
+  }
+  std::rotate(probes.begin(), best, best+1);
+  return probes;
+}
+
+
+#endif
@@ -0,0 +1,418 @@
+#ifndef KM_PARTITION_PREFETCH_H
+#define KM_PARTITION_PREFETCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "progress.h"
+
+// (KM_NO_IO_URING disables io_uring at build time, e.g. for kernels without it)
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && !defined(KM_NO_IO_URING)
+#define KM_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+
+// read-ahead of kmtricks matrix partitions: the file is read in large blocks, several of them
+// being in flight while the previous ones are decompressed and processed, with io_uring when the
+// kernel allows it, or else with a reader thread per partition
+//
+// depth blocks of block_size bytes are kept in flight (0 for the blocking reads of kmtricks);
+// delay_us is added to each read, to test prefetching on a local disk as on a slow filesystem
+// (it is set from the KMAT_READ_DELAY_US environment variable by default)
+struct prefetch_options {
+  std::size_t depth{4};
+  std::size_t block_size{1 << 20};
+  unsigned delay_us{0};
+
+  prefetch_options() {
+    if (const char *delay = getenv("KMAT_READ_DELAY_US")) { delay_us = strtoul(delay, NULL, 10); }
+  }
+};
+
+
+#ifdef KM_HAVE_IO_URING
+
+// minimal io_uring ring (submission and completion queues mapped from the kernel), enough to
+// queue reads and wait for their completions without depending on liburing
+class io_uring_ring {
+public:
+  explicit io_uring_ring(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    m_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (m_fd < 0) { return; }
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) { m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size); }
+    m_sq_ptr = mmap(NULL, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    m_cq_ptr = single_mmap ? m_sq_ptr : mmap(NULL, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe*>(mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+    if (m_sq_ptr == MAP_FAILED || m_cq_ptr == MAP_FAILED || m_sqes == MAP_FAILED) { release(); return; }
+
+    char *sq = static_cast<char*>(m_sq_ptr), *cq = static_cast<char*>(m_cq_ptr);
+    m_sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    m_sq_entries = p.sq_entries;
+    m_cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+  }
+
+  ~io_uring_ring() { release(); }
+
+  io_uring_ring(const io_uring_ring&) = delete;
+  io_uring_ring& operator=(const io_uring_ring&) = delete;
+
+  bool good() const { return m_fd >= 0; }
+
+  // next free submission entry (zeroed), NULL if the queue is full
+  io_uring_sqe* get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sq_local_tail - head >= m_sq_entries) { return NULL; }
+    unsigned idx = m_sq_local_tail++ & m_sq_mask;
+    m_sq_array[idx] = idx;
+    memset(&m_sqes[idx], 0, sizeof(io_uring_sqe));
+    return &m_sqes[idx];
+  }
+
+  // submit the queued entries and wait for at least min_complete completions
+  bool submit_and_wait(unsigned min_complete) {
+    unsigned to_submit = m_sq_local_tail - *m_sq_tail;
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && min_complete == 0) { return true; }
+    while (true) {
+      long ret = syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (ret >= 0) { return true; }
+      if (errno != EINTR) { return false; }
+      to_submit = 0;
+    }
+  }
+
+  // call visit(user_data, res) for each available completion
+  template <typename Visitor>
+  void reap(Visitor visit) {
+    unsigned head = *m_cq_head;
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+      visit(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+  }
+
+private:
+  void release() {
+    if (m_sqes && m_sqes != MAP_FAILED) { munmap(m_sqes, m_sqes_size); }
+    if (m_cq_ptr && m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) { munmap(m_cq_ptr, m_cq_size); }
+    if (m_sq_ptr && m_sq_ptr != MAP_FAILED) { munmap(m_sq_ptr, m_sq_size); }
+    if (m_fd >= 0) { close(m_fd); }
+    m_sqes = NULL; m_sq_ptr = m_cq_ptr = NULL; m_fd = -1;
+  }
+
+  int m_fd{-1};
+  void *m_sq_ptr{NULL}, *m_cq_ptr{NULL};
+  std::size_t m_sq_size{0}, m_cq_size{0}, m_sqes_size{0};
+  io_uring_sqe *m_sqes{NULL};
+  unsigned *m_sq_head{NULL}, *m_sq_tail{NULL}, *m_sq_array{NULL};
+  unsigned m_sq_mask{0}, m_sq_entries{0}, m_sq_local_tail{0};
+  unsigned *m_cq_head{NULL}, *m_cq_tail{NULL};
+  unsigned m_cq_mask{0};
+  io_uring_cqe *m_cqes{NULL};
+};
+
+#endif
+
+
+// whether partitions are read with io_uring (probed once, it may be disabled, e.g. in containers)
+static bool prefetch_uses_io_uring() {
+#ifdef KM_HAVE_IO_URING
+  static const bool available = io_uring_ring(2).good();
+  return available;
+#else
+  return false;
+#endif
+}
+
+
+// stream buffer serving a file from a given offset, block after block, while the next blocks are
+// read; the reads only start when the first character is requested, so that opening a partition
+// which is not read (e.g. decided from its summary) costs nothing more
+class prefetch_buf : public std::streambuf {
+public:
+  prefetch_buf(const std::string &path, uint64_t offset, const prefetch_options &opts)
+    : m_offset(offset), m_block_size(std::max<std::size_t>(opts.block_size, 4096)), m_delay_us(opts.delay_us),
+      m_slots(std::max<std::size_t>(opts.depth, 1))
+  {
+    m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+      if (m_fd >= 0) { close(m_fd); }
+      throw std::runtime_error("Unable to open " + path);
+    }
+    uint64_t size = st.st_size;
+    m_nb_blocks = size > offset ? (size - offset + m_block_size - 1) / m_block_size : 0;
+    m_size = size;
+    m_slots.resize(std::min<uint64_t>(m_slots.size(), std::max<uint64_t>(m_nb_blocks, 1)));
+    for (slot &s : m_slots) { s.data.resize(std::min<uint64_t>(m_block_size, size > offset ? size - offset : 0)); }
+  }
+
+  ~prefetch_buf() {
+#ifdef KM_HAVE_IO_URING
+    // the kernel may still write to the buffers of the reads in flight
+    while (m_ring && m_in_flight > 0 && m_ring->submit_and_wait(1)) { reap(); }
+#endif
+    if (m_reader.joinable()) {
+      { std::lock_guard<std::mutex> lock(m_mutex); m_stop = true; }
+      m_cond.notify_all();
+      m_reader.join();
+    }
+    close(m_fd);
+  }
+
+  prefetch_buf(const prefetch_buf&) = delete;
+  prefetch_buf& operator=(const prefetch_buf&) = delete;
+
+  // bytes served so far
+  uint64_t bytes_read() const { return m_bytes_read; }
+
+protected:
+  int_type underflow() override {
+    if (gptr() < egptr()) { return traits_type::to_int_type(*gptr()); }
+    if (!m_started) { start(); }
+    if (m_next >= m_nb_blocks) { return traits_type::eof(); }
+
+    // the block just consumed frees its slot for the block depth ahead
+    if (m_next > 0) { release(m_next - 1); }
+
+    slot &s = m_slots[m_next % m_slots.size()];
+    int64_t res = wait(m_next);
+    if (res < 0) { throw std::runtime_error(std::string("Unable to read partition: ") + strerror(-res)); }
+    // a short read (e.g. interrupted) is completed with blocking reads
+    std::size_t len = block_length(m_next);
+    std::size_t got = res;
+    while (got < len) {
+      ssize_t n = pread(m_fd, s.data.data() + got, len - got, block_offset(m_next) + got);
+      if (n < 0 && errno == EINTR) { continue; }
+      if (n < 0) { throw std::runtime_error(std::string("Unable to read partition: ") + strerror(errno)); }
+      if (n == 0) { break; }
+      got += n;
+    }
+    m_next++;
+    m_bytes_read += got;
+    progress_meter::global().add(PROGRESS_BYTES_IN, got);
+    if (got == 0) { m_nb_blocks = m_next; return traits_type::eof(); }
+    setg(s.data.data(), s.data.data(), s.data.data() + got);
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  struct slot {
+    std::vector<char> data;
+    int64_t result{0};
+    bool done{false};
+#ifdef KM_HAVE_IO_URING
+    iovec iov;
+#endif
+  };
+
+  uint64_t block_offset(uint64_t block) const { return m_offset + block * m_block_size; }
+  std::size_t block_length(uint64_t block) const { return std::min<uint64_t>(m_block_size, m_size - block_offset(block)); }
+
+  void start() {
+    m_started = true;
+#ifdef KM_HAVE_IO_URING
+    if (prefetch_uses_io_uring()) {
+      m_ring = std::make_unique<io_uring_ring>(2 * m_slots.size());
+      if (m_ring->good()) {
+        for (uint64_t b = 0; b < std::min<uint64_t>(m_slots.size(), m_nb_blocks); ++b) { queue_read(b); }
+        if (!m_ring->submit_and_wait(0)) { throw std::runtime_error("Unable to submit partition reads"); }
+        return;
+      }
+      m_ring.reset();
+    }
+#endif
+    m_reader = std::thread(&prefetch_buf::read_ahead, this);
+  }
+
+  // the slot of a consumed block is reused for the block depth ahead
+  void release(uint64_t block) {
+#ifdef KM_HAVE_IO_URING
+    if (m_ring) {
+      if (block + m_slots.size() < m_nb_blocks) {
+        queue_read(block + m_slots.size());
+        if (!m_ring->submit_and_wait(0)) { throw std::runtime_error("Unable to submit partition reads"); }
+      }
+      return;
+    }
+#endif
+    { std::lock_guard<std::mutex> lock(m_mutex); m_released = block + 1; }
+    m_cond.notify_all();
+  }
+
+  int64_t wait(uint64_t block) {
+    slot &s = m_slots[block % m_slots.size()];
+#ifdef KM_HAVE_IO_URING
+    if (m_ring) {
+      while (!s.done) {
+        if (!m_ring->submit_and_wait(1)) { throw std::runtime_error("Unable to wait for partition reads"); }
+        reap();
+      }
+      return s.result;
+    }
+#endif
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [&]() { return s.done; });
+    s.done = false;
+    return s.result;
+  }
+
+#ifdef KM_HAVE_IO_URING
+  static constexpr uint64_t TIMEOUT_USER_DATA = UINT64_MAX;
+
+  // read of a block, after a linked timeout when reads are artificially delayed
+  void queue_read(uint64_t block) {
+    slot &s = m_slots[block % m_slots.size()];
+    s.done = false;
+    if (m_delay_us > 0) {
+      io_uring_sqe *t = m_ring->get_sqe();
+      m_delay.tv_sec = m_delay_us / 1000000;
+      m_delay.tv_nsec = (m_delay_us % 1000000) * 1000;
+      t->opcode = IORING_OP_TIMEOUT;
+      t->addr = reinterpret_cast<uint64_t>(&m_delay);
+      t->len = 1;
+      t->flags = IOSQE_IO_HARDLINK;
+      t->user_data = TIMEOUT_USER_DATA;
+      m_in_flight++;
+    }
+    s.iov.iov_base = s.data.data();
+    s.iov.iov_len = block_length(block);
+    io_uring_sqe *r = m_ring->get_sqe();
+    r->opcode = IORING_OP_READV;
+    r->fd = m_fd;
+    r->off = block_offset(block);
+    r->addr = reinterpret_cast<uint64_t>(&s.iov);
+    r->len = 1;
+    r->user_data = block % m_slots.size();
+    m_in_flight++;
+  }
+
+  void reap() {
+    m_ring->reap([&](uint64_t user_data, int32_t res) {
+      m_in_flight--;
+      if (user_data == TIMEOUT_USER_DATA) { return; }
+      m_slots[user_data].result = res;
+      m_slots[user_data].done = true;
+    });
+  }
+#endif
+
+  // thread-based prefetching: the blocks are read in turn, at most depth ahead of the consumer
+  void read_ahead() {
+    for (uint64_t b = 0; b < m_nb_blocks; ++b) {
+      slot &s = m_slots[b % m_slots.size()];
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [&]() { return m_stop || b < m_released + m_slots.size(); });
+        if (m_stop) { return; }
+      }
+      if (m_delay_us > 0) { std::this_thread::sleep_for(std::chrono::microseconds(m_delay_us)); }
+      int64_t res;
+      do { res = pread(m_fd, s.data.data(), block_length(b), block_offset(b)); } while (res < 0 && errno == EINTR);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        s.result = res < 0 ? -errno : res;
+        s.done = true;
+      }
+      m_cond.notify_all();
+    }
+  }
+
+  int m_fd{-1};
+  uint64_t m_offset;
+  uint64_t m_size{0};
+  std::size_t m_block_size;
+  unsigned m_delay_us;
+  uint64_t m_nb_blocks{0};
+  uint64_t m_bytes_read{0};
+  uint64_t m_next{0};
+  bool m_started{false};
+  std::vector<slot> m_slots;
+
+#ifdef KM_HAVE_IO_URING
+  std::unique_ptr<io_uring_ring> m_ring;
+  std::size_t m_in_flight{0};
+  __kernel_timespec m_delay{};
+#endif
+
+  std::thread m_reader;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  uint64_t m_released{0};
+  bool m_stop{false};
+};
+
+
+// kmtricks matrix reader (km::MatrixReader or km::PAMatrixReader) whose file is prefetched: the
+// header is read by kmtricks, then the file stream below the LZ4 layer reads from a prefetch_buf
+// (whose read errors are thrown by read() instead of ending the partition early)
+//
+// the blocks served are counted as bytes read by the progress meter, and the rest of the file
+// (its header, or all of it without prefetching) once the reader is destroyed
+template <typename Reader>
+class prefetching_reader : public Reader {
+public:
+  prefetching_reader(const std::string &path, const prefetch_options &opts) : Reader(path) {
+    struct stat st;
+    m_size = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+    if (opts.depth == 0) { return; }
+    m_raw = this->m_header.compressed ? this->m_first_layer.get() : this->m_second_layer.get();
+    std::streamoff pos = m_raw->tellg();
+    if (pos < 0) { m_raw = NULL; return; }
+    m_buf = std::make_unique<prefetch_buf>(path, pos, opts);
+    m_prev = m_raw->rdbuf(m_buf.get());
+    m_raw->exceptions(std::ios::badbit);
+    this->m_second_layer->exceptions(std::ios::badbit);
+  }
+
+  ~prefetching_reader() {
+    if (m_raw) { m_raw->rdbuf(m_prev); }
+    uint64_t served = m_buf ? m_buf->bytes_read() : 0;
+    progress_meter::global().add(PROGRESS_BYTES_IN, m_size > served ? m_size - served : 0);
+  }
+
+private:
+  uint64_t m_size{0};
+  std::istream *m_raw{NULL};
+  std::streambuf *m_prev{NULL};
+  std::unique_ptr<prefetch_buf> m_buf;
+};
+
+
+#endif
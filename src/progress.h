@@ -0,0 +1,385 @@
+#ifndef KM_PROGRESS_H
+#define KM_PROGRESS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// progress of a subcommand while it runs, printed to stderr every KMAT_PROGRESS seconds and/or
+// written every KMAT_PROGRESS seconds (15 by default) to "kmat_tools_<command>.prom" in the
+// KMAT_METRICS_DIR directory, in the text format of the textfile collector of the node exporter
+//
+// the processing loops add to the counters through slots owned by their thread (relaxed atomics
+// written by a single thread, hence a plain addition), and the bytes read or written sequentially
+// through a FILE* are rather sampled by the reporter from the offset of its file descriptor. A run
+// is split into phases, timed, whose ETA is estimated from their input size (in bytes or rows).
+enum progress_counter { PROGRESS_ROWS, PROGRESS_BYTES_IN, PROGRESS_BYTES_OUT, PROGRESS_HITS, PROGRESS_MISSES, PROGRESS_NB_COUNTERS };
+
+class progress_meter {
+public:
+  // the meter of the process (kmat_tools runs a single subcommand)
+  static progress_meter& global() {
+    static progress_meter meter;
+    return meter;
+  }
+
+  progress_meter(const progress_meter&) = delete;
+  progress_meter& operator=(const progress_meter&) = delete;
+
+  ~progress_meter() { stop(); }
+
+  // start the reporter thread if progress or metrics are requested by the environment
+  void start(const std::string &command) {
+    double interval = 0;
+    if (const char *s = getenv("KMAT_PROGRESS")) { interval = atof(s); }
+    const char *dir = getenv("KMAT_METRICS_DIR");
+    m_print = interval > 0;
+    if (dir != NULL && *dir != '\0') { m_metrics_path = std::string(dir) + "/kmat_tools_" + command + ".prom"; }
+    if (!m_print && m_metrics_path.empty()) { return; }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_command = command;
+    m_interval = interval > 0 ? interval : 15;
+    m_start = m_phase_start = m_last_report = clock::now();
+    m_start_time = time(NULL);
+    m_phase = command;
+    m_stopping = false;
+    m_active = true;
+    m_reporter = std::thread(&progress_meter::report_loop, this);
+  }
+
+  // final report, with the duration of each phase
+  void stop() {
+    if (!m_reporter.joinable()) { return; }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_cv.notify_all();
+    m_reporter.join();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    end_phase();
+    if (m_print) {
+      std::string phases;
+      for (const auto &[name, seconds] : m_phase_seconds) {
+        if (name != m_command) { phases += (phases.empty() ? " (" : ", ") + name + " " + format_duration(seconds); }
+      }
+      fprintf(stderr, "[progress] done in %s%s\n", format_duration(seconds_since(m_start)).c_str(), phases.empty() ? "" : (phases + ")").c_str());
+    }
+    write_metrics(false);
+    close_watches();
+  }
+
+  // start a new phase of total_rows rows (0 if unknown), whose input size is given by expect_input()
+  // or watch_input()
+  void phase(const std::string &name, uint64_t total_rows = 0) {
+    if (!m_active) { return; }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    end_phase();
+    m_phase = name;
+    m_phase_start = clock::now();
+    m_phase_rows = total_rows;
+    m_phase_bytes = 0;
+    for (int c = 0; c < PROGRESS_NB_COUNTERS; ++c) { m_phase_base[c] = value(progress_counter(c)); }
+  }
+
+  // input size of the current phase, in bytes read (PROGRESS_BYTES_IN)
+  void expect_input(uint64_t bytes) {
+    if (!m_active) { return; }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_phase_bytes += bytes;
+  }
+
+  // bytes read from fp (from its start, the size of a regular file being expected in the current
+  // phase) or written to fp (from now), sampled until the end of the phase; no-op for streams
+  // without a file descriptor (e.g. KFF matrices)
+  void watch_input(FILE *fp) { watch(fp, PROGRESS_BYTES_IN); }
+  void watch_output(FILE *fp) { watch(fp, PROGRESS_BYTES_OUT); }
+
+  // bytes written to a file (e.g. by an std::ofstream), sampled from its size until the end of the phase
+  void watch_output(const std::string &path) {
+    if (!m_active || path.empty()) { return; }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_watches.push_back(file_watch{ -1, path, PROGRESS_BYTES_OUT, 0, 0 });
+  }
+
+  void add(progress_counter c, uint64_t n = 1) {
+    thread_local slot_owner owner;
+    std::atomic<uint64_t> &v = m_slots[owner.index].values[c];
+    if (owner.index != SHARED_SLOT) {
+      v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    } else {
+      v.fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  // the slots are owned by the running threads, the last one being shared by any thread beyond
+  static constexpr std::size_t NB_SLOTS = 64;
+  static constexpr std::size_t SHARED_SLOT = NB_SLOTS - 1;
+
+  struct alignas(64) slot {
+    std::atomic<uint64_t> values[PROGRESS_NB_COUNTERS]{};
+  };
+
+  static std::atomic<uint64_t>& used_slots() {
+    static std::atomic<uint64_t> used{0};
+    return used;
+  }
+
+  struct slot_owner {
+    std::size_t index{SHARED_SLOT};
+    slot_owner() {
+      std::atomic<uint64_t> &used = used_slots();
+      uint64_t mask = used.load(std::memory_order_relaxed);
+      while (~mask & ((uint64_t(1) << SHARED_SLOT) - 1)) {
+        std::size_t i = __builtin_ctzll(~mask);
+        if (used.compare_exchange_weak(mask, mask | (uint64_t(1) << i), std::memory_order_acquire)) { index = i; break; }
+      }
+    }
+    ~slot_owner() {
+      if (index != SHARED_SLOT) { used_slots().fetch_and(~(uint64_t(1) << index), std::memory_order_release); }
+    }
+  };
+
+  // bytes read or written through a file descriptor (duplicated, hence still valid once the file is
+  // closed) or written to a file given by its path
+  struct file_watch {
+    int fd;
+    std::string path;
+    progress_counter counter;
+    uint64_t base;
+    uint64_t last;
+  };
+
+  progress_meter() = default;
+
+  void watch(FILE *fp, progress_counter c) {
+    if (!m_active) { return; }
+    int fd = fileno(fp);
+    fd = fd < 0 ? -1 : dup(fd);
+    if (fd < 0) { return; }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    struct stat st;
+    file_watch w{ fd, "", c, 0, 0 };
+    if (c == PROGRESS_BYTES_IN && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) { m_phase_bytes += st.st_size; }
+    if (c == PROGRESS_BYTES_OUT && offset > 0) { w.base = w.last = offset; }
+    m_watches.push_back(w);
+  }
+
+  void sample_watches() {
+    for (file_watch &w : m_watches) {
+      struct stat st;
+      off_t offset = w.fd >= 0 ? lseek(w.fd, 0, SEEK_CUR) : (stat(w.path.c_str(), &st) == 0 ? st.st_size : -1);
+      if (offset >= 0) { w.last = std::max<uint64_t>(w.last, offset); }
+    }
+  }
+
+  // the sampled bytes are kept in m_sampled once the watches of a phase are closed
+  void close_watches() {
+    sample_watches();
+    for (file_watch &w : m_watches) {
+      m_sampled[w.counter] += w.last - w.base;
+      if (w.fd >= 0) { close(w.fd); }
+    }
+    m_watches.clear();
+  }
+
+  uint64_t value(progress_counter c) const {
+    uint64_t v = m_sampled[c];
+    for (const slot &s : m_slots) { v += s.values[c].load(std::memory_order_relaxed); }
+    for (const file_watch &w : m_watches) { v += (w.counter == c) ? w.last - w.base : 0; }
+    return v;
+  }
+
+  void end_phase() {
+    close_watches();
+    if (!m_phase.empty()) { m_phase_seconds.emplace_back(m_phase, seconds_since(m_phase_start)); }
+  }
+
+  static double seconds_since(clock::time_point t) {
+    return std::chrono::duration<double>(clock::now() - t).count();
+  }
+
+  // ETA of the current phase from its progress in bytes read or else in rows, -1 if unknown
+  double eta(double &fraction) const {
+    uint64_t total = m_phase_bytes, done = value(PROGRESS_BYTES_IN) - m_phase_base[PROGRESS_BYTES_IN];
+    if (total == 0) { total = m_phase_rows; done = value(PROGRESS_ROWS) - m_phase_base[PROGRESS_ROWS]; }
+    if (total == 0 || done == 0) { return -1; }
+    fraction = std::min(1.0, double(done) / total);
+    return seconds_since(m_phase_start) * (1 - fraction) / fraction;
+  }
+
+  void report_loop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t last[PROGRESS_NB_COUNTERS] = {};
+    while (!m_cv.wait_for(lock, std::chrono::duration<double>(m_interval), [&]() { return m_stopping; })) {
+      sample_watches();
+      uint64_t now[PROGRESS_NB_COUNTERS];
+      for (int c = 0; c < PROGRESS_NB_COUNTERS; ++c) { now[c] = value(progress_counter(c)); }
+      double elapsed = std::max(1e-3, seconds_since(m_last_report));
+      m_last_report = clock::now();
+      if (m_print) { print_report(now, last, elapsed); }
+      write_metrics(true);
+      std::copy(now, now + PROGRESS_NB_COUNTERS, last);
+    }
+  }
+
+  // counts of the current phase and rates since the last report, e.g. "[progress] reading the
+  // k-mer matrix (2m10s): 125.30M rows at 1.02M/s, 4.31 GB read at 33.2 MB/s, 95.1% lookups hit,
+  // 47.0% done, ETA 2m26s"
+  void print_report(const uint64_t *now, const uint64_t *last, double elapsed) const {
+    uint64_t done[PROGRESS_NB_COUNTERS];
+    double rate[PROGRESS_NB_COUNTERS];
+    for (int c = 0; c < PROGRESS_NB_COUNTERS; ++c) {
+      done[c] = now[c] - m_phase_base[c];
+      rate[c] = (now[c] - std::max(last[c], m_phase_base[c])) / elapsed;
+    }
+    std::vector<std::string> parts;
+    if (done[PROGRESS_ROWS] > 0) {
+      parts.push_back(format_count(done[PROGRESS_ROWS]) + " rows at " + format_count(rate[PROGRESS_ROWS]) + "/s");
+    }
+    if (done[PROGRESS_BYTES_IN] > 0) {
+      parts.push_back(format_bytes(done[PROGRESS_BYTES_IN]) + " read at " + format_bytes(rate[PROGRESS_BYTES_IN]) + "/s");
+    }
+    if (done[PROGRESS_BYTES_OUT] > 0) {
+      parts.push_back(format_bytes(done[PROGRESS_BYTES_OUT]) + " written at " + format_bytes(rate[PROGRESS_BYTES_OUT]) + "/s");
+    }
+    char buf[32];
+    uint64_t lookups = done[PROGRESS_HITS] + done[PROGRESS_MISSES];
+    if (lookups > 0) {
+      snprintf(buf, sizeof(buf), "%.1f%%", 100.0 * done[PROGRESS_HITS] / lookups);
+      parts.push_back(std::string(buf) + " lookups hit");
+    }
+    double fraction = 0, t = eta(fraction);
+    if (t >= 0) {
+      snprintf(buf, sizeof(buf), "%.1f%%", 100 * fraction);
+      parts.push_back(std::string(buf) + " done, ETA " + format_duration(t));
+    }
+    std::string line = "[progress] " + m_phase + " (" + format_duration(seconds_since(m_phase_start)) + ")";
+    for (std::size_t i = 0; i < parts.size(); ++i) { line += (i == 0 ? ": " : ", ") + parts[i]; }
+    fprintf(stderr, "%s\n", line.c_str());
+  }
+
+  // the file is replaced atomically, as the textfile collector may read it at any time
+  void write_metrics(bool running) {
+    if (m_metrics_path.empty()) { return; }
+    std::string labels = "command=\"" + escape_label(m_command) + "\"";
+    std::string text;
+    auto metric = [&](const char *name, const char *type, const char *help, const std::vector<std::pair<std::string, double>> &values) {
+      text += std::string("# HELP kmat_tools_") + name + " " + help + "\n# TYPE kmat_tools_" + name + " " + type + "\n";
+      for (const auto &[extra, v] : values) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.15g", v);
+        text += std::string("kmat_tools_") + name + "{" + labels + extra + "} " + buf + "\n";
+      }
+    };
+    metric("rows_total", "counter", "Rows (k-mers, unitigs, reads or lines) processed.", { { "", double(value(PROGRESS_ROWS)) } });
+    metric("read_bytes_total", "counter", "Bytes of input read.", { { "", double(value(PROGRESS_BYTES_IN)) } });
+    metric("written_bytes_total", "counter", "Bytes of output written.", { { "", double(value(PROGRESS_BYTES_OUT)) } });
+    metric("lookups_total", "counter", "K-mer lookups in a dictionary.", {
+      { ",result=\"hit\"", double(value(PROGRESS_HITS)) }, { ",result=\"miss\"", double(value(PROGRESS_MISSES)) } });
+    std::vector<std::pair<std::string, double>> phases;
+    for (const auto &[name, seconds] : m_phase_seconds) { phases.emplace_back(",phase=\"" + escape_label(name) + "\"", seconds); }
+    if (running) { phases.emplace_back(",phase=\"" + escape_label(m_phase) + "\"", seconds_since(m_phase_start)); }
+    metric("phase_seconds", "gauge", "Duration of each phase, so far for the current one.", phases);
+    if (running) {
+      metric("phase_info", "gauge", "Current phase.", { { ",phase=\"" + escape_label(m_phase) + "\"", 1 } });
+      double fraction = 0, t = eta(fraction);
+      if (t >= 0) { metric("phase_eta_seconds", "gauge", "Estimated time left in the current phase.", { { "", t } }); }
+    }
+    metric("start_time_seconds", "gauge", "Start time since the epoch.", { { "", double(m_start_time) } });
+    metric("last_update_seconds", "gauge", "Time of this update since the epoch.", { { "", double(time(NULL)) } });
+    metric("running", "gauge", "Whether the command is still running.", { { "", running ? 1.0 : 0.0 } });
+
+    std::string tmp = m_metrics_path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    bool ok = fp != NULL && fwrite(text.data(), 1, text.size(), fp) == text.size();
+    ok = (fp != NULL && fclose(fp) == 0) && ok && rename(tmp.c_str(), m_metrics_path.c_str()) == 0;
+    if (!ok && !m_metrics_warned) {
+      fprintf(stderr, "[warning] cannot write metrics to \"%s\"\n", m_metrics_path.c_str());
+      m_metrics_warned = true;
+    }
+  }
+
+  static std::string escape_label(const std::string &s) {
+    std::string out;
+    for (char c : s) {
+      if (c == '\\' || c == '"') { out.push_back('\\'); }
+      if (c == '\n') { out += "\\n"; continue; }
+      out.push_back(c);
+    }
+    return out;
+  }
+
+  static std::string format_count(double n) {
+    char buf[32];
+    if (n < 1e3) { snprintf(buf, sizeof(buf), "%.0f", n); }
+    else if (n < 1e6) { snprintf(buf, sizeof(buf), "%.1fk", n / 1e3); }
+    else if (n < 1e9) { snprintf(buf, sizeof(buf), "%.2fM", n / 1e6); }
+    else { snprintf(buf, sizeof(buf), "%.2fG", n / 1e9); }
+    return buf;
+  }
+
+  static std::string format_bytes(double n) {
+    char buf[32];
+    if (n < 1e6) { snprintf(buf, sizeof(buf), "%.1f kB", n / 1e3); }
+    else if (n < 1e9) { snprintf(buf, sizeof(buf), "%.1f MB", n / 1e6); }
+    else { snprintf(buf, sizeof(buf), "%.2f GB", n / 1e9); }
+    return buf;
+  }
+
+  static std::string format_duration(double seconds) {
+    char buf[32];
+    long s = std::lround(seconds);
+    if (seconds < 10) { snprintf(buf, sizeof(buf), "%.1fs", seconds); }
+    else if (s < 60) { snprintf(buf, sizeof(buf), "%lds", s); }
+    else if (s < 3600) { snprintf(buf, sizeof(buf), "%ldm%02lds", s / 60, s % 60); }
+    else { snprintf(buf, sizeof(buf), "%ldh%02ldm", s / 3600, (s / 60) % 60); }
+    return buf;
+  }
+
+  slot m_slots[NB_SLOTS];
+
+  // the rest is protected by m_mutex
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_reporter;
+  bool m_active{false};
+  bool m_stopping{false};
+  bool m_print{false};
+  bool m_metrics_warned{false};
+  double m_interval{15};
+  std::string m_command;
+  std::string m_metrics_path;
+  clock::time_point m_start, m_phase_start, m_last_report;
+  time_t m_start_time{0};
+  std::string m_phase;
+  uint64_t m_phase_rows{0}, m_phase_bytes{0};
+  uint64_t m_phase_base[PROGRESS_NB_COUNTERS]{};
+  uint64_t m_sampled[PROGRESS_NB_COUNTERS]{};
+  std::vector<file_watch> m_watches;
+  std::vector<std::pair<std::string, double>> m_phase_seconds;
+};
+
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef KM_UNITIG_CHAINS_H
+#define KM_UNITIG_CHAINS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "unitig_dict.h"
+
+
+// chains of unitigs adjacent in the de Bruijn graph of the dictionary, with nothing else attached
+// at their junctions, merged into "super-unitigs" ("kmat_tools unitig -M"): e.g. the unitigs that
+// were only split by a branch removed by the length filter of the unitigs, or by a sequencing error
+//
+// each end of a unitig is numbered 2*utg_id (its first k-mer) or 2*utg_id+1 (its last k-mer); two
+// ends are linked if each one is the only end adjacent to the other, and the values of their unitigs
+// in the samples are similar. The linked ends form paths (or cycles, broken at one of their unitigs)
+// that are walked to get the chains, with the orientation of each unitig along its chain.
+struct unitig_chains {
+  std::vector<uint64_t> members;
+  std::vector<uint8_t> reversed;
+  std::vector<uint64_t> offsets{0};
+
+  std::size_t size() const { return offsets.size() - 1; }
+  const uint64_t* begin(std::size_t chain) const { return members.data() + offsets[chain]; }
+  std::size_t length(std::size_t chain) const { return offsets[chain+1] - offsets[chain]; }
+
+  // sequence of a chain, the consecutive unitigs overlapping by k-1 nucleotides
+  void append_seq(const sshash::dictionary &dict, std::size_t chain, std::string &out) const {
+    std::string seq;
+    for (uint64_t i = offsets[chain]; i < offsets[chain+1]; ++i) {
+      seq.clear();
+      append_unitig_seq(dict, members[i], seq);
+      if (reversed[i]) {
+        std::string rc(seq.size(), 'N');
+        sshash::util::compute_reverse_complement(seq.data(), rc.data(), seq.size());
+        seq.swap(rc);
+      }
+      out.append(seq, i == offsets[chain] ? 0 : dict.k() - 1, std::string::npos);
+    }
+  }
+
+  // unitig names separated by commas
+  void append_names(const unitig_names &names, std::size_t chain, std::string &out) const {
+    for (uint64_t i = offsets[chain]; i < offsets[chain+1]; ++i) {
+      if (i > offsets[chain]) { out.push_back(','); }
+      out.append(names[members[i]]);
+    }
+  }
+};
+
+
+static constexpr uint64_t NO_UNITIG_END = UINT64_MAX;
+static constexpr uint64_t MANY_UNITIG_ENDS = UINT64_MAX - 1;
+
+// end of a unitig adjacent to an end of another unitig, given the lookup of the k-mer extending
+// that end (outwards): it must be the first k-mer of the unitig, in the same orientation, or the
+// last one, reverse complemented
+static inline uint64_t adjacent_unitig_end(const sshash::lookup_result &res, bool from_last) {
+  bool forward = res.kmer_orientation == sshash::constants::forward_orientation;
+  if (res.kmer_id_in_contig == 0 && forward == from_last) { return 2 * res.contig_id; }
+  if (res.kmer_id_in_contig == res.contig_size - 1 && forward != from_last) { return 2 * res.contig_id + 1; }
+  return MANY_UNITIG_ENDS;
+}
+
+// similar(u, v) tells whether unitigs u and v can be in the same chain
+template <typename Similarity>
+static void build_unitig_chains(const sshash::dictionary &dict, std::size_t nb_threads, Similarity similar, unitig_chains &out) {
+  const uint64_t n_unitigs = dict.num_contigs();
+  constexpr uint64_t block_size = 1 << 12;
+
+  // the end adjacent to each end, if only one
+  std::vector<uint64_t> adjacent(2 * n_unitigs);
+  std::atomic<uint64_t> next{0};
+  auto find_adjacent = [&]() {
+    for (uint64_t first; (first = next.fetch_add(block_size)) < n_unitigs; ) {
+      for (uint64_t u = first; u < std::min(n_unitigs, first + block_size); ++u) {
+        sshash::neighbourhood nb = dict.contig_neighbours(u);
+        const sshash::lookup_result forward[] = { nb.forward_A, nb.forward_C, nb.forward_G, nb.forward_T };
+        const sshash::lookup_result backward[] = { nb.backward_A, nb.backward_C, nb.backward_G, nb.backward_T };
+        for (int last = 0; last < 2; ++last) {
+          uint64_t end = NO_UNITIG_END;
+          for (const sshash::lookup_result &res : last ? forward : backward) {
+            if (res.kmer_id == sshash::constants::invalid_uint64) { continue; }
+            uint64_t e = adjacent_unitig_end(res, last);
+            end = (end == NO_UNITIG_END || end == e) ? e : MANY_UNITIG_ENDS;
+          }
+          adjacent[2*u + last] = end;
+        }
+      }
+    }
+  };
+
+  // the ends linked to each end: the adjacency must be mutual, between different unitigs
+  std::vector<uint64_t> link(2 * n_unitigs, NO_UNITIG_END);
+  auto link_ends = [&]() {
+    for (uint64_t first; (first = next.fetch_add(block_size)) < n_unitigs; ) {
+      for (uint64_t u = first; u < std::min(n_unitigs, first + block_size); ++u) {
+        for (uint64_t a = 2*u; a < 2*u + 2; ++a) {
+          uint64_t b = adjacent[a];
+          if (b >= MANY_UNITIG_ENDS || b/2 == u || adjacent[b] != a) { continue; }
+          if (similar(u, b/2)) { link[a] = b; }
+        }
+      }
+    }
+  };
+
+  auto run_parallel = [&](auto &worker) {
+    next = 0;
+    std::vector<std::thread> workers;
+    for (std::size_t t = 1; t < nb_threads; ++t) { workers.emplace_back(std::ref(worker)); }
+    worker();
+    for (auto &t : workers) { t.join(); }
+  };
+  run_parallel(find_adjacent);
+  run_parallel(link_ends);
+
+  // walk the paths from their free end, then the remaining cycles
+  out.members.clear();
+  out.reversed.clear();
+  out.offsets.assign(1, 0);
+  std::vector<bool> visited(n_unitigs, false);
+  auto walk = [&](uint64_t u, bool reversed) {
+    while (!visited[u]) {
+      visited[u] = true;
+      out.members.push_back(u);
+      out.reversed.push_back(reversed);
+      uint64_t next_end = link[2*u + !reversed];
+      if (next_end == NO_UNITIG_END) { break; }
+      u = next_end / 2;
+      reversed = next_end % 2;
+    }
+    out.offsets.push_back(out.members.size());
+  };
+  for (uint64_t u = 0; u < n_unitigs; ++u) {
+    if (visited[u]) { continue; }
+    if (link[2*u] == NO_UNITIG_END) {
+      walk(u, false);
+    } else if (link[2*u+1] == NO_UNITIG_END) {
+      walk(u, true);
+    }
+  }
+  for (uint64_t u = 0; u < n_unitigs; ++u) {
+    if (!visited[u]) { walk(u, false); }
+  }
+}
+
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef KM_UNITIG_DICT_H
+#define KM_UNITIG_DICT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../external/kseq++/seqio.hpp"
+#include "../external/sshash/dictionary.hpp"
+
+#include "progress.h"
+
+
+// redirect std::cout to std::cerr for the lifetime of the object
+// (sshash logs to stdout, which may also be used to output a matrix)
+struct cout_to_cerr {
+  cout_to_cerr() : m_coutbuf(std::cout.rdbuf(std::cerr.rdbuf())) {}
+  ~cout_to_cerr() { std::cout.rdbuf(m_coutbuf); }
+  std::streambuf *m_coutbuf;
+};
+
+
+// unitig names stored contiguously and indexed by unitig identifier
+struct unitig_names {
+
+  std::size_t size() const { return m_ends.size(); }
+
+  void push_back(std::string_view name) {
+    m_chars.insert(m_chars.end(), name.begin(), name.end());
+    m_ends.push_back(m_chars.size());
+  }
+
+  std::string_view operator[](std::size_t i) const {
+    uint64_t begin = i > 0 ? m_ends[i-1] : 0;
+    return std::string_view(m_chars.data()+begin, m_ends[i]-begin);
+  }
+
+  template <typename Visitor>
+  void visit(Visitor& visitor) {
+    visitor.visit(m_chars);
+    visitor.visit(m_ends);
+  }
+
+private:
+  std::vector<char> m_chars;
+  std::vector<uint64_t> m_ends;
+};
+
+
+// stream buffer providing the sshash builder with the sequences of a FASTA file (possibly
+// gzipped and/or multi-line) one per line, while recording the names of the retained ones
+// sequences shorter than min_length (at least k, as sshash would skip them) are skipped so that
+// names stay aligned to contig ids, e.g. to read the raw output of ggcat without a filtered copy
+class unitig_fasta_buf : public std::streambuf {
+public:
+  unitig_fasta_buf(const std::string &utg_file, std::size_t min_length, unitig_names &names)
+    : m_ssi(utg_file.c_str()), m_min_length(min_length), m_names(names) {}
+
+protected:
+  int_type underflow() override {
+    if (gptr() < egptr()) { return traits_type::to_int_type(*gptr()); }
+    do {
+      if (!(m_ssi >> m_record)) { return traits_type::eof(); }
+    } while (m_record.seq.length() < m_min_length);
+    m_names.push_back(m_record.name);
+    m_buf.assign(">\n");
+    m_buf.append(m_record.seq);
+    m_buf.push_back('\n');
+    setg(m_buf.data(), m_buf.data(), m_buf.data()+m_buf.size());
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  klibpp::SeqStreamIn m_ssi;
+  klibpp::KSeq m_record;
+  std::size_t m_min_length;
+  unitig_names &m_names;
+  std::string m_buf;
+};
+
+
+// build an sshash dictionary (with canonical parsing) from a FASTA file of unitigs, keeping
+// those at least min_length long, and collect the unitig names in the order of their identifiers
+// in the dictionary; returns false (with an empty dictionary) if no unitig is kept
+static bool build_unitig_dict(sshash::dictionary &dict, unitig_names &names, const std::string &utg_file, std::size_t ksize, std::size_t msize,
+                              std::size_t nb_threads, std::size_t min_length = 0) {
+  sshash::build_configuration build_config;
+  build_config.k = ksize;
+  build_config.m = msize;
+  build_config.c = 5.0;
+  build_config.pthash_threads = nb_threads;
+  build_config.canonical_parsing = true;
+  build_config.verbose = false;
+
+  unitig_fasta_buf utg_buf(utg_file, std::max(ksize, min_length), names);
+  std::istream utg_stream(&utg_buf);
+  if (utg_buf.sgetc() == std::char_traits<char>::eof()) { return false; }
+
+  cout_to_cerr redirect;
+  dict.build(utg_stream, build_config);
+  return true;
+}
+
+
+// save/load a dictionary along with the unitig names to/from a binary file
+// returns the number of bytes written/read
+static std::size_t save_unitig_dict(sshash::dictionary &dict, unitig_names &names, const std::string &dict_file) {
+  essentials::saver saver(dict_file.c_str());
+  saver.visit(dict);
+  saver.visit(names);
+  return saver.bytes();
+}
+
+static std::size_t load_unitig_dict(sshash::dictionary &dict, unitig_names &names, const std::string &dict_file) {
+  essentials::loader loader(dict_file.c_str());
+  loader.visit(dict);
+  loader.visit(names);
+  return loader.bytes();
+}
+
+
+// [begin,end) range of the k-mer identifiers of a unitig
+static std::pair<uint64_t,uint64_t> unitig_kmer_ids(const sshash::dictionary &dict, uint64_t utg_id) {
+  auto [begin, end] = dict.contig_offsets(utg_id);
+  uint64_t begin_kmer_id = begin - utg_id * (dict.k() - 1);
+  return { begin_kmer_id, begin_kmer_id + (end - begin) - dict.k() + 1 };
+}
+
+
+// append the sequence of a unitig to a string, decoding 32 nucleotides at a time
+static void append_unitig_seq(const sshash::dictionary &dict, uint64_t utg_id, std::string &out) {
+  auto [begin, end] = dict.contig_offsets(utg_id);
+  const pthash::bit_vector &strings = dict.strings();
+  std::size_t pos = out.size();
+  out.resize(pos + (end - begin));
+  for (uint64_t i = begin; i < end; i += 32) {
+    uint64_t word = strings.get_word64(2*i);
+    uint64_t n = std::min<uint64_t>(32, end - i);
+    for (uint64_t j = 0; j < n; ++j, word >>= 2) {
+      out[pos++] = sshash::util::uint64_to_char(word & 3);
+    }
+  }
+}
+
+
+// append the " avg;frac" column of a unitig given its number of k-mers present in a sample
+// and the sum of their abundances
+static inline void append_avg_frac(std::string &buf, uint32_t nb_present, uint32_t sum, std::size_t utg_nb_kmers) {
+  char col[64];
+  double frac = (1.0 * nb_present)/utg_nb_kmers;
+  double avg_coverage = (1.0 * sum)/utg_nb_kmers;
+  int len = snprintf(col, sizeof(col), " %.2f;%.2f", avg_coverage, frac);
+  buf.append(col, len);
+}
+
+
+// append the " n ci" columns of a unitig whose k-mer fractions are estimated from n sampled
+// k-mers out of its utg_nb_kmers ones: ci is the half-width of the 95% confidence interval of
+// a fraction in the worst case (p=0.5), with finite population correction
+static inline void append_sketch_columns(std::string &buf, uint32_t nb_sampled, std::size_t utg_nb_kmers) {
+  char col[64];
+  double ci = 1.0;
+  if(nb_sampled > 0 && utg_nb_kmers > 1) {
+    double fpc = (1.0 * utg_nb_kmers - std::min<double>(nb_sampled, utg_nb_kmers)) / (utg_nb_kmers - 1);
+    ci = std::min(1.0, 1.96 * std::sqrt(0.25 / nb_sampled * fpc));
+  } else if(nb_sampled > 0) {
+    ci = 0.0;
+  }
+  int len = snprintf(col, sizeof(col), " %u %.2f", nb_sampled, ci);
+  buf.append(col, len);
+}
+
+
+// write n_rows rows, each made of a name appended by append_name(row, buf) followed by the
+// columns appended by format_columns(row, buf); blocks of consecutive rows are formatted in parallel
+template <typename NameFormatter, typename ColumnFormatter>
+static void write_matrix_rows(std::ostream &out, uint64_t n_rows, std::size_t nb_threads, NameFormatter append_name, ColumnFormatter format_columns) {
+  constexpr uint64_t block_size = 1 << 14;
+  std::vector<std::string> buffers(nb_threads);
+
+  auto format_rows = [&](uint64_t begin, uint64_t end, std::string &buf) {
+    buf.clear();
+    for (uint64_t row = begin; row < end; ++row) {
+      append_name(row, buf);
+      format_columns(row, buf);
+      buf.push_back('\n');
+    }
+    progress_meter::global().add(PROGRESS_ROWS, end - begin);
+  };
+
+  for (uint64_t first = 0; first < n_rows; first += nb_threads * block_size) {
+    std::vector<std::thread> workers;
+    for (std::size_t t = 0; t < nb_threads; ++t) {
+      uint64_t begin = std::min(n_rows, first + t * block_size);
+      uint64_t end = std::min(n_rows, begin + block_size);
+      workers.emplace_back(format_rows, begin, end, std::ref(buffers[t]));
+    }
+    for (std::size_t t = 0; t < nb_threads; ++t) {
+      workers[t].join();
+      out.write(buffers[t].data(), buffers[t].size());
+    }
+  }
+}
+
+
+// write one row per unitig: its name (or sequence), followed by the columns appended
+// by format_columns(utg_id, buf)
+template <typename ColumnFormatter>
+static void write_unitig_rows(std::ostream &out, const sshash::dictionary &dict, const unitig_names &names, bool write_seq, std::size_t nb_threads, ColumnFormatter format_columns) {
+  write_matrix_rows(out, dict.num_contigs(), nb_threads, [&](uint64_t utg_id, std::string &buf) {
+    if (write_seq) {
+      append_unitig_seq(dict, utg_id, buf);
+    } else {
+      buf.append(names[utg_id]);
+    }
+  }, format_columns);
+}
+
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef KM_UNITIG_PARTIAL_H
+#define KM_UNITIG_PARTIAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+
+// partial unitig matrix computed by "kmat_tools unitig --shard i/n" from a subset of the
+// partitions of a kmtricks matrix, merged with the other shards by "kmat_tools unitig-reduce"
+//
+// file layout: a fixed-size header followed, for each unitig with at least one k-mer found in
+// the shard partitions (in increasing identifier order), by varint-encoded fields:
+//   unitig id (delta from the previous one), number of entries n,
+//   then n times: sample (delta from the previous one), hits, sum
+// where hits is the number of k-mers of the unitig present in the sample and sum their abundance
+
+static const char UNITIG_PARTIAL_MAGIC[8] = { 'K', 'M', 'U', 'T', 'G', 'P', 'S', '1' };
+
+struct unitig_partial_header {
+  char magic[8];
+  uint32_t shard;
+  uint32_t nb_shards;
+  uint64_t nb_unitigs;  // number of unitigs and k-mers of the dictionary, used to check
+  uint64_t nb_kmers;    // that all the shards are computed against the same one
+  uint64_t nb_samples;
+  uint64_t nb_rows;     // number of unitigs with at least one entry
+};
+
+
+// write a partial matrix given the (hits,sum) pairs of all the unitigs, n_samples per unitig
+static bool write_unitig_partial(const std::string &fname, unitig_partial_header hdr, const std::vector<std::pair<uint32_t,uint32_t>> &utg_samples) {
+  FILE *fp = fopen(fname.c_str(), "wb");
+  if(fp == NULL) { return false; }
+
+  memcpy(hdr.magic, UNITIG_PARTIAL_MAGIC, sizeof(hdr.magic));
+  hdr.nb_rows = 0;
+  fwrite(&hdr, sizeof(hdr), 1, fp); // rewritten at the end with the number of rows
+
+  std::string buf;
+  uint64_t prev_utg = 0;
+  for(uint64_t utg_id = 0; utg_id < hdr.nb_unitigs; ++utg_id) {
+    const auto *row = utg_samples.data() + utg_id * hdr.nb_samples;
+    uint64_t n = 0;
+    for(uint64_t s = 0; s < hdr.nb_samples; ++s) { n += (row[s].first || row[s].second); }
+    if(n == 0) { continue; }
+
+    put_varint(buf, utg_id - prev_utg);
+    put_varint(buf, n);
+    uint64_t prev_s = 0;
+    for(uint64_t s = 0; s < hdr.nb_samples; ++s) {
+      if(!row[s].first && !row[s].second) { continue; }
+      put_varint(buf, s - prev_s);
+      put_varint(buf, row[s].first);
+      put_varint(buf, row[s].second);
+      prev_s = s;
+    }
+    prev_utg = utg_id;
+    hdr.nb_rows++;
+
+    if(buf.size() >= (1 << 20)) {
+      fwrite(buf.data(), 1, buf.size(), fp);
+      buf.clear();
+    }
+  }
+  fwrite(buf.data(), 1, buf.size(), fp);
+
+  rewind(fp);
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  bool ok = !ferror(fp);
+  return (fclose(fp) == 0) && ok;
+}
+
+
+// read the header of a partial matrix, returns false if the file is not a valid partial matrix
+static bool read_unitig_partial_header(FILE *fp, unitig_partial_header &hdr) {
+  return fread(&hdr, sizeof(hdr), 1, fp) == 1 && memcmp(hdr.magic, UNITIG_PARTIAL_MAGIC, sizeof(hdr.magic)) == 0;
+}
+
+// add the entries of a partial matrix (whose header has already been read) to utg_samples
+static bool add_unitig_partial(FILE *fp, const unitig_partial_header &hdr, std::vector<std::pair<uint32_t,uint32_t>> &utg_samples) {
+  std::vector<uint8_t> data;
+  uint8_t chunk[1 << 16];
+  std::size_t n;
+  while((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) { data.insert(data.end(), chunk, chunk+n); }
+
+  const uint8_t *p = data.data(), *end = data.data() + data.size();
+  uint64_t utg_id = 0;
+  for(uint64_t r = 0; r < hdr.nb_rows; ++r) {
+    if(p >= end) { return false; }
+    utg_id += get_varint(p, end);
+    uint64_t n_entries = get_varint(p, end);
+    uint64_t s = 0;
+    for(uint64_t e = 0; e < n_entries; ++e) {
+      s += get_varint(p, end);
+      uint32_t hits = get_varint(p, end);
+      uint32_t sum = get_varint(p, end);
+      if(utg_id >= hdr.nb_unitigs || s >= hdr.nb_samples) { return false; }
+      auto &entry = utg_samples[utg_id * hdr.nb_samples + s];
+      entry.first = add_sat(entry.first, hits);
+      entry.second = add_sat(entry.second, sum);
+    }
+  }
+  return p == end;
+}
+
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef KM_UNITIG_PROFILES_H
+#define KM_UNITIG_PROFILES_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+// unitig matrix stored as its distinct rows of values ("profiles", e.g. the many unitigs present
+// in all the samples or private to one of them) and the profile of each unitig, in the order of
+// the unitigs of the dictionary ("kmat_tools unitig -u/-U")
+//
+// binary file layout: magic, number of unitigs and of profiles (uint64_t), the columns of each
+// profile as written in the unitig matrix (uint32_t length followed by its characters), then the
+// profile of each unitig on 1, 2 or 4 bytes depending on the number of profiles
+static const char UNITIG_PROFILES_MAGIC[8] = { 'K', 'M', 'U', 'P', 'R', 'O', 'F', '1' };
+
+struct unitig_profiles {
+  std::vector<std::string> profiles;
+  std::vector<uint32_t> profile_of;
+
+  // number of bytes of the profile of a unitig in the binary file
+  std::size_t id_bytes() const {
+    return profiles.size() <= (1u << 8) ? 1 : profiles.size() <= (1u << 16) ? 2 : 4;
+  }
+
+  // one line per profile: its identifier followed by its columns
+  void write_profiles(std::ostream &out) const {
+    std::string line;
+    for (std::size_t p = 0; p < profiles.size(); ++p) {
+      line = std::to_string(p);
+      line.append(profiles[p]);
+      line.push_back('\n');
+      out.write(line.data(), line.size());
+    }
+  }
+
+  // one line per unitig: its name (as given by append_name(utg_id, line)) followed by its profile
+  template <typename NameFormatter>
+  void write_map(std::ostream &out, NameFormatter append_name) const {
+    std::string buf;
+    for (uint64_t utg_id = 0; utg_id < profile_of.size(); ++utg_id) {
+      append_name(utg_id, buf);
+      buf.push_back(' ');
+      buf.append(std::to_string(profile_of[utg_id]));
+      buf.push_back('\n');
+      if (buf.size() >= (1 << 20)) { out.write(buf.data(), buf.size()); buf.clear(); }
+    }
+    out.write(buf.data(), buf.size());
+  }
+
+  bool save(const std::string &fname) const {
+    FILE *fp = fopen(fname.c_str(), "wb");
+    if (fp == NULL) { return false; }
+    uint64_t dims[2] = { profile_of.size(), profiles.size() };
+    fwrite(UNITIG_PROFILES_MAGIC, 1, sizeof(UNITIG_PROFILES_MAGIC), fp);
+    fwrite(dims, sizeof(uint64_t), 2, fp);
+    for (const std::string &p : profiles) {
+      uint32_t len = p.size();
+      fwrite(&len, sizeof(len), 1, fp);
+      fwrite(p.data(), 1, len, fp);
+    }
+    std::size_t nb = id_bytes();
+    std::vector<uint8_t> ids(profile_of.size() * nb);
+    for (std::size_t i = 0; i < profile_of.size(); ++i) {
+      uint32_t id = profile_of[i];
+      memcpy(ids.data() + i * nb, &id, nb);
+    }
+    fwrite(ids.data(), 1, ids.size(), fp);
+    bool ok = !ferror(fp);
+    return (fclose(fp) == 0) && ok;
+  }
+
+  bool load(const std::string &fname) {
+    FILE *fp = fopen(fname.c_str(), "rb");
+    if (fp == NULL) { return false; }
+    char magic[8];
+    uint64_t dims[2];
+    bool ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, UNITIG_PROFILES_MAGIC, sizeof(magic)) == 0
+           && fread(dims, sizeof(uint64_t), 2, fp) == 2;
+    if (ok) {
+      profiles.assign(dims[1], "");
+      for (std::size_t p = 0; ok && p < profiles.size(); ++p) {
+        uint32_t len;
+        ok = fread(&len, sizeof(len), 1, fp) == 1;
+        profiles[p].resize(ok ? len : 0);
+        ok = ok && fread(profiles[p].data(), 1, len, fp) == len;
+      }
+      std::size_t nb = id_bytes();
+      std::vector<uint8_t> ids(dims[0] * nb);
+      ok = ok && fread(ids.data(), 1, ids.size(), fp) == ids.size();
+      profile_of.assign(dims[0], 0);
+      for (std::size_t i = 0; ok && i < profile_of.size(); ++i) {
+        memcpy(&profile_of[i], ids.data() + i * nb, nb);
+        ok = profile_of[i] < profiles.size();
+      }
+    }
+    fclose(fp);
+    return ok;
+  }
+};
+
+
+// group the rows of the unitig matrix by their columns, as appended by format_columns(utg_id, buf)
+// (see write_unitig_rows), the profiles being numbered in the order of their first unitig; blocks
+// of consecutive unitigs are formatted in parallel, then their rows are looked up in turn
+template <typename ColumnFormatter>
+static void build_unitig_profiles(uint64_t n_unitigs, std::size_t nb_threads, ColumnFormatter format_columns, unitig_profiles &out) {
+  constexpr uint64_t block_size = 1 << 14;
+  std::vector<std::string> buffers(nb_threads);
+  std::vector<std::vector<std::size_t>> ends(nb_threads);
+  std::unordered_map<std::string, uint32_t> ids;
+  out.profiles.clear();
+  out.profile_of.assign(n_unitigs, 0);
+
+  auto format_rows = [&](uint64_t begin, uint64_t end, std::string &buf, std::vector<std::size_t> &row_ends) {
+    buf.clear();
+    row_ends.clear();
+    for (uint64_t utg_id = begin; utg_id < end; ++utg_id) {
+      format_columns(utg_id, buf);
+      row_ends.push_back(buf.size());
+    }
+  };
+
+  std::string row;
+  for (uint64_t first = 0; first < n_unitigs; first += nb_threads * block_size) {
+    std::vector<std::thread> workers;
+    for (std::size_t t = 0; t < nb_threads; ++t) {
+      uint64_t begin = std::min(n_unitigs, first + t * block_size);
+      uint64_t end = std::min(n_unitigs, begin + block_size);
+      workers.emplace_back(format_rows, begin, end, std::ref(buffers[t]), std::ref(ends[t]));
+    }
+    for (std::size_t t = 0; t < nb_threads; ++t) {
+      workers[t].join();
+      uint64_t utg_id = std::min(n_unitigs, first + t * block_size);
+      for (std::size_t r = 0, start = 0; r < ends[t].size(); start = ends[t][r++], ++utg_id) {
+        row.assign(buffers[t], start, ends[t][r] - start);
+        auto [it, inserted] = ids.try_emplace(row, out.profiles.size());
+        if (inserted) { out.profiles.push_back(row); }
+        out.profile_of[utg_id] = it->second;
+      }
+    }
+  }
+}
+
+
+#endif
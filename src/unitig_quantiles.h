@@ -0,0 +1,81 @@
+#ifndef KM_UNITIG_QUANTILES_H
+#define KM_UNITIG_QUANTILES_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// median and interquartile range of the abundances of the k-mers of each unitig in each sample
+// ("kmat_tools unitig -Q"), which unlike the average are not skewed by a few repeated k-mers
+//
+// they are computed from a fixed sample of at most R k-mers per unitig: all its k-mers when it has
+// at most R of them, otherwise R k-mers evenly spaced along the unitig (chosen from its length only,
+// before reading the matrix). The abundances of the sampled k-mers are kept in min(R, n) slots per
+// unitig of n k-mers and sample, k-mers missing from the matrix counting as zero as for the average,
+// hence at most 4R bytes per unitig and sample.
+
+struct unitig_quantiles {
+
+  // nb_kmers(i) is the number of k-mers of unitig i
+  template <typename SizeOf>
+  unitig_quantiles(std::size_t nb_unitigs, std::size_t nb_samples, std::size_t nb_slots, SizeOf nb_kmers)
+    : m_samples(nb_samples), m_slots(nb_slots), m_offsets(nb_unitigs + 1, 0) {
+    for (std::size_t i = 0; i < nb_unitigs; ++i) {
+      m_offsets[i+1] = m_offsets[i] + std::min<uint64_t>(nb_kmers(i), nb_slots) * nb_samples;
+    }
+    m_counts.assign(m_offsets[nb_unitigs], 0);
+  }
+
+  std::size_t bytes() const { return m_counts.size() * sizeof(uint32_t) + m_offsets.size() * sizeof(uint64_t); }
+
+  // position of the sampled k-mer of slot j in a unitig of n > R k-mers: the middle one of the
+  // j-th of R equal parts of the unitig
+  uint64_t sampled_pos(uint64_t j, uint64_t n) const { return (2*j + 1) * n / (2*m_slots); }
+
+  // slot of the k-mer at position pos of a unitig of n k-mers, or -1 if it is not sampled
+  // (sampled positions are increasing in j and the one equal to pos, if any, is that of
+  // j = floor(pos*R/n) or of the next slot)
+  long slot(uint64_t pos, uint64_t n) const {
+    if (n <= m_slots) { return pos; }
+    for (uint64_t j = pos * m_slots / n; j < m_slots && sampled_pos(j, n) <= pos; ++j) {
+      if (sampled_pos(j, n) == pos) { return (long)j; }
+    }
+    return -1;
+  }
+
+  uint32_t* slots(uint64_t utg_id, std::size_t sample) {
+    return m_counts.data() + m_offsets[utg_id] + sample * width(utg_id);
+  }
+
+  // append ";median;iqr" to the column of a unitig in a sample
+  void append(std::string &buf, uint64_t utg_id, std::size_t sample) const {
+    thread_local std::vector<uint32_t> vals;
+    const uint32_t *begin = m_counts.data() + m_offsets[utg_id] + sample * width(utg_id);
+    vals.assign(begin, begin + width(utg_id));
+    std::sort(vals.begin(), vals.end());
+    // linear interpolation between the closest ranks
+    auto quantile = [&](double q) {
+      double h = q * (vals.size() - 1);
+      std::size_t lo = h;
+      return lo + 1 < vals.size() ? vals[lo] + (h - lo) * ((double)vals[lo+1] - vals[lo]) : (double)vals[lo];
+    };
+    char col[64];
+    int len = snprintf(col, sizeof(col), ";%.2f;%.2f", quantile(0.5), quantile(0.75) - quantile(0.25));
+    buf.append(col, len);
+  }
+
+private:
+  std::size_t width(uint64_t utg_id) const { return m_samples ? (m_offsets[utg_id+1] - m_offsets[utg_id]) / m_samples : 0; }
+
+  std::size_t m_samples;
+  std::size_t m_slots;
+  std::vector<uint64_t> m_offsets; // first slot of each unitig, whose slots are grouped by sample
+  std::vector<uint32_t> m_counts;
+};
+
+
+#endif